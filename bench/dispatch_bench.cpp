@@ -0,0 +1,277 @@
+//
+//  dispatch_bench
+//
+//  Messages per second through the client's receive path for each supported
+//  XNU version, with the run loop specialized for the version's struct
+//  handler (the default) and with every call going through the
+//  NTStatKernelStructHandler interface (the virtual-dispatch build).
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "../src/NetworkStatisticsClientImpl.hpp"
+#include "../include/NTStatTransport.hpp"
+#include "../simulator/NTStatSimStructWriter.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <chrono>
+#include <vector>
+using namespace std;
+
+// request types, same across versions
+
+enum
+{
+  BENCH_ADD_ALL_SRCS  = 1002,
+  BENCH_QUERY_SRC     = 1004,
+  BENCH_GET_SRC_DESC  = 1005,
+  BENCH_GET_UPDATE    = 1007
+};
+
+static double nowNs()
+{
+  return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class CountingListener : public NetworkStatisticsListener
+{
+public:
+  CountingListener() : numEvents(0) {}
+
+  virtual void onStreamAdded(const NTStatStream *stream) { numEvents++; }
+  virtual void onStreamRemoved(const NTStatStream *stream) { numEvents++; }
+  virtual void onStreamStatsUpdate(const NTStatStream *stream) { numEvents++; }
+
+  uint64_t numEvents;
+};
+
+/*
+ * In-memory transport.  Serves a prebuilt script of unsolicited messages in
+ * blocks of SOURCES_PER_BLOCK sources:
+ *   SRC_ADDED for each, COUNTS_ROUNDS rounds of SRC_COUNTS, SRC_REMOVED
+ * and answers requests the way the kernel would (SUCCESS, SRC_DESC,
+ * SRC_COUNTS, SRC_UPDATE).  A block boundary ends the batch, so the
+ * client gets to send between blocks, and the counts wait until the
+ * block's sources are described.  Returns -1 from recvBatch() after
+ * maxMsgs messages, which ends run().
+ */
+class ScriptTransport : public NTStatTransport
+{
+public:
+  enum { SOURCES_PER_BLOCK = 64, COUNTS_ROUNDS = 8, NUM_BLOCKS = 64, MAX_STALLS = 100000 };
+
+  ScriptTransport(unsigned int xnuVersion, NTStatSimStructWriter* writer, uint64_t maxMsgs) :
+    _xnuVersion(xnuVersion), _writer(writer), _isOpen(false), _maxMsgs(maxMsgs), _numMsgs(0),
+    _pos(0), _replyHead(0), _descPending(0), _stalls(0)
+  {
+    memset(&_counts, 0, sizeof(_counts));
+    _buildScript();
+  }
+
+  virtual bool open() { _isOpen = true; return true; }
+  virtual void close() { _isOpen = false; }
+  virtual bool isOpen() { return _isOpen; }
+  virtual unsigned int getXnuVersion() { return _xnuVersion; }
+
+  virtual bool send(const void* msg, size_t msglen)
+  {
+    NTStatSimRequest req;
+    if (!_writer->readRequest((const nstat_msg_hdr*)msg, (int)msglen, req)) return true;
+
+    uint8_t buf[NTSTAT_SIM_MAX_MSG_SIZE];
+    int len = 0;
+
+    if (req.type == BENCH_ADD_ALL_SRCS || req.srcRef == _writer->srcRefAll()) {
+      len = _writer->writeSuccess(buf, req.context, 0);
+    } else if (req.type == BENCH_GET_SRC_DESC) {
+      len = _writer->writeSrcDesc(buf, req.context, req.srcRef, _provider(req.srcRef), _flow(req.srcRef));
+      if (_descPending > 0) _descPending--;
+    } else if (req.type == BENCH_QUERY_SRC) {
+      len = _writer->writeSrcCounts(buf, req.context, req.srcRef, _counts);
+    } else if (req.type == BENCH_GET_UPDATE) {
+      len = _writer->writeSrcUpdate(buf, req.context, req.srcRef, _provider(req.srcRef), _flow(req.srcRef), _counts, 0);
+      if (_descPending > 0) _descPending--;
+    }
+    if (len > 0) _replies.push_back(vector<uint8_t>(buf, buf + len));
+    return true;
+  }
+
+  virtual int recvBatch(NTStatRecvMsg* msgs, int maxMsgs)
+  {
+    if (_numMsgs >= _maxMsgs) return -1;
+
+    int n = 0;
+    while (n < maxMsgs && _replyHead < _replies.size()) {
+      _copy(msgs[n++], &_replies[_replyHead][0], (uint32_t)_replies[_replyHead].size());
+      _replyHead++;
+    }
+    if (_replyHead == _replies.size()) { _replies.clear(); _replyHead = 0; }
+
+    // hold the script while descriptor requests are outstanding
+    // (bounded, in case the client gave up on some)
+
+    if (_descPending > 0 && n == 0 && ++_stalls < MAX_STALLS) return 0;
+    _stalls = 0;
+
+    while (n < maxMsgs) {
+      const Msg &m = _script[_pos];
+      _copy(msgs[n++], &_arena[m.offset], m.length);
+      _pos = (_pos + 1) % _script.size();
+      if (m.endOfBlock) {
+        if (m.isAdded) _descPending = SOURCES_PER_BLOCK;
+        break;
+      }
+    }
+
+    _numMsgs += n;
+    return n;
+  }
+
+  virtual int wait(int timeoutMs) { return 1; }
+  virtual void interrupt() {}
+
+  uint64_t getNumMsgs() const { return _numMsgs; }
+
+private:
+  struct Msg
+  {
+    size_t    offset;
+    uint32_t  length;
+    bool      endOfBlock;
+    bool      isAdded;
+  };
+
+  uint32_t _provider(uint64_t srcRef) { return (srcRef & 1) ? _writer->providerUdp() : _writer->providerTcp(); }
+
+  const NTStatStream& _flow(uint64_t srcRef)
+  {
+    memset(&_stream, 0, sizeof(_stream));
+    _stream.key.ipproto = (srcRef & 1) ? IPPROTO_UDP : IPPROTO_TCP;
+    _stream.key.ifindex = 4;
+    _stream.key.lport = htons(49152 + (uint16_t)(srcRef & 0x3FFF));
+    _stream.key.rport = htons(443);
+    _stream.key.local.addr4.s_addr = htonl(0x0a000002);
+    _stream.key.remote.addr4.s_addr = htonl(0x0b000000 | (uint32_t)(srcRef & 0xffffff));
+    _stream.process.pid = 100 + (uint32_t)(srcRef & 0xFF);
+    strcpy(_stream.process.name, "benchproc");
+    return _stream;
+  }
+
+  void _append(const uint8_t* buf, int len)
+  {
+    Msg m = { _arena.size(), (uint32_t)len, false, false };
+    _arena.insert(_arena.end(), buf, buf + len);
+    _script.push_back(m);
+  }
+
+  void _buildScript()
+  {
+    uint8_t buf[NTSTAT_SIM_MAX_MSG_SIZE];
+    uint64_t firstRef = 1000;
+
+    for (uint32_t b=0; b < NUM_BLOCKS; b++, firstRef += SOURCES_PER_BLOCK)
+    {
+      for (uint32_t i=0; i < SOURCES_PER_BLOCK; i++)
+        _append(buf, _writer->writeSrcAdded(buf, 0, firstRef + i, _provider(firstRef + i)));
+      _script.back().endOfBlock = true;
+      _script.back().isAdded = true;
+
+      for (uint32_t r=0; r < COUNTS_ROUNDS; r++) {
+        for (uint32_t i=0; i < SOURCES_PER_BLOCK; i++) {
+          _counts.rxbytes = 1400 * (r + 1);
+          _counts.rxpackets = r + 1;
+          _append(buf, _writer->writeSrcCounts(buf, 0, firstRef + i, _counts));
+        }
+      }
+
+      for (uint32_t i=0; i < SOURCES_PER_BLOCK; i++)
+        _append(buf, _writer->writeSrcRemoved(buf, 0, firstRef + i));
+      _script.back().endOfBlock = true;
+    }
+  }
+
+  void _copy(NTStatRecvMsg &dest, const uint8_t* data, uint32_t length)
+  {
+    dest.truncated = (length > dest.capacity);
+    if (dest.truncated) length = dest.capacity;
+    memcpy(dest.data, data, length);
+    dest.length = length;
+  }
+
+  unsigned int                  _xnuVersion;
+  NTStatSimStructWriter*        _writer;
+  bool                          _isOpen;
+  uint64_t                      _maxMsgs;
+  uint64_t                      _numMsgs;
+
+  vector<uint8_t>               _arena;
+  vector<Msg>                   _script;
+  size_t                        _pos;
+
+  vector< vector<uint8_t> >     _replies;
+  size_t                        _replyHead;
+  uint32_t                      _descPending;
+  uint32_t                      _stalls;
+
+  NTStatCounters                _counts;
+  NTStatStream                  _stream;
+};
+
+struct Result
+{
+  double    msgsPerSec;
+  uint64_t  events;
+};
+
+static Result runOnce(unsigned int xnuVersion, NTStatSimStructWriter* writer, bool virtualDispatch, uint64_t maxMsgs)
+{
+  CountingListener listener;
+  ntstat_client::NetworkStatisticsClientImpl client(&listener);
+  ScriptTransport* transport = new ScriptTransport(xnuVersion, writer, maxMsgs);
+
+  client.setVirtualDispatch(virtualDispatch);
+  client.connectToTransport(transport);
+  client.configure(true, true, 30);
+
+  double t0 = nowNs();
+  client.run();
+  double seconds = (nowNs() - t0) / 1e9;
+
+  Result r;
+  r.msgsPerSec = transport->getNumMsgs() / seconds;
+  r.events = listener.numEvents;
+  return r;
+}
+
+int main(int argc, char * const argv[])
+{
+  enum { NUM_VERSIONS = 5 };
+  const unsigned int versions[NUM_VERSIONS] = { 2422, 2782, 3248, 3789, 4570 };
+  NTStatSimStructWriter* writers[NUM_VERSIONS] = { NewNTStatSimWriter2422(), NewNTStatSimWriter2782(), NewNTStatSimWriter3248(),
+                                       NewNTStatSimWriter3789(), NewNTStatSimWriter4570() };
+  const uint64_t maxMsgs = 4000000;
+  const int runs = 5;    // best of, to ride out scheduler noise
+
+  Result best[NUM_VERSIONS][2];
+  memset(best, 0, sizeof(best));
+
+  for (int v=0; v < NUM_VERSIONS; v++) {
+    for (int i=0; i < runs; i++) {
+      for (int virt=0; virt < 2; virt++) {
+        Result r = runOnce(versions[v], writers[v], virt != 0, maxMsgs);
+        if (r.msgsPerSec > best[v][virt].msgsPerSec) best[v][virt] = r;
+      }
+    }
+  }
+
+  // the client prints the version as it starts, so report after all runs
+
+  printf("\n%-10s %14s %14s %8s %10s   (msgs/s, best of %d)\n", "xnu", "specialized", "virtual", "gain", "events", runs);
+  for (int v=0; v < NUM_VERSIONS; v++) {
+    printf("%-10u %14.0f %14.0f %7.1f%% %10llu\n", versions[v], best[v][0].msgsPerSec, best[v][1].msgsPerSec,
+           100.0 * (best[v][0].msgsPerSec / best[v][1].msgsPerSec - 1.0), (unsigned long long)best[v][0].events);
+  }
+  return 0;
+}
@@ -0,0 +1,126 @@
+//
+//  keyindex_bench
+//
+//  Flow lookup by NTStatStreamKey: std::map on operator< (what
+//  applications had), std::unordered_map with NTStatStreamKeyHash, and
+//  the NTStatKeyIndex the client uses for getStream().  Half of the
+//  lookups miss.
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "../src/NTStatKeyIndex.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+static double nowNs()
+{
+  return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Flow
+{
+  NTStatStreamKey   key;
+  uint64_t          id;
+};
+
+struct FlowKeyOf
+{
+  const NTStatStreamKey& operator()(const Flow* flow) const { return flow->key; }
+};
+
+/*
+ * Client-like flows: one local address, ephemeral local ports, a few
+ * thousand remotes on 443 and 53.  Every fourth is IPv6.
+ */
+static void makeKey(NTStatStreamKey &key, uint32_t i, uint32_t salt)
+{
+  memset(&key, 0, sizeof(key));
+  key.isV6 = (i % 4 == 3);
+  key.ipproto = (i % 8 == 1 ? IPPROTO_UDP : IPPROTO_TCP);
+  key.ifindex = 4 + (i % 3);
+  key.lport = htons(49152 + ((i * 7 + salt) & 0x3FFF));
+  key.rport = htons(key.ipproto == IPPROTO_UDP ? 53 : 443);
+  if (key.isV6) {
+    key.local.addr6.s6_addr[0] = 0x20;
+    key.local.addr6.s6_addr[15] = 2;
+    key.remote.addr6.s6_addr[0] = 0x26;
+    memcpy(&key.remote.addr6.s6_addr[12], &i, sizeof(i));
+    key.remote.addr6.s6_addr[11] = (uint8_t)salt;
+  } else {
+    key.local.addr4.s_addr = htonl(0x0a000002);
+    key.remote.addr4.s_addr = htonl(0x0b000000 | ((i ^ (salt << 20)) & 0xffffff));
+  }
+}
+
+int main(int argc, char * const argv[])
+{
+  const uint32_t sizes[] = { 256, 4096, 65536 };
+  const uint32_t lookupsPerPass = 1 << 20;
+
+  printf("%-8s %12s %12s %12s   (ns/lookup, half miss)\n", "flows", "std::map", "unordered", "keyindex");
+
+  for (size_t s=0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+  {
+    uint32_t numFlows = sizes[s];
+    vector<Flow> flows(numFlows);
+    vector<NTStatStreamKey> probes(numFlows * 2);
+
+    for (uint32_t i=0; i < numFlows; i++) {
+      makeKey(flows[i].key, i, 0);
+      flows[i].id = i + 1;
+      probes[i * 2] = flows[i].key;
+      makeKey(probes[i * 2 + 1], i, 1);
+    }
+    for (uint32_t i=(uint32_t)probes.size() - 1; i > 0; i--) swap(probes[i], probes[rand() % (i + 1)]);
+
+    map<NTStatStreamKey, Flow*> ordered;
+    unordered_map<NTStatStreamKey, Flow*, NTStatStreamKeyHash> unordered;
+    NTStatKeyIndex<Flow*, FlowKeyOf> index;
+    for (uint32_t i=0; i < numFlows; i++) {
+      ordered[flows[i].key] = &flows[i];
+      unordered[flows[i].key] = &flows[i];
+      index.insert(NTStatKeyHash(flows[i].key), &flows[i]);
+    }
+
+    volatile uint64_t sink = 0;
+    uint64_t found[3] = { 0, 0, 0 };
+    double ns[3];
+    uint32_t mask = (uint32_t)probes.size() - 1;
+
+    double t0 = nowNs();
+    for (uint32_t n=0; n < lookupsPerPass; n++) {
+      map<NTStatStreamKey, Flow*>::iterator it = ordered.find(probes[n & mask]);
+      if (it != ordered.end()) { found[0]++; sink += it->second->id; }
+    }
+    ns[0] = (nowNs() - t0) / lookupsPerPass;
+
+    t0 = nowNs();
+    for (uint32_t n=0; n < lookupsPerPass; n++) {
+      unordered_map<NTStatStreamKey, Flow*, NTStatStreamKeyHash>::iterator it = unordered.find(probes[n & mask]);
+      if (it != unordered.end()) { found[1]++; sink += it->second->id; }
+    }
+    ns[1] = (nowNs() - t0) / lookupsPerPass;
+
+    t0 = nowNs();
+    for (uint32_t n=0; n < lookupsPerPass; n++) {
+      Flow* flow = index.find(probes[n & mask]);
+      if (flow != 0L) { found[2]++; sink += flow->id; }
+    }
+    ns[2] = (nowNs() - t0) / lookupsPerPass;
+
+    printf("%-8u %12.1f %12.1f %12.1f", numFlows, ns[0], ns[1], ns[2]);
+    if (found[0] != found[1] || found[0] != found[2]) printf("   MISMATCH %llu %llu %llu", (unsigned long long)found[0],
+                                                             (unsigned long long)found[1], (unsigned long long)found[2]);
+    printf("\n");
+    (void)sink;
+  }
+  return 0;
+}
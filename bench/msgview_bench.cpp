@@ -0,0 +1,124 @@
+//
+//  msgview_bench
+//
+//  Per-message cost of decoding received messages with the xnu-3789
+//  struct handler: decode() into an NTStatMsgView, then readCounts() or
+//  readSrcDesc() from the view, as _handleResponseMessage does.
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "../src/NTStatKernelStructHandler.hpp"
+#include <uuid/uuid.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../src/ntstat_kernel_3789.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+using namespace std;
+
+NTStatKernelStructHandler* NewNTStatKernel3789();
+
+static double nowNs()
+{
+  return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Msg
+{
+  uint8_t*  data;
+  int       length;
+};
+
+/*
+ * Receive-side mix during a counts refresh: mostly SRC_COUNTS, with a
+ * SRC_DESC (TCP or UDP) every fourth message.
+ */
+static void buildMessages(vector<Msg> &msgs, uint8_t* arena, uint32_t numMsgs, uint32_t slotSize)
+{
+  for (uint32_t i=0; i < numMsgs; i++)
+  {
+    uint8_t* buf = arena + (size_t)i * slotSize;
+    Msg m = { buf, 0 };
+
+    if (i % 4 == 3) {
+      nstat_msg_src_description* msg = (nstat_msg_src_description*)buf;
+      bool isTcp = ((i / 4) % 2 == 0);
+      m.length = sizeof(nstat_msg_src_description) + (isTcp ? sizeof(nstat_tcp_descriptor) : sizeof(nstat_udp_descriptor));
+      memset(buf, 0, m.length);
+      msg->hdr.type = NSTAT_MSG_TYPE_SRC_DESC;
+      msg->hdr.length = m.length;
+      msg->srcref = 1000 + i;
+      msg->provider = (isTcp ? NSTAT_PROVIDER_TCP_KERNEL : NSTAT_PROVIDER_UDP_KERNEL);
+
+      // same leading layout for tcp and udp
+      nstat_tcp_descriptor* desc = (nstat_tcp_descriptor*)msg->data;
+      desc->local.v4.sin_family = AF_INET;
+      desc->local.v4.sin_port = htons(50000 + (i & 0x3FF));
+      desc->remote.v4.sin_port = htons(443);
+      desc->pid = 100 + (i & 0xFF);
+      strcpy(desc->pname, "benchproc");
+    } else {
+      nstat_msg_src_counts* msg = (nstat_msg_src_counts*)buf;
+      m.length = sizeof(nstat_msg_src_counts);
+      memset(buf, 0, m.length);
+      msg->hdr.type = NSTAT_MSG_TYPE_SRC_COUNTS;
+      msg->hdr.length = m.length;
+      msg->srcref = 1000 + i;
+      msg->counts.nstat_rxbytes = i * 1400;
+      msg->counts.nstat_rxpackets = i;
+    }
+    msgs.push_back(m);
+  }
+}
+
+int main(int argc, char * const argv[])
+{
+  const uint32_t numMsgs = 4096;      // about a batch-arena's worth of distinct buffers
+  const uint32_t slotSize = 2048;
+  const int passes = 2000;
+
+  NTStatKernelStructHandler* handler = NewNTStatKernel3789();
+
+  uint8_t* arena = (uint8_t*)calloc(numMsgs, slotSize);
+  vector<Msg> msgs;
+  buildMessages(msgs, arena, numMsgs, slotSize);
+
+  NTStatStream stream;
+  NTStatCounters counts;
+  memset(&counts, 0, sizeof(counts));
+  volatile uint64_t sink = 0;
+  uint64_t numShort = 0;
+
+  double t0 = nowNs();
+  for (int p=0; p < passes; p++)
+  {
+    for (uint32_t i=0; i < numMsgs; i++)
+    {
+      NTStatMsgView view;
+      if (!handler->decode((nstat_msg_hdr*)msgs[i].data, msgs[i].length, view)) { numShort++; continue; }
+
+      switch (view.hdr->type)
+      {
+        case NSTAT_MSG_TYPE_SRC_COUNTS:
+          handler->readCounts(view, counts);
+          sink += counts.rxbytes + view.srcRef;
+          break;
+        case NSTAT_MSG_TYPE_SRC_DESC:
+          if (handler->readSrcDesc(view, &stream)) sink += stream.key.lport + view.srcRef;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+  double ns = (nowNs() - t0) / ((double)passes * numMsgs);
+
+  printf("messages:%u passes:%d  %.1f ns/msg  (short:%llu)\n", numMsgs, passes, ns, (unsigned long long)numShort);
+
+  (void)sink;
+  free(arena);
+  return 0;
+}
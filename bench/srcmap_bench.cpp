@@ -0,0 +1,120 @@
+//
+//  srcmap_bench
+//
+//  Microbenchmark of the srcRef -> source index: std::map (the client's
+//  original index) against NTStatFlatMap, at 10k, 100k and 1M live sources.
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "../src/NTStatFlatMap.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <map>
+#include <vector>
+using namespace std;
+
+// stand-in for NetstatSource*
+
+struct Obj { uint64_t pad[32]; };
+
+static double nowNs()
+{
+  return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// xorshift64*, fixed seed so runs compare
+
+static uint64_t s_rand = 88172645463325252ULL;
+static uint64_t nextRand()
+{
+  s_rand ^= s_rand >> 12;
+  s_rand ^= s_rand << 25;
+  s_rand ^= s_rand >> 27;
+  return s_rand * 2685821657736338717ULL;
+}
+
+struct Result
+{
+  double insertNs;
+  double lookupNs;
+  double churnNs;
+  double iterateNs;
+};
+
+/*
+ * Same workload for both maps, per op:
+ *  insert  : N sequential srcRefs (the kernel hands them out in order)
+ *  lookup  : random live srcRefs, as in _handleResponseMessage
+ *  churn   : remove the oldest source, add a new one (flows closing/opening)
+ *  iterate : full pass, as in the counts refresh and cleanup timers
+ */
+template <typename MAP>
+Result run(MAP &m, uint32_t n, Obj* objs)
+{
+  Result r;
+  const uint32_t numLookups = 2000000;
+  uint64_t base = 1000;
+  volatile uint64_t sink = 0;
+
+  double t0 = nowNs();
+  for (uint32_t i=0; i < n; i++) m[base + i] = &objs[i];
+  r.insertNs = (nowNs() - t0) / n;
+
+  vector<uint64_t> keys(numLookups);
+  for (uint32_t i=0; i < numLookups; i++) keys[i] = base + nextRand() % n;
+
+  t0 = nowNs();
+  for (uint32_t i=0; i < numLookups; i++) {
+    auto it = m.find(keys[i]);
+    if (it != m.end()) sink += it->second->pad[0];
+  }
+  r.lookupNs = (nowNs() - t0) / numLookups;
+
+  uint64_t oldest = base, next = base + n;
+  t0 = nowNs();
+  for (uint32_t i=0; i < numLookups; i++) {
+    auto it = m.find(oldest++);
+    Obj* obj = it->second;
+    m.erase(it);
+    m[next++] = obj;
+  }
+  r.churnNs = (nowNs() - t0) / numLookups;
+
+  const int passes = 10;
+  t0 = nowNs();
+  for (int p=0; p < passes; p++) {
+    for (auto it = m.begin(); it != m.end(); it++) sink += it->second->pad[1];
+  }
+  r.iterateNs = (nowNs() - t0) / ((double)passes * n);
+
+  (void)sink;
+  return r;
+}
+
+int main(int argc, char * const argv[])
+{
+  const uint32_t sizes[] = { 10000, 100000, 1000000 };
+
+  printf("%-10s %-14s %10s %10s %10s %10s   (ns/op)\n", "sources", "map", "insert", "lookup", "churn", "iterate");
+
+  for (uint32_t s=0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+  {
+    uint32_t n = sizes[s];
+    Obj* objs = (Obj*)calloc(n, sizeof(Obj));
+
+    {
+      map<uint64_t, Obj*> m;
+      Result r = run(m, n, objs);
+      printf("%-10u %-14s %10.1f %10.1f %10.1f %10.1f\n", n, "std::map", r.insertNs, r.lookupNs, r.churnNs, r.iterateNs);
+    }
+    {
+      NTStatFlatMap<Obj*> m;
+      Result r = run(m, n, objs);
+      printf("%-10u %-14s %10.1f %10.1f %10.1f %10.1f\n", n, "NTStatFlatMap", r.insertNs, r.lookupNs, r.churnNs, r.iterateNs);
+    }
+
+    free(objs);
+  }
+  return 0;
+}
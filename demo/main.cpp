@@ -30,6 +30,14 @@ class MyNetstatListener : public NetworkStatisticsListener
   {
     log(stream, '#');
   }
+  virtual void onInterfaceStatsUpdate(const NTStatInterface *iface)
+  {
+    printf(" I %s %s (ifindex:%u) bytes (tx/rx):%llu/%llu  packets:%llu/%llu\n", timestr().c_str(), iface->name, iface->ifindex,
+           iface->stats.txbytes, iface->stats.rxbytes, iface->stats.txpackets, iface->stats.rxpackets);
+    if (iface->delta.intervalMs > 0)
+      printf("   rate (tx/rx):%.0f/%.0f bytes/s over %llu ms\n", iface->delta.perSecond.txbytes, iface->delta.perSecond.rxbytes,
+             (unsigned long long)iface->delta.intervalMs);
+  }
 
 
   void log(const NTStatStream* stream, char displayChar)
@@ -57,6 +65,12 @@ class MyNetstatListener : public NetworkStatisticsListener
 
       if (displayChar != '+' && (stream->stats.rxpackets > 0 || stream->stats.txpackets > 0))
         printf("   bytes (tx/rx):%llu/%llu  packets:%llu/%llu %s\n",stream->stats.txbytes, stream->stats.rxbytes, stream->stats.txpackets, stream->stats.rxpackets, medium.c_str());
+
+      // rate since the last report
+
+      if (displayChar == '#' && stream->delta.intervalMs > 0)
+        printf("   rate (tx/rx):%.0f/%.0f bytes/s over %llu ms\n", stream->delta.perSecond.txbytes, stream->delta.perSecond.rxbytes,
+               (unsigned long long)stream->delta.intervalMs);
     }
   }
   
@@ -80,6 +94,9 @@ int main(int argc, const char * argv[])
   bool wantTcp=true, wantUdp=false;
   uint32_t updateIntervalSeconds = 60;
   netstatClient->configure(wantTcp, wantUdp, updateIntervalSeconds);
+
+  // host totals per interface, reported at least every 64 MB
+  netstatClient->setInterfaceStats(true, 64 * 1024 * 1024);
   
   // in a real app, we would want to run this in a dedicated thread
   netstatClient->run();
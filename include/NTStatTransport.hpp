@@ -0,0 +1,97 @@
+//  NTStatTransport.hpp
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#ifndef NTStatTransport_hpp
+#define NTStatTransport_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * NTStatRecvMsg
+ *
+ * One received message.  The caller provides data and capacity, the
+ * transport fills in length and truncated.  A message longer than capacity
+ * is cut to capacity and flagged truncated.
+ */
+struct NTStatRecvMsg
+{
+  uint8_t*    data;
+  uint32_t    capacity;
+  uint32_t    length;
+  bool        truncated;
+};
+
+/*
+ * NTStatTransport
+ *
+ * The message source behind NetworkStatisticsClient.  By default this is the
+ * com.apple.network.statistics kernel control socket, but anything that
+ * preserves message boundaries can stand in for it, so the client can be
+ * driven by a simulator or a recording on hosts without the kernel control.
+ */
+class NTStatTransport
+{
+public:
+  virtual ~NTStatTransport() {}
+
+  /*
+   * Establish the connection.  Returns true on success.
+   */
+  virtual bool open() = 0;
+
+  virtual void close() = 0;
+
+  virtual bool isOpen() = 0;
+
+  /*
+   * XNU version of the peer.  Used to pick the kernel struct layouts.
+   */
+  virtual unsigned int getXnuVersion() = 0;
+
+  /*
+   * Write a single message.  Returns true if the whole message was written.
+   */
+  virtual bool send(const void* msg, size_t msglen) = 0;
+
+  /*
+   * Read up to maxMsgs queued messages into msgs without blocking.
+   * Returns number of messages read, 0 if none available, -1 on error
+   * or if the peer has closed the connection.
+   */
+  virtual int recvBatch(NTStatRecvMsg* msgs, int maxMsgs) = 0;
+
+  /*
+   * Block until a message is available, timeoutMs elapses or interrupt()
+   * is called.  timeoutMs < 0 blocks until one of the others happens.
+   * Returns 1 if readable, 0 on timeout or interrupt, -1 on error.
+   */
+  virtual int wait(int timeoutMs) = 0;
+
+  /*
+   * Size the receive buffer (SO_RCVBUF) of the underlying socket.  Call
+   * after open().  Returns the size granted, or 0 if the transport has no
+   * such buffer or the call failed.
+   */
+  virtual uint32_t setRecvBufferSize(uint32_t) { return 0; }
+
+  /*
+   * Wake up a blocked wait().  Safe to call from any thread.
+   */
+  virtual void interrupt() = 0;
+};
+
+/*
+ * Kernel control socket (PF_SYSTEM).  Only available on Darwin.
+ */
+NTStatTransport* NTStatTransportNewKctl();
+
+/*
+ * AF_UNIX SOCK_SEQPACKET socket.  The first form adopts an already connected
+ * socket (e.g. one end of a socketpair), the second connects to path.
+ * xnuVersion is the version of the struct layouts the peer speaks.
+ */
+NTStatTransport* NTStatTransportNewUnix(int fd, unsigned int xnuVersion);
+NTStatTransport* NTStatTransportNewUnix(const char* path, unsigned int xnuVersion);
+
+#endif /* NTStatTransport_hpp */
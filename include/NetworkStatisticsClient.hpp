@@ -8,6 +8,14 @@
 #include <netinet/in.h>
 
 struct NTStatStream;
+struct NTStatStreamKey;
+struct NTStatInterface;
+struct NTStatProcessStats;
+struct NTStatTopEntry;
+struct NTStatSnapshot;
+struct NTStatClientMetrics;
+struct NTStatFilterConfig;
+class NTStatTransport;
 
 /*
  * NetworkStatisticsListener
@@ -26,6 +34,12 @@ public:
   virtual void onStreamRemoved(const NTStatStream *stream)=0;
 
   virtual void onStreamStatsUpdate(const NTStatStream *stream)=0;
+
+  /*
+   * Interface counters, if enabled with setInterfaceStats().  Not pure,
+   * so listeners that don't use it needn't implement it.
+   */
+  virtual void onInterfaceStatsUpdate(const NTStatInterface * /*iface*/) {}
 };
 
 // this is for testing... you can ignore
@@ -55,11 +69,24 @@ const int NTSTAT_LOGF_DROPS    = (1 << 5);
 class NetworkStatisticsClient : public NTStatClientEmulation
 {
 public:
+  /*
+   * Releases the sources, the connection and the transport.  Call
+   * after run() has returned.
+   */
+  virtual ~NetworkStatisticsClient() {}
+
   /*
    * This should be done before call to run().
    */
   virtual bool connectToKernel() = 0;
 
+  /*
+   * Alternative to connectToKernel(): read messages from transport instead
+   * of the kernel control socket (see NTStatTransport.hpp).  The client
+   * takes ownership of transport.
+   */
+  virtual bool connectToTransport(NTStatTransport* transport) = 0;
+
   /*
    * returns true if connectToKernel() was called and was successful.
    */
@@ -81,6 +108,24 @@ public:
    */
   virtual void configure(bool wantTcp, bool wantUdp, uint32_t updateIntervalSeconds) = 0;
 
+  /*
+   * configure() with source filters (see NTStatFilterConfig).  Filters the
+   * kernel supports are sent with ADD_ALL_SRCS, so unwanted sources never
+   * reach userspace.  Others are applied by the client, so the listener
+   * sees the same streams on every XNU version.
+   */
+  virtual void configure(bool wantTcp, bool wantUdp, uint32_t updateIntervalSeconds,
+                         const NTStatFilterConfig &filter) = 0;
+
+  /*
+   * configure() with filters and the size of the receive buffer (SO_RCVBUF)
+   * on the connection, in bytes.  The kernel drops messages (ENOBUFS) when
+   * it is full, so a larger buffer rides out longer bursts.  0 leaves the
+   * system default.  The size granted is in NTStatClientMetrics.
+   */
+  virtual void configure(bool wantTcp, bool wantUdp, uint32_t updateIntervalSeconds,
+                         const NTStatFilterConfig &filter, uint32_t recvBufferBytes) = 0;
+
   /*
    * Will set the stop flag, so run() will exit.
    */
@@ -98,6 +143,134 @@ public:
    */
   virtual uint32_t getNumDrops() = 0;
 
+  /*
+   * If true, the periodic counts refresh (see configure()) sends a single
+   * QUERY_SRC for all sources instead of one per source, and the SRC_COUNTS
+   * replies are matched back to streams.  From XNU 3248 the kernel sends the
+   * replies in chunks.  Falls back to per-source queries for streams the bulk
+   * query missed, and for good if the kernel rejects it.  Default: false.
+   */
+  virtual void setBulkCountsRefresh(bool enable) = 0;
+
+  /*
+   * Upper bound on requests (GET_SRC_DESC, QUERY_SRC, ...) waiting for a
+   * response.  The client adjusts its window below this (AIMD): additive
+   * increase on clean responses, halved on ENOBUFS.  Default: 64, at most 1024.
+   */
+  virtual void setMaxRequestsInFlight(uint32_t maxInFlight) = 0;
+
+  /*
+   * How long a removed stream is kept, so late messages for its srcRef
+   * still find it.  May be changed while running.  Default: 30000.
+   */
+  virtual void setRemovedStreamRetentionMs(uint32_t ms) = 0;
+
+  /*
+   * A request without a response after this long stops counting against
+   * the request window.  May be changed while running.  Default: 2000.
+   */
+  virtual void setRequestTimeoutMs(uint32_t ms) = 0;
+
+  /*
+   * Number of streams (open, plus removed ones still retained)
+   * expected at once.  Memory for them is reserved up front, so the client
+   * only allocates when the hint is exceeded.  Stream objects are reused
+   * after removal either way.  Optional, call before run().
+   */
+  virtual void setSourceCapacityHint(uint32_t numSources) = 0;
+
+  /*
+   * Copy current metrics into dest.  Safe to call from another thread.
+   * Values are as of the client's last pass through its loop, so may be
+   * slightly stale, and counters may come from two consecutive passes.
+   */
+  virtual void getMetrics(NTStatClientMetrics &dest) = 0;
+
+  /*
+   * Totals for process pid over every stream reported to the listener,
+   * including closed ones, plus current rates and open stream count.
+   * Kept up to date as streams are reported, so this is a lookup, not a
+   * scan.  remoteHosts and remoteEndpoints estimate how many distinct
+   * remotes pid has talked to, in a fixed 2 KB per process.  Returns
+   * false if no stream of pid has been reported.  Not thread-safe: call
+   * from the listener callbacks.
+   */
+  virtual bool getProcessStats(uint32_t pid, NTStatProcessStats &dest) = 0;
+
+  /*
+   * Copy the open stream with key into dest: its process, counters and
+   * latest delta.  Covers streams reported with onStreamAdded() and not yet
+   * removed, and is a hash lookup, not a scan.  If two open streams share
+   * a key, either may be returned.  Returns false if none.  Not
+   * thread-safe: call from the listener callbacks.
+   */
+  virtual bool getStream(const NTStatStreamKey &key, NTStatStream &dest) = 0;
+
+  /*
+   * Also subscribe to each network interface present when run() starts
+   * and report its counters to onInterfaceStatsUpdate(): once it is
+   * described, on every counts refresh (see configure()), and each time
+   * the kernel sees thresholdBytes more traffic on it.  These come from
+   * one kernel source per interface, not from the streams.  thresholdBytes
+   * is raised to NTSTAT_IFNET_THRESHOLD_MIN if below.  Call before run().
+   * Default: off.
+   */
+  virtual void setInterfaceStats(bool enable, uint64_t thresholdBytes) = 0;
+
+  /*
+   * Track heavy hitters over every stream reported to the listener:
+   * processes, remote addresses and remote ports (NTSTAT_TOP_*), by bytes
+   * sent and received and by streams opened (NTSTAT_TOPBY_*), keeping the
+   * top maxEntries of each.  Memory is a few counters per entry, whatever
+   * the number of streams.  Counts may be overestimated, by at most each
+   * entry's error.  Call before run().  Default: 0, off.
+   */
+  virtual void setTopTalkers(uint32_t maxEntries) = 0;
+
+  /*
+   * Copy the top entries of ranking kind (NTSTAT_TOP_*) by (NTSTAT_TOPBY_*)
+   * into dest, largest first.  Returns the number copied, at most
+   * maxEntries.  Costs O(maxEntries) sorting, no scan of the streams.  Not
+   * thread-safe: call from the listener callbacks.
+   */
+  virtual uint32_t getTopTalkers(uint32_t kind, uint32_t by, NTStatTopEntry *dest, uint32_t maxEntries) = 0;
+
+  /*
+   * Every intervalMs, copy the open streams and per-process aggregates
+   * into a snapshot for acquireSnapshot().  Taken on the run() thread
+   * between messages, so each snapshot is consistent.  Call before run().
+   * Default: 0, off.
+   */
+  virtual void setSnapshotInterval(uint32_t intervalMs) = 0;
+
+  /*
+   * Latest snapshot, 0L if none yet.  Safe to call from any thread.  The
+   * snapshot does not change until releaseSnapshot(); neither call locks,
+   * and run() never waits for readers.  While readers hold older
+   * snapshots the client may skip taking new ones (see
+   * NTStatClientMetrics::snapshotsSkipped), so release promptly.  Release
+   * all snapshots before deleting the client.
+   */
+  virtual const NTStatSnapshot* acquireSnapshot() = 0;
+
+  virtual void releaseSnapshot(const NTStatSnapshot* snapshot) = 0;
+
+  /*
+   * Make listener callbacks on a dispatch thread of the client's instead
+   * of the run() thread, so a slow listener doesn't keep the kernel socket
+   * from being read.  Events are copied into a lock-free ring of capacity
+   * entries (rounded up to a power of 2).  When it is full, overflowPolicy
+   * (NTSTAT_OVERFLOW_*) decides what gives; run() never waits.  Order is
+   * kept for events that are delivered.  The ring, and for COALESCE as
+   * many events again held back, is allocated when run() starts.  The
+   * dispatch thread sleeps while there is nothing to deliver.  Events
+   * still held back when run() is stopped are delivered on its thread
+   * before it returns.  getProcessStats(), getStream() and
+   * getTopTalkers() are then not safe from callbacks: use
+   * acquireSnapshot().  Call before run().  Default: 0, synchronous.
+   */
+  virtual void setAsyncDispatch(uint32_t capacity, uint32_t overflowPolicy) = 0;
+
 };
 
 // Instantiate (singleton) the NetworkStatisticsClient
@@ -126,6 +299,38 @@ struct NTStatCounters
   uint64_t wired_txbytes;
 };
 
+/*
+ * NTStatCounters fields, per second.
+ */
+struct NTStatRates
+{
+  double rxpackets;
+  double txpackets;
+  double rxbytes;
+  double txbytes;
+
+  double cell_rxbytes;
+  double cell_txbytes;
+  double wifi_rxbytes;
+  double wifi_txbytes;
+  double wired_rxbytes;
+  double wired_txbytes;
+};
+
+/*
+ * Change in stats since the stream was last reported to the listener
+ * (onStreamAdded or onStreamStatsUpdate), and the rates over that
+ * interval.  Valid in onStreamStatsUpdate and, as the final delta, in
+ * onStreamRemoved.  Intervals are measured with a monotonic clock.  A
+ * counter that went backwards counts as 0.
+ */
+struct NTStatStreamDelta
+{
+  uint64_t        intervalMs;   // since last report.  0: rates are 0
+  NTStatCounters  counts;       // stats minus stats at last report
+  NTStatRates     perSecond;    // counts over intervalMs
+};
+
 struct NTStatStreamState
 {
   uint32_t state;      // TCPS_LISTEN, TCPS_SYN_SENT, etc.
@@ -145,6 +350,15 @@ struct NTStatStreamKey
   addr_t      remote;
 
   bool operator<(const NTStatStreamKey& b) const; // needed to be a key type for std::map
+  bool operator==(const NTStatStreamKey& b) const; // ignores pad, and unused address bytes
+  uint64_t hash() const;                           // 64-bit, equal keys hash the same
+};
+
+// for std::unordered_map<NTStatStreamKey, ..., NTStatStreamKeyHash>
+
+struct NTStatStreamKeyHash
+{
+  size_t operator()(const NTStatStreamKey& key) const { return (size_t)key.hash(); }
 };
 
 struct NTStatProcess
@@ -163,20 +377,161 @@ struct NTStatStream
   // these get updated
   NTStatCounters     stats;
   NTStatStreamState  states;
+  NTStatStreamDelta  delta;  // stats change since last callback, so no need to keep a copy
+
+};
+
+/*
+ * NTStatProcessStats
+ *
+ * Per-process aggregate.  See NetworkStatisticsClient::getProcessStats()
+ */
+struct NTStatProcessStats
+{
+  NTStatProcess   process;
+  uint32_t        activeStreams;    // open now
+  uint64_t        totalStreams;     // ever reported
+  NTStatCounters  totals;           // open streams so far, plus closed streams' final counters
+  NTStatRates     perSecond;        // sum of open streams' latest rates
+  uint32_t        remoteHosts;      // distinct remote addresses ever connected to, estimated (~3%)
+  uint32_t        remoteEndpoints;  // distinct remote address, protocol and port, estimated (~3%)
+};
+
+/*
+ * NTStatTopEntry
+ *
+ * One heavy hitter.  See NetworkStatisticsClient::getTopTalkers()
+ */
+struct NTStatTopEntry
+{
+  uint64_t        count;    // bytes (rx + tx) or streams, by the ranking
+  uint64_t        error;    // count may be over by this much, 0 if exact
+
+  NTStatProcess   process;  // NTSTAT_TOP_PROCESS
+  uint8_t         isV6;     // NTSTAT_TOP_REMOTE_ADDR
+  uint8_t         ipproto;  // NTSTAT_TOP_REMOTE_PORT
+  uint16_t        port;     // NTSTAT_TOP_REMOTE_PORT (network-endian)
+  addr_t          addr;     // NTSTAT_TOP_REMOTE_ADDR
+};
+
+const uint32_t NTSTAT_TOP_PROCESS      = 0;
+const uint32_t NTSTAT_TOP_REMOTE_ADDR  = 1;
+const uint32_t NTSTAT_TOP_REMOTE_PORT  = 2;
+const uint32_t NTSTAT_TOP_NUM_KINDS    = 3;
+
+const uint32_t NTSTAT_TOPBY_BYTES      = 0;
+const uint32_t NTSTAT_TOPBY_STREAMS    = 1;
 
+/*
+ * NTStatSnapshot
+ *
+ * Copy of the client's state at one moment.  See
+ * NetworkStatisticsClient::acquireSnapshot()
+ */
+struct NTStatSnapshot
+{
+  uint64_t                    sequence;       // 1 for the first snapshot, then +1 each
+  uint64_t                    timestampMs;    // when taken, monotonic clock (not wall time)
+
+  const NTStatStream*         streams;        // open streams reported to the listener
+  uint32_t                    numStreams;
+  const NTStatProcessStats*   processes;      // every process with a reported stream, see getProcessStats()
+  uint32_t                    numProcesses;
 };
 
 /*
-#include <string>
+ * Overflow policies for setAsyncDispatch().  Dropped events are counted
+ * in NTStatClientMetrics::eventsDropped.  A stream's add may be dropped
+ * while its updates or removal are delivered.
+ */
+const uint32_t NTSTAT_OVERFLOW_DROP_NEWEST = 0;   // drop the event that doesn't fit
+const uint32_t NTSTAT_OVERFLOW_DROP_OLDEST = 1;   // drop the oldest undelivered event to make room
+const uint32_t NTSTAT_OVERFLOW_COALESCE    = 2;   // hold events back, up to capacity more, and fold each
+                                                  // stream's updates into one, deltas summed
+
+/*
+ * NTStatClientMetrics
+ *
+ * Client internals, for monitoring.  See NetworkStatisticsClient::getMetrics()
+ */
+struct NTStatClientMetrics
+{
+  uint32_t    requestWindow;        // current AIMD window (max requests in flight)
+  uint32_t    requestsInFlight;
+  uint64_t    requestsSent;
+  uint64_t    windowIncreases;      // additive increase steps
+  uint64_t    windowDecreases;      // multiplicative decreases, one per ENOBUFS episode
+  uint64_t    requestTimeouts;      // requests that never got a response
+  uint64_t    requestRetries;       // GET_SRC_DESC / QUERY_SRC requeued after ENOBUFS
+  uint64_t    bulkQueries;          // QUERY_SRC for all sources, including continuations
+  uint64_t    bulkFallbacks;        // bulk refreshes that left streams to per-source queries
+  uint64_t    sourcesFiltered;      // dropped by the client part of NTStatFilterConfig
+  uint64_t    msgsTruncated;        // received messages longer than the receive buffer, dropped
+  uint32_t    sourcesTracked;       // streams in memory, including recently removed
+  uint32_t    recvBufferBytes;      // SO_RCVBUF granted, 0 if not configured
+  uint64_t    snapshotsTaken;       // see setSnapshotInterval()
+  uint64_t    snapshotsSkipped;     // due, but readers held every free buffer
+  uint64_t    eventsDropped;        // listener events lost to a full ring, see setAsyncDispatch()
+  uint64_t    eventsCoalesced;      // updates folded into one already waiting
+  uint64_t    sendFailures;         // requests the transport failed to send, retried
+};
+
+/*
+ * Interface types for NTStatFilterConfig::acceptInterfaces.
+ */
+const uint32_t NTSTAT_IFTYPE_UNKNOWN   = (1 << 0);
+const uint32_t NTSTAT_IFTYPE_LOOPBACK  = (1 << 1);
+const uint32_t NTSTAT_IFTYPE_CELLULAR  = (1 << 2);
+const uint32_t NTSTAT_IFTYPE_WIFI      = (1 << 3);
+const uint32_t NTSTAT_IFTYPE_WIRED     = (1 << 4);
+const uint32_t NTSTAT_IFTYPE_ALL       = 0x1F;
+
+/*
+ * NTStatFilterConfig
+ *
+ * Source filters for configure().  Defaults accept everything.
+ *
+ * Kernel support, by XNU version:
+ *   2422, 2782 : none, all applied by the client
+ *   3248       : acceptInterfaces, skipListeners, skipZeroBytes
+ *   3789+      : all
+ * When applied by the client, acceptInterfaces can only tell loopback
+ * (by address) from the rest, and skipZeroBytes only suppresses
+ * stats updates.  acceptInterfaces must have at least one type set;
+ * configure() replaces an empty mask with NTSTAT_IFTYPE_ALL.
+ */
+struct NTStatFilterConfig
+{
+  NTStatFilterConfig() : acceptInterfaces(NTSTAT_IFTYPE_ALL), skipListeners(false),
+    skipZeroBytes(false), pid(0) {}
+
+  uint32_t    acceptInterfaces;   // NTSTAT_IFTYPE_ mask
+  bool        skipListeners;      // TCP sockets in LISTEN state
+  bool        skipZeroBytes;      // sources that have not sent or received anything
+  uint32_t    pid;                // only sources of this process. 0 for all.
+};
+
+/*
+ * NTStatInterface
+ *
+ * A network interface and the counters for all traffic on it.
+ * See NetworkStatisticsClient::setInterfaceStats()
+ */
 struct NTStatInterface
 {
-  std::string                     name;
-  uint32_t                        ifindex;
-  uint64_t                        threshold;
-  unsigned int                    type;
-  std::string                     description;
+  uint32_t           ifindex;
+  uint32_t           type;              // IFT_ETHER, IFT_CELLULAR, ... (net/if_types.h)
+  uint64_t           threshold;         // bytes between kernel-initiated reports
+  char               name[32];          // "en0"
+  char               description[128];
+
+  NTStatCounters     stats;             // since the interface attached.  Packets and bytes only
+  NTStatStreamDelta  delta;             // since last onInterfaceStatsUpdate.  0 on the first
 };
-*/
+
+// the kernel rejects interface sources with a lower threshold
+
+const uint64_t NTSTAT_IFNET_THRESHOLD_MIN = 1024 * 1024;
 
 // convenience macros
 
@@ -0,0 +1,671 @@
+//
+//  selfcheck
+//
+//  Checks the client's containers on the paths the simulator rarely
+//  reaches: slab growth and recycling, flat map erase across the end of
+//  the table, timer wheel cascades and rescheduling, top-K eviction,
+//  HyperLogLog accuracy on structured input, snapshot acquire and
+//  release, event ring overflow.  Prints each failed check and exits 1
+//  if there were any.
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "../src/NTStatSlabPool.hpp"
+#include "../src/NTStatFlatMap.hpp"
+#include "../src/NTStatTimerWheel.hpp"
+#include "../src/NTStatTopK.hpp"
+#include "../src/NTStatHyperLogLog.hpp"
+#include "../src/NTStatKeyHash.hpp"
+#include "../src/NTStatSnapshot.hpp"
+#include "../src/NTStatEventRing.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+using namespace std;
+
+static int numChecks = 0;
+static int numFailed = 0;
+
+#define CHECK(cond) do {                                          \
+  numChecks++;                                                    \
+  if (!(cond)) {                                                  \
+    printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond);        \
+    numFailed++;                                                  \
+  }                                                               \
+} while (0)
+
+//----------------------------------------------------------
+// NTStatSlabPool: free() destructs, slots are recycled with
+// a new generation, reserve() grows whole slabs up front.
+//----------------------------------------------------------
+struct Counted
+{
+  Counted(int v) : value(v) { live++; }
+  ~Counted() { live--; }
+
+  int         value;
+  static int  live;
+};
+int Counted::live = 0;
+
+typedef NTStatSlabPool<Counted, 4> CountedPool;
+
+static void checkSlabPool()
+{
+  CountedPool pool;
+  CHECK(pool.size() == 0 && pool.capacity() == 0);
+
+  // grows a slab at a time
+
+  vector<Counted*> objs;
+  for (int i=0; i < 9; i++) objs.push_back(pool.alloc(i));
+  CHECK(pool.size() == 9);
+  CHECK(pool.capacity() == 12);
+  CHECK(Counted::live == 9);
+  for (int i=0; i < 9; i++) CHECK(objs[i]->value == i);
+
+  // free destructs and bumps the generation; the slot is reused next
+
+  Counted* victim = objs[5];
+  uint32_t gen = CountedPool::generation(victim);
+  pool.free(victim);
+  CHECK(Counted::live == 8);
+  CHECK(pool.size() == 8);
+  CHECK(CountedPool::generation(victim) == gen + 1);
+
+  Counted* reused = pool.alloc(100);
+  CHECK(reused == victim);
+  CHECK(reused->value == 100);
+  CHECK(CountedPool::generation(reused) == gen + 1);
+  objs[5] = reused;
+
+  pool.free(0L);
+  CHECK(pool.size() == 9);
+
+  // reserve() rounds up to slabs, then alloc() stays within them
+
+  pool.reserve(20);
+  CHECK(pool.capacity() == 20);
+  for (int i=9; i < 20; i++) objs.push_back(pool.alloc(i));
+  CHECK(pool.capacity() == 20);
+  CHECK(pool.size() == 20);
+
+  for (size_t i=0; i < objs.size(); i++) pool.free(objs[i]);
+  CHECK(pool.size() == 0);
+  CHECK(Counted::live == 0);
+}
+
+//----------------------------------------------------------
+// NTStatFlatMap: backward-shift erase, including probe runs
+// that wrap from the last slot to the first.
+//----------------------------------------------------------
+
+// same as NTStatFlatMap::_hash, to pick keys by home slot
+static uint32_t homeSlot(uint64_t key, uint32_t capacity)
+{
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+static vector<uint64_t> keysWithHome(uint32_t home, uint32_t capacity, int count)
+{
+  vector<uint64_t> keys;
+  for (uint64_t key=1; (int)keys.size() < count; key++) {
+    if (homeSlot(key, capacity) == home) keys.push_back(key);
+  }
+  return keys;
+}
+
+static bool findsAll(const NTStatFlatMap<uint64_t> &fm, const vector<uint64_t> &keys)
+{
+  for (size_t i=0; i < keys.size(); i++) {
+    NTStatFlatMap<uint64_t>::iterator it = fm.find(keys[i]);
+    if (it == fm.end() || it->second != keys[i] * 10) return false;
+  }
+  return true;
+}
+
+static void checkFlatMap()
+{
+  const uint32_t capacity = 16;
+
+  // three keys homed at the last slot fill 15, 0, 1.  A key homed at
+  // 0 lands in 2.  Erasing from the head of the run must shift each
+  // back across the end of the table without moving one before its home.
+
+  vector<uint64_t> last = keysWithHome(capacity - 1, capacity, 3);
+  vector<uint64_t> first = keysWithHome(0, capacity, 1);
+
+  NTStatFlatMap<uint64_t> fm;
+  for (size_t i=0; i < last.size(); i++) fm[last[i]] = last[i] * 10;
+  fm[first[0]] = first[0] * 10;
+  CHECK(fm.capacity() == capacity);
+  CHECK(fm.size() == 4);
+
+  CHECK(fm.erase(last[0]) == 1);
+  CHECK(fm.size() == 3);
+  CHECK(fm.find(last[0]) == fm.end());
+  vector<uint64_t> rest;
+  rest.push_back(last[1]); rest.push_back(last[2]); rest.push_back(first[0]);
+  CHECK(findsAll(fm, rest));
+
+  // erase in the middle of the wrapped run, then the key homed at 0
+
+  CHECK(fm.erase(last[2]) == 1);
+  rest.clear(); rest.push_back(last[1]); rest.push_back(first[0]);
+  CHECK(findsAll(fm, rest));
+  CHECK(fm.erase(first[0]) == 1);
+  CHECK(fm.erase(first[0]) == 0);
+  rest.pop_back();
+  CHECK(findsAll(fm, rest));
+  CHECK(fm.size() == 1);
+
+  // it = erase(it) over a wrapped run visits every entry once
+
+  fm.clear();
+  vector<uint64_t> all = keysWithHome(capacity - 2, capacity, 4);
+  vector<uint64_t> more = keysWithHome(1, capacity, 2);
+  all.insert(all.end(), more.begin(), more.end());
+  for (size_t i=0; i < all.size(); i++) fm[all[i]] = all[i] * 10;
+
+  map<uint64_t, int> visits;
+  for (NTStatFlatMap<uint64_t>::iterator it = fm.begin(); it != fm.end(); ) {
+    visits[it->first]++;
+    if (it->first % 2) it = fm.erase(it);
+    else ++it;
+  }
+  CHECK(visits.size() == all.size());
+  bool once = true;
+  for (map<uint64_t, int>::iterator it = visits.begin(); it != visits.end(); it++) once = once && (it->second == 1);
+  CHECK(once);
+  for (size_t i=0; i < all.size(); i++) CHECK(fm.count(all[i]) == (all[i] % 2 ? 0u : 1u));
+
+  // random inserts and erases over a small key space, against std::map
+
+  NTStatFlatMap<uint64_t> rm;
+  map<uint64_t, uint64_t> ref;
+  srand(1);
+  bool same = true;
+  for (int op=0; op < 200000 && same; op++) {
+    uint64_t key = 1 + rand() % 48;
+    if (rand() % 2) { rm[key] = key * 10; ref[key] = key * 10; }
+    else same = (rm.erase(key) == ref.erase(key));
+
+    if (op % 64 == 0) {
+      same = (rm.size() == ref.size());
+      for (uint64_t k=1; k <= 48 && same; k++) {
+        NTStatFlatMap<uint64_t>::iterator it = rm.find(k);
+        same = (ref.count(k) ? (it != rm.end() && it->second == k * 10) : it == rm.end());
+      }
+      uint32_t n = 0;
+      for (NTStatFlatMap<uint64_t>::iterator it = rm.begin(); it != rm.end(); ++it) n++;
+      same = same && (n == ref.size());
+    }
+  }
+  CHECK(same);
+}
+
+//----------------------------------------------------------
+// NTStatTimerWheel: items in every level fire on their tick,
+// not before, after cascading down.  fn may reschedule.
+//----------------------------------------------------------
+static void checkTimerWheel()
+{
+  const uint32_t tickMs = 10;
+
+  // level 0 spans 64 ticks (640 ms), level 1 4096 (40.96 s), level 2
+  // 262144 (43.7 min).  Deadlines on each side of those boundaries.
+
+  const uint64_t deadlines[] = { 5, 10, 630, 639, 640, 641, 650, 40950, 40960, 40970,
+                                 123456, 2621430, 2621440, 2621450, 9000000 };
+  const uint32_t n = sizeof(deadlines) / sizeof(deadlines[0]);
+
+  NTStatTimerWheel<uint32_t> wheel(tickMs);
+  wheel.reset(0);
+  for (uint32_t i=0; i < n; i++) wheel.schedule(deadlines[i], i);
+  CHECK(wheel.size() == n);
+  CHECK(wheel.msUntilNext(0) == 10);
+
+  vector<uint64_t> firedAt(n, 0);
+  vector<int> fireCount(n, 0);
+  for (uint64_t nowMs = tickMs; nowMs <= deadlines[n - 1] + tickMs; nowMs += tickMs) {
+    wheel.advance(nowMs, [&](uint32_t id) { firedAt[id] = nowMs; fireCount[id]++; });
+  }
+  bool onTime = true;
+  for (uint32_t i=0; i < n; i++) {
+    uint64_t dueMs = (deadlines[i] + tickMs - 1) / tickMs * tickMs;
+    if (fireCount[i] != 1 || firedAt[i] != dueMs) {
+      printf("  deadline %llu fired %d times, at %llu\n", (unsigned long long)deadlines[i], fireCount[i],
+             (unsigned long long)firedAt[i]);
+      onTime = false;
+    }
+  }
+  CHECK(onTime);
+  CHECK(wheel.empty());
+  CHECK(wheel.msUntilNext(deadlines[n - 1]) == -1);
+
+  // msUntilNext is exact in level 0, else the next level 1 cascade
+
+  wheel.reset(0);
+  wheel.schedule(250, 0);
+  CHECK(wheel.msUntilNext(0) == 250);
+  wheel.reset(0);
+  wheel.schedule(5000, 0);
+  CHECK(wheel.msUntilNext(0) == 640);
+  CHECK(wheel.msUntilNext(100) == 540);
+
+  // beyond the top level (64^4 ticks) is parked, then placed again
+
+  NTStatTimerWheel<uint32_t> far(1);
+  far.reset(0);
+  const uint64_t farMs = 20000000;
+  far.schedule(farMs, 7);
+  uint64_t farFiredAt = 0;
+  far.advance(farMs - 1, [&](uint32_t) { farFiredAt = 1; });
+  CHECK(farFiredAt == 0);
+  CHECK(far.size() == 1);
+  far.advance(farMs, [&](uint32_t) { farFiredAt = farMs; });
+  CHECK(farFiredAt == farMs);
+  CHECK(far.empty());
+
+  // rescheduling from fn, as the client does when a deadline moved:
+  // into level 1 from the slot firing, and an already due item, which
+  // fires on the next tick.  The clock doesn't start at 0.
+
+  const uint64_t baseMs = 123456780;
+  wheel.reset(baseMs);
+  wheel.schedule(baseMs + 100, 1);
+  vector<uint64_t> fired;
+  for (uint64_t nowMs = baseMs + tickMs; nowMs <= baseMs + 2000; nowMs += tickMs) {
+    wheel.advance(nowMs, [&](uint32_t id) {
+      fired.push_back(id);
+      fired.push_back(nowMs - baseMs);
+      if (id == 1 && fired.size() == 2) {
+        wheel.schedule(nowMs + 1000, 1);
+        wheel.schedule(nowMs - 50, 2);
+      }
+    });
+  }
+  const uint64_t expect[] = { 1, 100, 2, 110, 1, 1100 };
+  CHECK(fired.size() == 6 && 0 == memcmp(&fired[0], expect, sizeof(expect)));
+  CHECK(wheel.empty());
+}
+
+//----------------------------------------------------------
+// NTStatTopK: exact until full, then evictions inherit the
+// smallest count as error, and heavy hitters are never lost.
+// Labels stay with their counter as the heap moves.
+//----------------------------------------------------------
+static void checkTopK()
+{
+  typedef NTStatTopK<uint64_t> TopK;
+  TopK topk;
+  topk.reset(4);
+
+  // up to capacity: exact, labels filled once per key
+
+  uint64_t* label = topk.add(1, 10);
+  CHECK(label != 0L);
+  if (label) *label = 1;
+  CHECK(topk.add(1, 5) == 0L);
+  const uint64_t weights[] = { 0, 15, 3, 7, 1 };
+  for (uint64_t key=2; key <= 4; key++) {
+    label = topk.add(key, weights[key]);
+    if (label) *label = key;
+  }
+  CHECK(topk.add(0, 5) == 0L && topk.add(5, 0) == 0L);
+  CHECK(topk.size() == 4);
+
+  TopK::Counter top[8];
+  uint32_t n = topk.top(top, 8);
+  CHECK(n == 4);
+  CHECK(top[0].key == 1 && top[0].count == 15 && top[0].error == 0);
+  CHECK(top[1].key == 3 && top[1].count == 7);
+  CHECK(top[2].key == 2 && top[2].count == 3);
+  CHECK(top[3].key == 4 && top[3].count == 1);
+  bool labelled = true;
+  for (uint32_t i=0; i < n; i++) labelled = labelled && (top[i].item == top[i].key);
+  CHECK(labelled);
+
+  // a fifth key takes over the smallest counter (4, count 1)
+
+  label = topk.add(5, 2);
+  CHECK(label != 0L);
+  if (label) *label = 5;
+  n = topk.top(top, 8);
+  CHECK(n == 4);
+  CHECK(top[2].key == 5 && top[2].count == 3 && top[2].error == 1);
+  CHECK(top[3].key == 2 && top[3].count == 3 && top[3].error == 0);
+  CHECK(topk.top(top, 2) == 2 && top[0].key == 1 && top[1].key == 3);
+
+  // a skewed stream: keys over total / capacity are always counted,
+  // and every count - error <= true total <= count
+
+  const uint32_t capacity = 32;
+  topk.reset(capacity);
+  map<uint64_t, uint64_t> truth;
+  uint64_t total = 0;
+  srand(2);
+  for (int i=0; i < 200000; i++) {
+    uint64_t key = (i % 3 == 0 ? 1 + rand() % 4 : 5 + rand() % 5000);
+    uint64_t weight = 1 + rand() % 1400;
+    truth[key] += weight;
+    total += weight;
+    label = topk.add(key, weight);
+    if (label) *label = key;
+  }
+
+  vector<TopK::Counter> all(capacity);
+  n = topk.top(&all[0], capacity);
+  CHECK(n == capacity);
+  bool bounded = true, sorted = true;
+  labelled = true;
+  for (uint32_t i=0; i < n; i++) {
+    uint64_t t = truth[all[i].key];
+    bounded = bounded && (all[i].count >= t && all[i].count - all[i].error <= t);
+    sorted = sorted && (i == 0 || all[i - 1].count >= all[i].count);
+    labelled = labelled && (all[i].item == all[i].key);
+  }
+  CHECK(bounded);
+  CHECK(sorted);
+  CHECK(labelled);
+
+  bool heavyKept = true;
+  for (map<uint64_t, uint64_t>::iterator it = truth.begin(); it != truth.end(); it++) {
+    if (it->second <= total / capacity) continue;
+    bool found = false;
+    for (uint32_t i=0; i < n; i++) found = found || (all[i].key == it->first);
+    heavyKept = heavyKept && found;
+  }
+  CHECK(heavyKept);
+  CHECK(all[0].key >= 1 && all[0].key <= 4);
+}
+
+//----------------------------------------------------------
+// NTStatHyperLogLog: fed NTStatRemoteHash of sequential
+// addresses, as the process table does.  Within 1 + 10% for
+// small counts (linear counting), 4 standard errors above.
+//----------------------------------------------------------
+static void remoteKey(NTStatStreamKey &key, uint32_t i, uint16_t port)
+{
+  memset(&key, 0, sizeof(key));
+  key.ipproto = IPPROTO_TCP;
+  key.isV6 = (i % 4 == 3);
+  key.rport = htons(port);
+  if (key.isV6) {
+    key.remote.addr6.s6_addr[0] = 0x26;
+    memcpy(&key.remote.addr6.s6_addr[12], &i, sizeof(i));
+  } else {
+    key.remote.addr4.s_addr = htonl(0x0b000000 + i);
+  }
+}
+
+static void checkHyperLogLog()
+{
+  NTStatHyperLogLog hll;
+  CHECK(hll.estimate() == 0);
+
+  const uint32_t counts[] = { 1, 10, 100, 1000, 2560, 5000, 20000, 100000, 1000000 };
+  NTStatStreamKey key;
+  uint32_t added = 0;
+  bool close = true;
+  for (size_t c=0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    for (; added < counts[c]; added++) {
+      remoteKey(key, added, 443);
+      hll.add(NTStatRemoteHash(key, false));
+    }
+    double estimate = (double)hll.estimate();
+    double allowed = (added < 1000 ? 1 + added * 0.1 : added * 4 * 0.033);
+    if (fabs(estimate - added) > allowed) {
+      printf("  %u distinct, estimate %.0f\n", added, estimate);
+      close = false;
+    }
+  }
+  CHECK(close);
+
+  // adding again changes nothing
+
+  uint64_t before = hll.estimate();
+  for (uint32_t i=0; i < 1000; i++) {
+    remoteKey(key, i, 443);
+    hll.add(NTStatRemoteHash(key, false));
+  }
+  CHECK(hll.estimate() == before);
+
+  // one host on many ports: one host, many endpoints
+
+  NTStatHyperLogLog hosts, endpoints;
+  for (uint32_t port=1; port <= 3000; port++) {
+    remoteKey(key, 7, (uint16_t)port);
+    hosts.add(NTStatRemoteHash(key, false));
+    endpoints.add(NTStatRemoteHash(key, true));
+  }
+  CHECK(hosts.estimate() == 1);
+  CHECK(fabs((double)endpoints.estimate() - 3000) < 3000 * 4 * 0.033);
+
+  hll.clear();
+  CHECK(hll.estimate() == 0);
+}
+
+//----------------------------------------------------------
+// NTStatSnapshotPublisher: a held snapshot is never rewritten,
+// the writer skips when readers hold every spare buffer, and
+// concurrent readers only ever see whole snapshots.
+//----------------------------------------------------------
+
+// snapshot seq: seq % 7 streams, each with id seq
+static bool writeSnapshot(NTStatSnapshotPublisher &publisher, uint64_t seq)
+{
+  NTStatSnapshotBuffer* buffer = publisher.beginWrite();
+  if (0L == buffer) return false;
+  buffer->sequence = seq;
+  buffer->streamData.assign(seq % 7, NTStatStream());
+  for (size_t i=0; i < buffer->streamData.size(); i++) buffer->streamData[i].id = seq;
+  publisher.publish(buffer);
+  return true;
+}
+
+static bool isWhole(const NTStatSnapshot* snap)
+{
+  if (snap->numStreams != snap->sequence % 7) return false;
+  for (uint32_t i=0; i < snap->numStreams; i++) {
+    if (snap->streams[i].id != snap->sequence) return false;
+  }
+  return true;
+}
+
+static void checkSnapshot()
+{
+  NTStatSnapshotPublisher publisher;
+  CHECK(publisher.acquire() == 0L);
+
+  CHECK(writeSnapshot(publisher, 1));
+  const NTStatSnapshot* first = publisher.acquire();
+  CHECK(first != 0L && first->sequence == 1 && isWhole(first));
+
+  // hold one snapshot per publish until only the current buffer is free
+
+  const NTStatSnapshot* held[NTStatSnapshotPublisher::MAX_BUFFERS];
+  held[0] = first;
+  for (uint64_t seq=2; seq <= NTStatSnapshotPublisher::MAX_BUFFERS; seq++) {
+    CHECK(writeSnapshot(publisher, seq));
+    held[seq - 1] = publisher.acquire();
+  }
+  CHECK(!writeSnapshot(publisher, 99));
+
+  bool intact = true;
+  for (int i=0; i < NTStatSnapshotPublisher::MAX_BUFFERS; i++) {
+    intact = intact && held[i] != 0L && held[i]->sequence == (uint64_t)i + 1 && isWhole(held[i]);
+  }
+  CHECK(intact);
+
+  // the current one is held twice; one release leaves it current and held
+
+  const NTStatSnapshot* again = publisher.acquire();
+  CHECK(again == held[NTStatSnapshotPublisher::MAX_BUFFERS - 1]);
+  publisher.release(again);
+  publisher.release(0L);
+  CHECK(!writeSnapshot(publisher, 99));
+
+  // releasing an old one frees exactly that buffer
+
+  publisher.release(held[0]);
+  CHECK(writeSnapshot(publisher, 100));
+  const NTStatSnapshot* latest = publisher.acquire();
+  CHECK(latest == held[0] && latest->sequence == 100 && isWhole(latest));
+  CHECK(!writeSnapshot(publisher, 101));
+  publisher.release(latest);
+  for (int i=1; i < NTStatSnapshotPublisher::MAX_BUFFERS; i++) publisher.release(held[i]);
+
+  // writer and readers on their own threads
+
+  const uint64_t numWrites = 200000;
+  std::atomic<bool> done(false);
+  std::atomic<uint32_t> torn(0), backwards(0);
+  vector<thread> readers;
+  for (int r=0; r < 3; r++) {
+    readers.push_back(thread([&]() {
+      uint64_t lastSeq = 0;
+      while (!done.load()) {
+        const NTStatSnapshot* snap = publisher.acquire();
+        if (0L == snap) continue;
+        if (!isWhole(snap)) torn++;
+        if (snap->sequence < lastSeq) backwards++;
+        lastSeq = snap->sequence;
+        publisher.release(snap);
+      }
+    }));
+  }
+  uint64_t published = 0;
+  for (uint64_t seq=200; seq < 200 + numWrites; seq++) {
+    if (writeSnapshot(publisher, seq)) published++;
+  }
+  done = true;
+  for (size_t r=0; r < readers.size(); r++) readers[r].join();
+
+  CHECK(torn.load() == 0);
+  CHECK(backwards.load() == 0);
+  CHECK(published > 0);
+}
+
+//----------------------------------------------------------
+// NTStatEventRing overflow.  A full ring refuses a push and is
+// left as it was (what the client's COALESCE backlog waits
+// behind), or drops its oldest entries (DROP_OLDEST).  With a
+// concurrent consumer, entries come out in order, once, and
+// every one pushed is delivered, dropped or refused.
+//----------------------------------------------------------
+static void drainRing(NTStatEventRing<uint64_t> &ring, vector<uint64_t> &dest)
+{
+  uint64_t v;
+  dest.clear();
+  while (ring.pop(v)) dest.push_back(v);
+}
+
+static bool isRun(const vector<uint64_t> &v, uint64_t first, uint64_t last)
+{
+  if (v.size() != last - first + 1) return false;
+  for (size_t i=0; i < v.size(); i++) if (v[i] != first + i) return false;
+  return true;
+}
+
+// wide enough that a copy racing the producer can tear
+struct RingEntry { uint64_t seq[32]; };
+
+static void checkEventRing()
+{
+  NTStatEventRing<uint64_t> ring(5);
+  CHECK(ring.capacity() == 8);
+
+  uint64_t dropped = 0;
+  vector<uint64_t> out;
+
+  // full: refused, contents kept
+
+  for (uint64_t i=1; i <= 8; i++) CHECK(ring.push(i, false, dropped));
+  CHECK(!ring.push(9, false, dropped));
+  CHECK(dropped == 0 && ring.size() == 8);
+  drainRing(ring, out);
+  CHECK(isRun(out, 1, 8));
+
+  // full, drop oldest: room made one entry at a time
+
+  for (uint64_t i=11; i <= 18; i++) ring.push(i, true, dropped);
+  CHECK(dropped == 0);
+  CHECK(ring.push(19, true, dropped) && ring.push(20, true, dropped));
+  CHECK(dropped == 2 && ring.size() == 8);
+  drainRing(ring, out);
+  CHECK(isRun(out, 13, 20));
+  uint64_t v;
+  CHECK(!ring.pop(v));
+
+  // indexes keep running across many wraps
+
+  bool wraps = true;
+  for (uint64_t i=0; i < 1000; i++) {
+    for (uint64_t j=0; j < 5; j++) ring.push(i * 5 + j, (j % 2 == 0), dropped);
+    drainRing(ring, out);
+    wraps = wraps && isRun(out, i * 5, i * 5 + 4);
+  }
+  CHECK(wraps && dropped == 2);
+
+  // producer and consumer threads, small ring, consumer stalls now and then
+
+  for (int dropOldest=0; dropOldest <= 1; dropOldest++) {
+    NTStatEventRing<RingEntry> shared(16);
+    const uint64_t numPushes = 300000;
+    std::atomic<bool> done(false);
+    uint64_t numPopped = 0, numOutOfOrder = 0, numTorn = 0;
+
+    thread consumer([&]() {
+      uint64_t last = 0;
+      RingEntry entry;
+      for (;;) {
+        bool finished = done.load();
+        if (!shared.pop(entry)) {
+          if (finished) break;
+          continue;
+        }
+        for (int i=1; i < 32; i++) {
+          if (entry.seq[i] != entry.seq[0]) { numTorn++; break; }
+        }
+        if (entry.seq[0] <= last) numOutOfOrder++;
+        last = entry.seq[0];
+        if (++numPopped % 512 == 0) std::this_thread::yield();
+      }
+    });
+
+    uint64_t numDropped = 0, numRefused = 0;
+    RingEntry entry;
+    for (uint64_t i=1; i <= numPushes; i++) {
+      for (int j=0; j < 32; j++) entry.seq[j] = i;
+      if (!shared.push(entry, dropOldest != 0, numDropped)) numRefused++;
+    }
+    done = true;
+    consumer.join();
+
+    CHECK(numTorn == 0);
+    CHECK(numOutOfOrder == 0);
+    CHECK(numPopped + numDropped + numRefused == numPushes);
+    CHECK(dropOldest ? numDropped > 0 : (numDropped == 0 && numRefused > 0));
+  }
+}
+
+int main()
+{
+  checkSlabPool();
+  checkFlatMap();
+  checkTimerWheel();
+  checkTopK();
+  checkHyperLogLog();
+  checkSnapshot();
+  checkEventRing();
+
+  printf("%d checks, %d failed\n", numChecks, numFailed);
+  return (numFailed > 0 ? 1 : 0);
+}
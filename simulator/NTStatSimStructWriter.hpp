@@ -0,0 +1,109 @@
+#ifndef _NT_STAT_SIM_STRUCT_WRITER_H_
+#define _NT_STAT_SIM_STRUCT_WRITER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "../src/NTStatKernelStructHandler.hpp"
+
+// large enough for any message the simulator writes
+
+#define NTSTAT_SIM_MAX_MSG_SIZE 4096
+
+/*
+ * Request fields the simulator cares about, decoded from any version.
+ */
+struct NTStatSimRequest
+{
+  uint32_t    type;
+  uint16_t    flags;
+  uint64_t    context;
+  uint64_t    srcRef;
+  uint32_t    providerId;
+  uint32_t    targetPid;    // ADD_ALL_SRCS with NSTAT_FILTER_SPECIFIC_USER_BY_PID, else 0
+};
+
+/*
+ * Kernel side of NTStatKernelStructHandler: reads request structs and
+ * writes response structs using the exact layouts of one XNU version.
+ * Each write method fills buf and returns the message length.
+ */
+class NTStatSimStructWriter
+{
+public:
+  virtual ~NTStatSimStructWriter() {}
+
+  virtual uint32_t providerTcp() = 0;
+  virtual uint32_t providerUdp() = 0;
+
+  /*
+   * NSTAT_SRC_REF_ALL for this version (uint32_t prior to xnu-3789)
+   */
+  virtual uint64_t srcRefAll() = 0;
+
+  /*
+   * true if NSTAT_MSG_HDR_FLAG_CONTINUATION is honored (xnu-3248+)
+   */
+  virtual bool supportsContinuation() = 0;
+
+  /*
+   * true if GET_UPDATE / SRC_UPDATE are implemented (xnu-4570+)
+   */
+  virtual bool supportsUpdate() = 0;
+
+  /*
+   * Decode request msg.  Returns false if the message is too short.
+   */
+  virtual bool readRequest(const nstat_msg_hdr* msg, int msglen, NTStatSimRequest& req) = 0;
+
+  virtual int writeSrcAdded(uint8_t* buf, uint64_t context, uint64_t srcRef, uint32_t providerId) = 0;
+  virtual int writeSrcRemoved(uint8_t* buf, uint64_t context, uint64_t srcRef) = 0;
+  virtual int writeSrcDesc(uint8_t* buf, uint64_t context, uint64_t srcRef, uint32_t providerId, const NTStatStream& flow) = 0;
+  virtual int writeSrcCounts(uint8_t* buf, uint64_t context, uint64_t srcRef, const NTStatCounters& counts) = 0;
+  virtual int writeSrcUpdate(uint8_t* buf, uint64_t context, uint64_t srcRef, uint32_t providerId, const NTStatStream& flow, const NTStatCounters& counts, uint16_t flags) = 0;
+  virtual int writeSuccess(uint8_t* buf, uint64_t context, uint16_t flags) = 0;
+  virtual int writeError(uint8_t* buf, uint64_t context, uint32_t error) = 0;
+};
+
+NTStatSimStructWriter* NewNTStatSimWriter2422();
+NTStatSimStructWriter* NewNTStatSimWriter2782();
+NTStatSimStructWriter* NewNTStatSimWriter3248();
+NTStatSimStructWriter* NewNTStatSimWriter3789();
+NTStatSimStructWriter* NewNTStatSimWriter4570();
+
+/*
+ * Fill the fields common to the TCP and UDP descriptors of every version.
+ */
+template <typename T>
+void NTStatSimFillDescriptor(T* desc, const NTStatStream& flow)
+{
+  if (flow.key.isV6) {
+    desc->local.v6.sin6_family = AF_INET6;
+    desc->local.v6.sin6_port = flow.key.lport;
+    desc->local.v6.sin6_addr = flow.key.local.addr6;
+    desc->remote.v6.sin6_family = AF_INET6;
+    desc->remote.v6.sin6_port = flow.key.rport;
+    desc->remote.v6.sin6_addr = flow.key.remote.addr6;
+  } else {
+    desc->local.v4.sin_family = AF_INET;
+    desc->local.v4.sin_port = flow.key.lport;
+    desc->local.v4.sin_addr = flow.key.local.addr4;
+    desc->remote.v4.sin_family = AF_INET;
+    desc->remote.v4.sin_port = flow.key.rport;
+    desc->remote.v4.sin_addr = flow.key.remote.addr4;
+  }
+  desc->ifindex = flow.key.ifindex;
+  desc->pid = flow.process.pid;
+  snprintf(desc->pname, sizeof(desc->pname), "%s", flow.process.name);
+}
+
+// macro for consistency in setting response hdr fields
+
+#define NTSTAT_SIM_HDR(msg_ptr, MSG_TYPE, CONTEXT, LEN)  { \
+  (msg_ptr)->hdr.type = MSG_TYPE;                         \
+  (msg_ptr)->hdr.length = (uint16_t)(LEN);                \
+  (msg_ptr)->hdr.context = (CONTEXT);                     \
+}
+
+#endif // _NT_STAT_SIM_STRUCT_WRITER_H_
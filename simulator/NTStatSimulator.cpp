@@ -0,0 +1,568 @@
+//  NTStatSimulator.cpp
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "NTStatSimulator.hpp"
+#include "NTStatSimStructWriter.hpp"
+#include "../include/NTStatTransport.hpp"
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// minimum ntstat.h definitions needed here (same across versions)
+
+enum
+{
+  NSTAT_MSG_TYPE_SUCCESS                  = 0
+  ,NSTAT_MSG_TYPE_ERROR                   = 1
+  ,NSTAT_MSG_TYPE_ADD_ALL_SRCS            = 1002
+  ,NSTAT_MSG_TYPE_REM_SRC                 = 1003
+  ,NSTAT_MSG_TYPE_QUERY_SRC               = 1004
+  ,NSTAT_MSG_TYPE_GET_SRC_DESC            = 1005
+  ,NSTAT_MSG_TYPE_GET_UPDATE              = 1007
+};
+
+#define SIM_TCPS_ESTABLISHED 4
+
+#define SIM_MSG_HDR_FLAG_CONTINUATION (1 << 1)   // xnu-3248+
+#define SIM_QUERY_CONTINUATION_SRC_COUNT 100
+#define SIM_MSG_HDR_FLAG_CLOSING (1 << 2)        // xnu-4570+
+
+static const uint16_t REMOTE_PORTS[] = { 443, 80, 22, 5223, 993, 27017, 3306, 53 };
+
+/*
+ * A simulated socket.  obj carries everything SRC_DESC reports.
+ */
+struct SimFlow
+{
+  NTStatStream  obj;
+  uint32_t      providerId;
+  bool          announced;    // client was sent SRC_ADDED
+  bool          closed;       // waiting for goodbye to fit in send buffer
+  uint64_t      querySeq;     // _querySeq when last included in a partial query
+  double        tStart;
+  double        tEnd;
+  uint32_t      rxRate;
+  uint32_t      txRate;
+};
+
+typedef pair<double, uint64_t> SimExpiry;
+
+/*
+ * Implementation of NTStatSimulator
+ */
+class NTStatSimulatorImpl : public NTStatSimulator
+{
+public:
+  NTStatSimulatorImpl(const NTStatSimConfig& config) : _config(config), _writer(0L), _fd(0), _peerFd(0),
+    _keepRunning(false), _flows(), _expiry(), _goodbyes(), _stats(), _nextSrcRef(0), _rand(config.seed),
+    _tStart(0), _arrivalCredit(0), _subscribedTcp(false), _subscribedUdp(false), _queryContext(0), _querySeq(0), _clientUsesUpdate(false), _targetPid(0)
+  {
+    if (_rand == 0) _rand = 1;
+
+    if (config.xnuVersion > 3800)
+      _writer = NewNTStatSimWriter4570();
+    else if (config.xnuVersion > 3300)
+      _writer = NewNTStatSimWriter3789();
+    else if (config.xnuVersion > 3200)
+      _writer = NewNTStatSimWriter3248();
+    else if (config.xnuVersion > 2700)
+      _writer = NewNTStatSimWriter2782();
+    else
+      _writer = NewNTStatSimWriter2422();
+  }
+
+  virtual ~NTStatSimulatorImpl()
+  {
+    if (_fd > 0) close(_fd);
+    if (_peerFd > 0) close(_peerFd);
+    delete _writer;
+  }
+
+  //----------------------------------------------------------
+  // SOCK_SEQPACKET is not available for AF_UNIX on Darwin,
+  // where SOCK_DGRAM is used.  Both keep message boundaries.
+  //----------------------------------------------------------
+  virtual NTStatTransport* newClientTransport()
+  {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0 &&
+        socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0) {
+      fprintf(stderr,"socketpair(AF_UNIX): %s\n", strerror(errno));
+      return 0L;
+    }
+
+    // the real sndbuf needs to be larger than the modeled one
+
+    int size = 1024 * 1024;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    _fd = fds[0];
+    _peerFd = dup(fds[1]);    // only used to measure what the client has not read yet
+
+    return NTStatTransportNewUnix(fds[1], _config.xnuVersion);
+  }
+
+  virtual void stop() { _keepRunning = false; }
+
+  virtual void getStats(NTStatSimStats& dest) { dest = _stats; }
+
+  //----------------------------------------------------------
+  // run
+  //----------------------------------------------------------
+  virtual void run()
+  {
+    if (_fd <= 0) {
+      printf("E run() no client transport.\n"); return;
+    }
+
+    _keepRunning = true;
+    _tStart = _now();
+
+    for (uint32_t i=0; i < _config.initialFlows; i++) _createFlow(0.0);
+
+    double tLast = 0.0;
+
+    while (_keepRunning)
+    {
+      double now = _now() - _tStart;
+
+      // arrivals
+
+      _arrivalCredit += (now - tLast) * _config.flowsPerSecond;
+      tLast = now;
+      while (_arrivalCredit >= 1.0) {
+        _arrivalCredit -= 1.0;
+        if (_flows.size() < _config.maxConcurrentFlows) _createFlow(now);
+      }
+
+      // departures
+
+      while (!_expiry.empty() && _expiry.top().first <= now) {
+        uint64_t srcRef = _expiry.top().second;
+        _expiry.pop();
+        _closeFlow(srcRef, now);
+      }
+
+      _retryGoodbyes(now);
+
+      // requests
+
+      struct pollfd pfd = { _fd, POLLIN, 0 };
+      if (poll(&pfd, 1, 1) > 0) _readRequests(now);
+    }
+  }
+
+private:
+
+  //----------------------------------------------------------
+  // monotonic seconds
+  //----------------------------------------------------------
+  double _now()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  // xorshift64*, so runs are reproducible for a seed
+
+  uint64_t _random()
+  {
+    _rand ^= _rand >> 12;
+    _rand ^= _rand << 25;
+    _rand ^= _rand >> 27;
+    return _rand * 2685821657736338717ULL;
+  }
+
+  double _uniform() { return (_random() >> 11) * (1.0 / 9007199254740992.0); }
+
+  //----------------------------------------------------------
+  // srcRef is uint32_t prior to xnu-3789. Skip 0 and ALL.
+  //----------------------------------------------------------
+  uint64_t _allocSrcRef()
+  {
+    do {
+      _nextSrcRef = (_nextSrcRef + 1) & _writer->srcRefAll();
+    } while (_nextSrcRef == 0 || _nextSrcRef == _writer->srcRefAll() || _flows.count(_nextSrcRef) > 0);
+    return _nextSrcRef;
+  }
+
+  bool _isSubscribed(const SimFlow &flow)
+  {
+    if (_targetPid != 0 && flow.obj.process.pid != _targetPid) return false;
+    return (flow.providerId == _writer->providerTcp() ? _subscribedTcp : _subscribedUdp);
+  }
+
+  //----------------------------------------------------------
+  // create a flow, announce if client subscribed to provider
+  //----------------------------------------------------------
+  void _createFlow(double now)
+  {
+    uint64_t srcRef = _allocSrcRef();
+    SimFlow &flow = _flows[srcRef];
+    flow = SimFlow();
+
+    bool isUdp = (_random() % 100) < _config.udpPercent;
+    flow.providerId = (isUdp ? _writer->providerUdp() : _writer->providerTcp());
+    flow.tStart = now;
+    flow.tEnd = now - log(1.0 - _uniform()) * _config.meanFlowLifetimeSeconds;
+    flow.rxRate = (uint32_t)(_random() % (_config.bytesPerSecondMax + 1));
+    flow.txRate = (uint32_t)(_random() % (_config.bytesPerSecondMax + 1));
+
+    NTStatStream &obj = flow.obj;
+    obj.id = srcRef;
+    obj.key.ipproto = (isUdp ? IPPROTO_UDP : IPPROTO_TCP);
+    obj.key.ifindex = 4;
+    obj.key.lport = htons(49152 + (uint16_t)(_random() % 16384));
+    obj.key.rport = htons(REMOTE_PORTS[_random() % (sizeof(REMOTE_PORTS) / sizeof(REMOTE_PORTS[0]))]);
+    obj.key.local.addr4.s_addr = htonl(0x0a000002);
+    obj.key.remote.addr4.s_addr = htonl(0x0b000000 | (uint32_t)(_random() & 0xffffff));
+    obj.states.state = SIM_TCPS_ESTABLISHED;
+    obj.states.txwindow = 131072;
+    obj.states.txcwindow = 65536;
+
+    uint32_t procIndex = (uint32_t)(_random() % (_config.numProcesses > 0 ? _config.numProcesses : 1));
+    obj.process.pid = 100 + procIndex;
+    snprintf(obj.process.name, sizeof(obj.process.name), "simproc%u", procIndex);
+
+    _expiry.push(SimExpiry(flow.tEnd, srcRef));
+    _stats.flowsCreated++;
+
+    if (_isSubscribed(flow)) _announce(srcRef, flow);
+  }
+
+  void _announce(uint64_t srcRef, SimFlow &flow)
+  {
+    int len = _writer->writeSrcAdded(_buf, 0, srcRef, flow.providerId);
+    if (_enqueue(_buf, len, false)) {
+      flow.announced = true;
+      _stats.flowsAnnounced++;
+    } else {
+      _stats.addedDrops++;
+    }
+  }
+
+  //----------------------------------------------------------
+  // counts grow linearly over flow lifetime
+  //----------------------------------------------------------
+  void _counts(const SimFlow &flow, double now, NTStatCounters &dest)
+  {
+    double elapsed = (now < flow.tEnd ? now : flow.tEnd) - flow.tStart;
+    if (elapsed < 0) elapsed = 0;
+
+    dest = NTStatCounters();
+    dest.rxbytes = (uint64_t)(flow.rxRate * elapsed);
+    dest.txbytes = (uint64_t)(flow.txRate * elapsed);
+    dest.rxpackets = dest.rxbytes / 1400 + 1;
+    dest.txpackets = dest.txbytes / 1400 + 1;
+    dest.wired_rxbytes = dest.rxbytes;
+    dest.wired_txbytes = dest.txbytes;
+  }
+
+  //----------------------------------------------------------
+  // Flow ended.  Client gets SRC_COUNTS, SRC_DESC, SRC_REMOVED,
+  // or SRC_UPDATE (CLOSING), SRC_REMOVED if it uses GET_UPDATE.
+  //----------------------------------------------------------
+  void _closeFlow(uint64_t srcRef, double now)
+  {
+    auto fit = _flows.find(srcRef);
+    if (fit == _flows.end()) return;
+
+    _stats.flowsClosed++;
+    fit->second.closed = true;
+
+    if (!fit->second.announced || _sendGoodbye(srcRef, fit->second, now)) {
+      _flows.erase(fit);
+      return;
+    }
+
+    _goodbyes.push_back(srcRef);
+  }
+
+  bool _sendGoodbye(uint64_t srcRef, SimFlow &flow, double now)
+  {
+    NTStatCounters counts;
+    _counts(flow, now, counts);
+
+    int countsLen, descLen;
+    if (_clientUsesUpdate) {
+      countsLen = _writer->writeSrcUpdate(_bufs[0], 0, srcRef, flow.providerId, flow.obj, counts, SIM_MSG_HDR_FLAG_CLOSING);
+      descLen = 0;
+    } else {
+      countsLen = _writer->writeSrcCounts(_bufs[0], 0, srcRef, counts);
+      descLen = _writer->writeSrcDesc(_bufs[1], 0, srcRef, flow.providerId, flow.obj);
+    }
+    int removedLen = _writer->writeSrcRemoved(_bufs[2], 0, srcRef);
+
+    if (_sendBufferUsed() + countsLen + descLen + removedLen > _config.sendBufferBytes) {
+      _stats.goodbyeRetries++;
+      return false;
+    }
+
+    _enqueue(_bufs[0], countsLen, true);
+    if (descLen > 0) _enqueue(_bufs[1], descLen, true);
+    _enqueue(_bufs[2], removedLen, true);
+    return true;
+  }
+
+  void _retryGoodbyes(double now)
+  {
+    while (!_goodbyes.empty())
+    {
+      auto fit = _flows.find(_goodbyes.front());
+      if (fit != _flows.end() && fit->second.announced) {
+        if (!_sendGoodbye(fit->first, fit->second, now)) return;
+      }
+      if (fit != _flows.end()) _flows.erase(fit);
+      _goodbyes.pop_front();
+    }
+  }
+
+  //----------------------------------------------------------
+  // Bytes the client has not read yet.  FIONREAD on the
+  // client end reports all queued payload bytes for a
+  // SEQPACKET (Linux) or DGRAM (Darwin) unix socket.
+  //----------------------------------------------------------
+  uint32_t _sendBufferUsed()
+  {
+    int queued = 0;
+    if (ioctl(_peerFd, FIONREAD, &queued) != 0) return 0;
+    return (uint32_t)queued;
+  }
+
+  //----------------------------------------------------------
+  // Write message if it fits in send buffer.  Errors and
+  // SUCCESS are critical, as in the kernel (CTL_DATA_CRIT).
+  //----------------------------------------------------------
+  bool _enqueue(const uint8_t* msg, int len, bool critical)
+  {
+    if (!critical && _sendBufferUsed() + len > _config.sendBufferBytes) return false;
+
+    ssize_t rc = send(_fd, msg, len, MSG_DONTWAIT);
+    if (rc != len) return false;
+
+    _stats.msgsSent++;
+    _stats.bytesSent += len;
+    return true;
+  }
+
+  void _sendError(uint64_t context, uint32_t error)
+  {
+    if (error == ENOBUFS) _stats.numDrops++;
+    int len = _writer->writeError(_buf, context, error);
+    _enqueue(_buf, len, true);
+  }
+
+  void _sendSuccess(uint64_t context)
+  {
+    int len = _writer->writeSuccess(_buf, context, 0);
+    _enqueue(_buf, len, true);
+  }
+
+  //----------------------------------------------------------
+  // read all pending requests
+  //----------------------------------------------------------
+  void _readRequests(double now)
+  {
+    uint8_t req[NTSTAT_SIM_MAX_MSG_SIZE] __attribute__((aligned(8)));
+    while (true)
+    {
+      ssize_t num_bytes = recv(_fd, req, sizeof(req), MSG_DONTWAIT);
+      if (num_bytes <= 0) return;
+
+      _stats.requests++;
+      _handleRequest((nstat_msg_hdr*)req, (int)num_bytes, now);
+    }
+  }
+
+  void _handleRequest(nstat_msg_hdr* hdr, int num_bytes, double now)
+  {
+    NTStatSimRequest req;
+    if (!_writer->readRequest(hdr, num_bytes, req)) {
+      _sendError(hdr->context, EINVAL);
+      return;
+    }
+
+    switch (req.type)
+    {
+      case NSTAT_MSG_TYPE_ADD_ALL_SRCS:
+      {
+        if (req.providerId == _writer->providerTcp()) _subscribedTcp = true;
+        else if (req.providerId == _writer->providerUdp()) _subscribedUdp = true;
+        else { _sendError(req.context, ENOENT); return; }
+        _targetPid = req.targetPid;
+
+        for (auto it = _flows.begin(); it != _flows.end(); it++) {
+          if (it->second.providerId == req.providerId && !it->second.announced && !it->second.closed &&
+              _isSubscribed(it->second))
+            _announce(it->first, it->second);
+        }
+        _sendSuccess(req.context);
+      }
+      break;
+      case NSTAT_MSG_TYPE_GET_UPDATE:
+        if (!_writer->supportsUpdate()) { _sendError(req.context, EINVAL); return; }
+        _clientUsesUpdate = true;
+        // fall through
+      case NSTAT_MSG_TYPE_GET_SRC_DESC:
+      case NSTAT_MSG_TYPE_QUERY_SRC:
+      {
+        if (req.srcRef == _writer->srcRefAll()) {
+          if ((req.flags & SIM_MSG_HDR_FLAG_CONTINUATION) && _writer->supportsContinuation())
+            _replyAllPartial(req, now);
+          else
+            _replyAll(req, now);
+          return;
+        }
+
+        auto fit = _flows.find(req.srcRef);
+        if (fit == _flows.end() || !fit->second.announced) {
+          _sendError(req.context, ENOENT);
+        } else if (!_reply(req, fit->first, fit->second, now)) {
+          _sendError(req.context, ENOBUFS);
+        }
+      }
+      break;
+      case NSTAT_MSG_TYPE_REM_SRC:
+      {
+        auto fit = _flows.find(req.srcRef);
+        if (fit == _flows.end() || !fit->second.announced) {
+          _sendError(req.context, ENOENT);
+        } else {
+          fit->second.announced = false;
+          int len = _writer->writeSrcRemoved(_buf, 0, req.srcRef);
+          _enqueue(_buf, len, true);
+        }
+      }
+      break;
+      default:
+        _sendError(req.context, EINVAL);
+        break;
+    }
+  }
+
+  //----------------------------------------------------------
+  // Reply for every flow.  Pre-3248 behavior: stop with ENOBUFS
+  // as soon as the send buffer is full.
+  //----------------------------------------------------------
+  void _replyAll(const NTStatSimRequest& req, double now)
+  {
+    for (auto it = _flows.begin(); it != _flows.end(); it++) {
+      if (!it->second.announced) continue;
+      if (!_reply(req, it->first, it->second, now)) { _sendError(req.context, ENOBUFS); return; }
+    }
+    _sendSuccess(req.context);
+  }
+
+  //----------------------------------------------------------
+  // NSTAT_MSG_HDR_FLAG_CONTINUATION (xnu-3248+): reply for up to
+  // 100 flows not yet covered by this query, then SUCCESS, with
+  // CONTINUATION set if any are left.  The client resends the
+  // request with the same context to continue.  A full send
+  // buffer ends the chunk early instead of failing the query.
+  //----------------------------------------------------------
+  void _replyAllPartial(const NTStatSimRequest& req, double now)
+  {
+    if (_queryContext == 0 || _queryContext != req.context) {
+      _queryContext = req.context;
+      _querySeq++;
+    }
+
+    uint32_t count = 0;
+    bool more = false;
+    for (auto it = _flows.begin(); it != _flows.end(); it++) {
+      SimFlow &flow = it->second;
+      if (!flow.announced || flow.querySeq == _querySeq) continue;
+
+      if (count >= SIM_QUERY_CONTINUATION_SRC_COUNT || !_reply(req, it->first, flow, now)) {
+        more = true;
+        break;
+      }
+      flow.querySeq = _querySeq;
+      count++;
+    }
+
+    if (!more) _queryContext = 0;
+    int len = _writer->writeSuccess(_buf, req.context, (more ? SIM_MSG_HDR_FLAG_CONTINUATION : 0));
+    _enqueue(_buf, len, true);
+  }
+
+  //----------------------------------------------------------
+  // SRC_DESC, SRC_COUNTS or SRC_UPDATE for one flow in reply to req
+  //----------------------------------------------------------
+  bool _reply(const NTStatSimRequest& req, uint64_t srcRef, SimFlow &flow, double now)
+  {
+    int len = 0;
+    if (req.type == NSTAT_MSG_TYPE_GET_SRC_DESC) {
+      len = _writer->writeSrcDesc(_buf, req.context, srcRef, flow.providerId, flow.obj);
+    } else if (req.type == NSTAT_MSG_TYPE_GET_UPDATE) {
+      NTStatCounters counts;
+      _counts(flow, now, counts);
+      len = _writer->writeSrcUpdate(_buf, req.context, srcRef, flow.providerId, flow.obj, counts, 0);
+    } else {
+      NTStatCounters counts;
+      _counts(flow, now, counts);
+      len = _writer->writeSrcCounts(_buf, req.context, srcRef, counts);
+    }
+    return _enqueue(_buf, len, false);
+  }
+
+  // private data members
+
+  NTStatSimConfig               _config;
+  NTStatSimStructWriter*        _writer;
+
+  int                           _fd;
+  int                           _peerFd;
+
+  std::atomic<bool>             _keepRunning;
+
+  unordered_map<uint64_t, SimFlow>  _flows;
+  priority_queue<SimExpiry, vector<SimExpiry>, greater<SimExpiry> > _expiry;
+  deque<uint64_t>               _goodbyes;  // closed flows waiting for send buffer space
+
+  NTStatSimStats                _stats;
+  uint64_t                      _nextSrcRef;
+  uint64_t                      _rand;
+  double                        _tStart;
+  double                        _arrivalCredit;
+
+  bool                          _subscribedTcp;
+  bool                          _subscribedUdp;
+
+  uint64_t                      _queryContext;  // partial query in progress
+  uint64_t                      _querySeq;
+
+  bool                          _clientUsesUpdate;  // goodbye as SRC_UPDATE
+  uint32_t                      _targetPid;         // kernel-side pid filter, 0 for all
+
+  uint8_t                       _bufs[3][NTSTAT_SIM_MAX_MSG_SIZE] __attribute__((aligned(8)));
+  uint8_t*                      _buf = _bufs[0];
+};
+
+//----------------------------------------------------------
+// Return new instance of impl
+//----------------------------------------------------------
+NTStatSimulator* NTStatSimulatorNew(const NTStatSimConfig& config)
+{
+  return new NTStatSimulatorImpl(config);
+}
@@ -0,0 +1,85 @@
+//  NTStatSimulator.hpp
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#ifndef NTStatSimulator_hpp
+#define NTStatSimulator_hpp
+
+#include <stdint.h>
+
+class NTStatTransport;
+
+/*
+ * NTStatSimConfig
+ *
+ * Load profile for the simulator.  Defaults model a busy host.
+ */
+struct NTStatSimConfig
+{
+  NTStatSimConfig() : xnuVersion(4570), flowsPerSecond(1000.0), meanFlowLifetimeSeconds(5.0),
+    maxConcurrentFlows(10000), initialFlows(0), sendBufferBytes(2048), udpPercent(0),
+    numProcesses(64), bytesPerSecondMax(100000), seed(1) {}
+
+  unsigned int  xnuVersion;               // struct layouts to speak (2422, 2782, 3248, 3789, 4570)
+  double        flowsPerSecond;           // new flow arrival rate
+  double        meanFlowLifetimeSeconds;  // exponentially distributed
+  uint32_t      maxConcurrentFlows;       // arrivals are skipped above this
+  uint32_t      initialFlows;             // flows open before the client subscribes
+  uint32_t      sendBufferBytes;          // kernel control socket sndbuf.  See docs/protocol.md
+  uint32_t      udpPercent;               // percentage of flows that are UDP
+  uint32_t      numProcesses;             // flows are spread across this many pids
+  uint32_t      bytesPerSecondMax;        // per flow, per direction
+  uint32_t      seed;                     // same seed, same flows
+};
+
+/*
+ * NTStatSimStats
+ */
+struct NTStatSimStats
+{
+  uint64_t    flowsCreated;
+  uint64_t    flowsClosed;
+  uint64_t    flowsAnnounced;     // SRC_ADDED delivered
+  uint64_t    addedDrops;         // SRC_ADDED did not fit in send buffer, flow not reported
+  uint64_t    goodbyeRetries;     // SRC_COUNTS/DESC/REMOVED did not fit, retried later
+  uint64_t    requests;
+  uint64_t    msgsSent;
+  uint64_t    bytesSent;
+  uint64_t    numDrops;           // ENOBUFS errors sent in reply to requests
+};
+
+/*
+ * NTStatSimulator
+ *
+ * In-process stand-in for the kernel side of com.apple.network.statistics.
+ * Generates SRC_ADDED/COUNTS/DESC/REMOVED for a synthetic flow population and
+ * answers ADD_ALL_SRCS, GET_SRC_DESC, QUERY_SRC and REM_SRC using the struct
+ * layouts of the configured XNU version.  The 2048 byte kernel send buffer
+ * is modeled: responses that do not fit are answered with ENOBUFS.
+ */
+class NTStatSimulator
+{
+public:
+  virtual ~NTStatSimulator() {}
+
+  /*
+   * Creates the socket pair and returns the client end, to be passed to
+   * NetworkStatisticsClient::connectToTransport().  Call before run().
+   */
+  virtual NTStatTransport* newClientTransport() = 0;
+
+  /*
+   * Blocking: run from dedicated thread until stop().
+   */
+  virtual void run() = 0;
+
+  virtual void stop() = 0;
+
+  /*
+   * Only consistent after run() has returned.
+   */
+  virtual void getStats(NTStatSimStats& dest) = 0;
+};
+
+NTStatSimulator* NTStatSimulatorNew(const NTStatSimConfig& config);
+
+#endif /* NTStatSimulator_hpp */
@@ -0,0 +1,132 @@
+//
+//  libntstat simulator
+//
+//  Runs NetworkStatisticsClient against the in-process kernel simulator
+//  and reports throughput and drops.
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "../include/NetworkStatisticsClient.hpp"
+#include "../include/NTStatTransport.hpp"
+#include "NTStatSimulator.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <thread>
+using namespace std;
+
+/*
+ * Listener that only counts events.
+ */
+class CountingListener : public NetworkStatisticsListener
+{
+public:
+  CountingListener() : numAdded(0), numRemoved(0), numUpdates(0) {}
+
+  virtual void onStreamAdded(const NTStatStream *stream) { numAdded++; }
+  virtual void onStreamRemoved(const NTStatStream *stream) { numRemoved++; }
+  virtual void onStreamStatsUpdate(const NTStatStream *stream) { numUpdates++; }
+
+  uint64_t numAdded;
+  uint64_t numRemoved;
+  uint64_t numUpdates;
+};
+
+void usage()
+{
+  printf("usage: ntstatsim [-v xnuVersion] [-r flowsPerSecond] [-l meanLifetimeSeconds] [-c maxConcurrentFlows]\n"
+         "                 [-i initialFlows] [-b sendBufferBytes] [-u udpPercent] [-s seed] [-d durationSeconds]\n"
+         "                 [-q]  bulk counts refresh\n"
+         "                 [-p pid]  only streams of simulated process pid\n"
+         "                 [-R recvBufferBytes]  client SO_RCVBUF\n");
+  exit(2);
+}
+
+int main(int argc, char * const argv[])
+{
+  NTStatSimConfig config;
+  unsigned int durationSeconds = 10;
+  bool bulkCounts = false;
+  NTStatFilterConfig filter;
+  uint32_t recvBufferBytes = 0;
+
+  int ch;
+  while ((ch = getopt(argc, argv, "v:r:l:c:i:b:u:s:d:qp:R:h")) != -1) {
+    switch (ch) {
+      case 'v': config.xnuVersion = atoi(optarg); break;
+      case 'r': config.flowsPerSecond = atof(optarg); break;
+      case 'l': config.meanFlowLifetimeSeconds = atof(optarg); break;
+      case 'c': config.maxConcurrentFlows = (uint32_t)atol(optarg); break;
+      case 'i': config.initialFlows = (uint32_t)atol(optarg); break;
+      case 'b': config.sendBufferBytes = (uint32_t)atol(optarg); break;
+      case 'u': config.udpPercent = (uint32_t)atol(optarg); break;
+      case 's': config.seed = (uint32_t)atol(optarg); break;
+      case 'd': durationSeconds = atoi(optarg); break;
+      case 'q': bulkCounts = true; break;
+      case 'p': filter.pid = (uint32_t)atol(optarg); break;
+      case 'R': recvBufferBytes = (uint32_t)atol(optarg); break;
+      default: usage();
+    }
+  }
+
+  if (config.xnuVersion < 2000 || config.xnuVersion > 5000) { printf("xnuVersion\n"); exit(3); }
+
+  // create simulator and client, connected by a socket pair
+
+  NTStatSimulator* sim = NTStatSimulatorNew(config);
+
+  CountingListener listener;
+  NetworkStatisticsClient* netstatClient = NetworkStatisticsClientNew(&listener);
+
+  if (false == netstatClient->connectToTransport(sim->newClientTransport())) {
+    printf("Failed to connect client to simulator\n");
+    return 2;
+  }
+  netstatClient->configure(true, config.udpPercent > 0, 30, filter, recvBufferBytes);
+  netstatClient->setBulkCountsRefresh(bulkCounts);
+
+  thread simThread(&NTStatSimulator::run, sim);
+  thread clientThread(&NetworkStatisticsClient::run, netstatClient);
+
+  sleep(durationSeconds);
+
+  netstatClient->stop();
+  clientThread.join();
+  sim->stop();
+  simThread.join();
+
+  // report
+
+  NTStatSimStats stats;
+  sim->getStats(stats);
+
+  double seconds = (durationSeconds > 0 ? durationSeconds : 1);
+  uint64_t responses = stats.requests > 0 ? stats.requests : 1;
+
+  printf("XNU version:%u duration:%us rate:%.0f/s lifetime:%.1fs concurrency:%u sndbuf:%u\n",
+         config.xnuVersion, durationSeconds, config.flowsPerSecond, config.meanFlowLifetimeSeconds,
+         config.maxConcurrentFlows, config.sendBufferBytes);
+  printf("simulator  flows created:%llu closed:%llu announced:%llu added-drops:%llu goodbye-retries:%llu\n",
+         (unsigned long long)stats.flowsCreated, (unsigned long long)stats.flowsClosed,
+         (unsigned long long)stats.flowsAnnounced, (unsigned long long)stats.addedDrops,
+         (unsigned long long)stats.goodbyeRetries);
+  printf("           requests:%llu msgs:%llu (%.0f/s) bytes:%llu ENOBUFS:%llu (%.2f%% of requests)\n",
+         (unsigned long long)stats.requests, (unsigned long long)stats.msgsSent, stats.msgsSent / seconds,
+         (unsigned long long)stats.bytesSent, (unsigned long long)stats.numDrops,
+         100.0 * stats.numDrops / responses);
+  printf("client     added:%llu removed:%llu updates:%llu drops:%u\n",
+         (unsigned long long)listener.numAdded, (unsigned long long)listener.numRemoved,
+         (unsigned long long)listener.numUpdates, netstatClient->getNumDrops());
+
+  NTStatClientMetrics metrics;
+  netstatClient->getMetrics(metrics);
+  printf("           requests:%llu window:%u (+%llu -%llu) retries:%llu timeouts:%llu bulk:%llu fallbacks:%llu filtered:%llu tracked:%u\n",
+         (unsigned long long)metrics.requestsSent, metrics.requestWindow,
+         (unsigned long long)metrics.windowIncreases, (unsigned long long)metrics.windowDecreases,
+         (unsigned long long)metrics.requestRetries, (unsigned long long)metrics.requestTimeouts,
+         (unsigned long long)metrics.bulkQueries, (unsigned long long)metrics.bulkFallbacks,
+         (unsigned long long)metrics.sourcesFiltered, metrics.sourcesTracked);
+  printf("           truncated:%llu rcvbuf:%u\n", (unsigned long long)metrics.msgsTruncated, metrics.recvBufferBytes);
+
+  return 0;
+}
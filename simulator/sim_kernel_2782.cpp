@@ -0,0 +1,153 @@
+#include "NTStatSimStructWriter.hpp"
+
+// definitions from darwin-xnu/bsd/net/ntstat.h kernel header
+
+#include <uuid/uuid.h>
+
+#include "../src/ntstat_kernel_2782.h"
+
+#include <string.h>
+
+class NTStatSimKernel2782 : public NTStatSimStructWriter
+{
+public:
+  virtual uint32_t providerTcp() { return NSTAT_PROVIDER_TCP; }
+  virtual uint32_t providerUdp() { return NSTAT_PROVIDER_UDP; }
+  virtual uint64_t srcRefAll() { return NSTAT_SRC_REF_ALL; }
+  virtual bool supportsContinuation() { return false; }
+  virtual bool supportsUpdate() { return false; }
+
+  //--------------------------------------------------------------------
+  // decode request
+  //--------------------------------------------------------------------
+  virtual bool readRequest(const nstat_msg_hdr* msg, int msglen, NTStatSimRequest& req)
+  {
+    if (msglen < (int)sizeof(nstat_msg_hdr)) return false;
+
+    req.type = msg->type;
+    req.flags = msg->flags;
+    req.context = msg->context;
+    req.srcRef = 0L;
+    req.providerId = 0;
+    req.targetPid = 0;
+
+    switch(msg->type)
+    {
+      case NSTAT_MSG_TYPE_ADD_ALL_SRCS:
+        if (msglen < (int)sizeof(nstat_msg_add_all_srcs)) return false;
+        req.providerId = ((nstat_msg_add_all_srcs*)msg)->provider;
+        break;
+      case NSTAT_MSG_TYPE_QUERY_SRC:
+        if (msglen < (int)sizeof(nstat_msg_query_src_req)) return false;
+        req.srcRef = ((nstat_msg_query_src_req*)msg)->srcref;
+        break;
+      case NSTAT_MSG_TYPE_GET_SRC_DESC:
+        if (msglen < (int)sizeof(nstat_msg_get_src_description)) return false;
+        req.srcRef = ((nstat_msg_get_src_description*)msg)->srcref;
+        break;
+      case NSTAT_MSG_TYPE_REM_SRC:
+        if (msglen < (int)sizeof(nstat_msg_rem_src_req)) return false;
+        req.srcRef = ((nstat_msg_rem_src_req*)msg)->srcref;
+        break;
+      default:
+        break;
+    }
+    return true;
+  }
+
+  virtual int writeSrcAdded(uint8_t* buf, uint64_t context, uint64_t srcRef, uint32_t providerId)
+  {
+    nstat_msg_src_added *msg = (nstat_msg_src_added*)buf;
+    memset(msg, 0, sizeof(*msg));
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_SRC_ADDED, context, sizeof(*msg));
+    msg->srcref = (nstat_src_ref_t)srcRef;
+    msg->provider = providerId;
+    return sizeof(*msg);
+  }
+
+  virtual int writeSrcRemoved(uint8_t* buf, uint64_t context, uint64_t srcRef)
+  {
+    nstat_msg_src_removed *msg = (nstat_msg_src_removed*)buf;
+    memset(msg, 0, sizeof(*msg));
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_SRC_REMOVED, context, sizeof(*msg));
+    msg->srcref = (nstat_src_ref_t)srcRef;
+    return sizeof(*msg);
+  }
+
+  virtual int writeSrcDesc(uint8_t* buf, uint64_t context, uint64_t srcRef, uint32_t providerId, const NTStatStream& flow)
+  {
+    nstat_msg_src_description *msg = (nstat_msg_src_description*)buf;
+    int len = sizeof(nstat_msg_src_description);
+
+    if (providerId == NSTAT_PROVIDER_TCP) {
+      len += sizeof(nstat_tcp_descriptor);
+      memset(msg, 0, len);
+      nstat_tcp_descriptor* tcp = (nstat_tcp_descriptor*)msg->data;
+      NTStatSimFillDescriptor(tcp, flow);
+      tcp->state = flow.states.state;
+      tcp->txwindow = flow.states.txwindow;
+      tcp->txcwindow = flow.states.txcwindow;
+    } else {
+      len += sizeof(nstat_udp_descriptor);
+      memset(msg, 0, len);
+      NTStatSimFillDescriptor((nstat_udp_descriptor*)msg->data, flow);
+    }
+
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_SRC_DESC, context, len);
+    msg->srcref = (nstat_src_ref_t)srcRef;
+    msg->provider = providerId;
+    return len;
+  }
+
+  virtual int writeSrcCounts(uint8_t* buf, uint64_t context, uint64_t srcRef, const NTStatCounters& counts)
+  {
+    nstat_msg_src_counts *msg = (nstat_msg_src_counts*)buf;
+    memset(msg, 0, sizeof(*msg));
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_SRC_COUNTS, context, sizeof(*msg));
+    msg->srcref = (nstat_src_ref_t)srcRef;
+
+    msg->counts.nstat_rxbytes = counts.rxbytes;
+    msg->counts.nstat_txbytes = counts.txbytes;
+    msg->counts.nstat_rxpackets = counts.rxpackets;
+    msg->counts.nstat_txpackets = counts.txpackets;
+    msg->counts.nstat_cell_rxbytes = counts.cell_rxbytes;
+    msg->counts.nstat_cell_txbytes = counts.cell_txbytes;
+    msg->counts.nstat_wifi_rxbytes = counts.wifi_rxbytes;
+    msg->counts.nstat_wifi_txbytes = counts.wifi_txbytes;
+    msg->counts.nstat_wired_rxbytes = counts.wired_rxbytes;
+    msg->counts.nstat_wired_txbytes = counts.wired_txbytes;
+    return sizeof(*msg);
+  }
+
+  // no SRC_UPDATE before xnu-4570
+
+  virtual int writeSrcUpdate(uint8_t* buf, uint64_t context, uint64_t srcRef, uint32_t providerId, const NTStatStream& flow, const NTStatCounters& counts, uint16_t flags)
+  {
+    return 0;
+  }
+
+  virtual int writeSuccess(uint8_t* buf, uint64_t context, uint16_t flags)
+  {
+    nstat_msg_hdr *hdr = (nstat_msg_hdr*)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = NSTAT_MSG_TYPE_SUCCESS;
+    hdr->length = sizeof(*hdr);
+    hdr->context = context;
+    hdr->flags = flags;
+    return sizeof(*hdr);
+  }
+
+  virtual int writeError(uint8_t* buf, uint64_t context, uint32_t error)
+  {
+    nstat_msg_error *msg = (nstat_msg_error*)buf;
+    memset(msg, 0, sizeof(*msg));
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_ERROR, context, sizeof(*msg));
+    msg->error = error;
+    return sizeof(*msg);
+  }
+};
+
+
+NTStatSimStructWriter* NewNTStatSimWriter2782() {
+  return new NTStatSimKernel2782();
+}
@@ -0,0 +1,178 @@
+#include "NTStatSimStructWriter.hpp"
+
+// definitions from darwin-xnu/bsd/net/ntstat.h kernel header
+
+#include <uuid/uuid.h>
+
+#include "../src/ntstat_kernel_4570.h"
+
+#include <string.h>
+
+class NTStatSimKernel4570 : public NTStatSimStructWriter
+{
+public:
+  virtual uint32_t providerTcp() { return NSTAT_PROVIDER_TCP_KERNEL; }
+  virtual uint32_t providerUdp() { return NSTAT_PROVIDER_UDP_KERNEL; }
+  virtual uint64_t srcRefAll() { return NSTAT_SRC_REF_ALL; }
+  virtual bool supportsContinuation() { return true; }
+  virtual bool supportsUpdate() { return true; }
+
+  //--------------------------------------------------------------------
+  // decode request
+  //--------------------------------------------------------------------
+  virtual bool readRequest(const nstat_msg_hdr* msg, int msglen, NTStatSimRequest& req)
+  {
+    if (msglen < (int)sizeof(nstat_msg_hdr)) return false;
+
+    req.type = msg->type;
+    req.flags = msg->flags;
+    req.context = msg->context;
+    req.srcRef = 0L;
+    req.providerId = 0;
+    req.targetPid = 0;
+
+    switch(msg->type)
+    {
+      case NSTAT_MSG_TYPE_ADD_ALL_SRCS:
+        if (msglen < (int)sizeof(nstat_msg_add_all_srcs)) return false;
+        req.providerId = ((nstat_msg_add_all_srcs*)msg)->provider;
+        if (((nstat_msg_add_all_srcs*)msg)->filter & NSTAT_FILTER_SPECIFIC_USER_BY_PID)
+          req.targetPid = ((nstat_msg_add_all_srcs*)msg)->target_pid;
+        break;
+      case NSTAT_MSG_TYPE_QUERY_SRC:
+      case NSTAT_MSG_TYPE_GET_UPDATE:
+        if (msglen < (int)sizeof(nstat_msg_query_src_req)) return false;
+        req.srcRef = ((nstat_msg_query_src_req*)msg)->srcref;
+        break;
+      case NSTAT_MSG_TYPE_GET_SRC_DESC:
+        if (msglen < (int)sizeof(nstat_msg_get_src_description)) return false;
+        req.srcRef = ((nstat_msg_get_src_description*)msg)->srcref;
+        break;
+      case NSTAT_MSG_TYPE_REM_SRC:
+        if (msglen < (int)sizeof(nstat_msg_rem_src_req)) return false;
+        req.srcRef = ((nstat_msg_rem_src_req*)msg)->srcref;
+        break;
+      default:
+        break;
+    }
+    return true;
+  }
+
+  virtual int writeSrcAdded(uint8_t* buf, uint64_t context, uint64_t srcRef, uint32_t providerId)
+  {
+    nstat_msg_src_added *msg = (nstat_msg_src_added*)buf;
+    memset(msg, 0, sizeof(*msg));
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_SRC_ADDED, context, sizeof(*msg));
+    msg->srcref = srcRef;
+    msg->provider = providerId;
+    return sizeof(*msg);
+  }
+
+  virtual int writeSrcRemoved(uint8_t* buf, uint64_t context, uint64_t srcRef)
+  {
+    nstat_msg_src_removed *msg = (nstat_msg_src_removed*)buf;
+    memset(msg, 0, sizeof(*msg));
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_SRC_REMOVED, context, sizeof(*msg));
+    msg->srcref = srcRef;
+    return sizeof(*msg);
+  }
+
+  virtual int writeSrcDesc(uint8_t* buf, uint64_t context, uint64_t srcRef, uint32_t providerId, const NTStatStream& flow)
+  {
+    nstat_msg_src_description *msg = (nstat_msg_src_description*)buf;
+    int len = sizeof(nstat_msg_src_description) + descriptorSize(providerId);
+    memset(msg, 0, len);
+    writeDescriptor(msg->data, providerId, flow);
+
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_SRC_DESC, context, len);
+    msg->srcref = srcRef;
+    msg->provider = providerId;
+    return len;
+  }
+
+  virtual int writeSrcCounts(uint8_t* buf, uint64_t context, uint64_t srcRef, const NTStatCounters& counts)
+  {
+    nstat_msg_src_counts *msg = (nstat_msg_src_counts*)buf;
+    memset(msg, 0, sizeof(*msg));
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_SRC_COUNTS, context, sizeof(*msg));
+    msg->srcref = srcRef;
+    writeCounts(msg->counts, counts);
+    return sizeof(*msg);
+  }
+
+  virtual int writeSrcUpdate(uint8_t* buf, uint64_t context, uint64_t srcRef, uint32_t providerId, const NTStatStream& flow, const NTStatCounters& counts, uint16_t flags)
+  {
+    nstat_msg_src_update *msg = (nstat_msg_src_update*)buf;
+    int len = sizeof(nstat_msg_src_update) + descriptorSize(providerId);
+    memset(msg, 0, len);
+    writeDescriptor(msg->data, providerId, flow);
+
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_SRC_UPDATE, context, len);
+    msg->hdr.flags = flags;
+    msg->srcref = srcRef;
+    msg->provider = providerId;
+    writeCounts(msg->counts, counts);
+    return len;
+  }
+
+  virtual int writeSuccess(uint8_t* buf, uint64_t context, uint16_t flags)
+  {
+    nstat_msg_hdr *hdr = (nstat_msg_hdr*)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = NSTAT_MSG_TYPE_SUCCESS;
+    hdr->length = sizeof(*hdr);
+    hdr->context = context;
+    hdr->flags = flags;
+    return sizeof(*hdr);
+  }
+
+  virtual int writeError(uint8_t* buf, uint64_t context, uint32_t error)
+  {
+    nstat_msg_error *msg = (nstat_msg_error*)buf;
+    memset(msg, 0, sizeof(*msg));
+    NTSTAT_SIM_HDR(msg, NSTAT_MSG_TYPE_ERROR, context, sizeof(*msg));
+    msg->error = error;
+    return sizeof(*msg);
+  }
+
+private:
+
+  int descriptorSize(uint32_t providerId)
+  {
+    if (providerId == NSTAT_PROVIDER_TCP_KERNEL || providerId == NSTAT_PROVIDER_TCP_USERLAND)
+      return sizeof(nstat_tcp_descriptor);
+    return sizeof(nstat_udp_descriptor);
+  }
+
+  void writeDescriptor(uint8_t* data, uint32_t providerId, const NTStatStream& flow)
+  {
+    if (providerId == NSTAT_PROVIDER_TCP_KERNEL || providerId == NSTAT_PROVIDER_TCP_USERLAND) {
+      nstat_tcp_descriptor* tcp = (nstat_tcp_descriptor*)data;
+      NTStatSimFillDescriptor(tcp, flow);
+      tcp->state = flow.states.state;
+      tcp->txwindow = flow.states.txwindow;
+      tcp->txcwindow = flow.states.txcwindow;
+    } else {
+      NTStatSimFillDescriptor((nstat_udp_descriptor*)data, flow);
+    }
+  }
+
+  void writeCounts(nstat_counts& dest, const NTStatCounters& counts)
+  {
+    dest.nstat_rxbytes = counts.rxbytes;
+    dest.nstat_txbytes = counts.txbytes;
+    dest.nstat_rxpackets = counts.rxpackets;
+    dest.nstat_txpackets = counts.txpackets;
+    dest.nstat_cell_rxbytes = counts.cell_rxbytes;
+    dest.nstat_cell_txbytes = counts.cell_txbytes;
+    dest.nstat_wifi_rxbytes = counts.wifi_rxbytes;
+    dest.nstat_wifi_txbytes = counts.wifi_txbytes;
+    dest.nstat_wired_rxbytes = counts.wired_rxbytes;
+    dest.nstat_wired_txbytes = counts.wired_txbytes;
+  }
+};
+
+
+NTStatSimStructWriter* NewNTStatSimWriter4570() {
+  return new NTStatSimKernel4570();
+}
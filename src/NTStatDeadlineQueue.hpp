@@ -0,0 +1,74 @@
+#ifndef _NT_STAT_DEADLINE_QUEUE_H_
+#define _NT_STAT_DEADLINE_QUEUE_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+//----------------------------------------------------------
+// milliseconds from a monotonic clock.  Not wall time.
+//----------------------------------------------------------
+inline uint64_t NTStatMonotonicMs()
+{
+#ifdef __APPLE__
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return mach_absolute_time() * tb.numer / tb.denom / 1000000ULL;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+#endif
+}
+
+/*
+ * Min-heap of (deadline, timer id) used by the client run loop to know
+ * how long it may block in NTStatTransport::wait().
+ */
+class NTStatDeadlineQueue
+{
+public:
+  /*
+   * Schedule timerId to fire at deadlineMs (NTStatMonotonicMs() time base).
+   */
+  void schedule(int timerId, uint64_t deadlineMs) { _heap.push(Entry(deadlineMs, timerId)); }
+
+  bool empty() const { return _heap.empty(); }
+
+  /*
+   * If the earliest deadline is <= nowMs, pop it into timerId and return true.
+   */
+  bool popExpired(uint64_t nowMs, int &timerId)
+  {
+    if (_heap.empty() || _heap.top().first > nowMs) return false;
+    timerId = _heap.top().second;
+    _heap.pop();
+    return true;
+  }
+
+  /*
+   * Milliseconds until the earliest deadline, 0 if already due,
+   * -1 if nothing is scheduled.
+   */
+  int msUntilNext(uint64_t nowMs) const
+  {
+    if (_heap.empty()) return -1;
+    uint64_t deadline = _heap.top().first;
+    if (deadline <= nowMs) return 0;
+    uint64_t delta = deadline - nowMs;
+    return (delta > 0x7fffffffULL ? 0x7fffffff : (int)delta);
+  }
+
+private:
+  typedef std::pair<uint64_t, int> Entry;
+
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > _heap;
+};
+
+#endif // _NT_STAT_DEADLINE_QUEUE_H_
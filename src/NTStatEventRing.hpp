@@ -0,0 +1,99 @@
+#ifndef _NT_STAT_EVENT_RING_H_
+#define _NT_STAT_EVENT_RING_H_
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+ * Bounded single-producer / single-consumer queue of T, lock-free on
+ * both sides.  Capacity is rounded up to a power of 2.  T is copied in
+ * and out, so it must be trivially copyable.
+ *
+ * The producer may drop the oldest entry to make room (push() with
+ * dropOldest).  Both sides then advance _tail, so the consumer claims an
+ * entry by compare-exchange after copying it out, and announces the
+ * index it is copying in _reading.  The producer never overwrites the
+ * entry being copied: if that is the one it would replace, the new entry
+ * is dropped instead.
+ */
+template <typename T>
+class NTStatEventRing
+{
+public:
+  NTStatEventRing(uint32_t capacity) : _slots(0L), _capacity(1), _mask(0), _head(0), _tail(0), _reading(NONE)
+  {
+    while (_capacity < capacity) _capacity <<= 1;
+    _mask = _capacity - 1;
+    _slots = new T[_capacity];
+  }
+
+  ~NTStatEventRing() { delete [] _slots; }
+
+  uint32_t capacity() const { return _capacity; }
+  uint32_t size() const { return (uint32_t)(_head.load() - _tail.load()); }
+
+  //----------------------------------------------------------
+  // producer.  Returns false if item was not queued (full).
+  // With dropOldest, makes room first and counts the entries
+  // dropped in numDropped.
+  //----------------------------------------------------------
+  bool push(const T& item, bool dropOldest, uint64_t &numDropped)
+  {
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    uint64_t tail = _tail.load();
+
+    if (head - tail >= _capacity) {
+      if (!dropOldest) return false;
+      if (_tail.compare_exchange_strong(tail, tail + 1)) numDropped++;   // else the consumer took it
+
+      // slot head & _mask held entry head - _capacity
+      if (_reading.load() == head - _capacity) return false;
+    }
+
+    _slots[head & _mask] = item;
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  //----------------------------------------------------------
+  // consumer.  Copies the oldest entry into dest and removes
+  // it, or returns false if empty.
+  //----------------------------------------------------------
+  bool pop(T& dest)
+  {
+    for (;;) {
+      uint64_t tail = _tail.load();
+      if (tail == _head.load(std::memory_order_acquire)) return false;
+
+      _reading.store(tail);
+      if (_tail.load() != tail) continue;   // dropped before we announced
+
+      dest = _slots[tail & _mask];
+      _reading.store(NONE);
+
+      if (_tail.compare_exchange_strong(tail, tail + 1)) return true;
+      // dropped while we copied, take the next
+    }
+  }
+
+private:
+  enum : uint64_t { NONE = ~0ULL };
+
+  NTStatEventRing(const NTStatEventRing&);
+  NTStatEventRing& operator=(const NTStatEventRing&);
+
+  T*                      _slots;
+  uint32_t                _capacity;
+  uint32_t                _mask;
+
+  // free-running indexes, each on its own cache line
+
+  char                    _pad0[64];
+  std::atomic<uint64_t>   _head;      // next to write, producer only
+  char                    _pad1[64];
+  std::atomic<uint64_t>   _tail;      // next to read
+  std::atomic<uint64_t>   _reading;   // index the consumer is copying, or NONE
+  char                    _pad2[64];
+};
+
+#endif // _NT_STAT_EVENT_RING_H_
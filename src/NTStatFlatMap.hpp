@@ -0,0 +1,232 @@
+#ifndef _NT_STAT_FLAT_MAP_H_
+#define _NT_STAT_FLAT_MAP_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Open-addressing hash map from uint64_t to V, for srcRef indexes.
+ *
+ * Entries live in one power-of-2 array probed linearly, so a lookup is
+ * usually one or two cache lines and iteration is a sequential scan.
+ * erase() shifts the rest of the probe run back instead of leaving
+ * tombstones, so lookups never slow down as sources come and go.
+ *
+ * Key 0 marks an empty slot and can't be stored (NSTAT_SRC_REF_INVALID).
+ * V must be trivially copyable (a pointer, typically).
+ *
+ * Iteration starts just after an empty slot, so it = erase(it) while
+ * iterating visits every remaining entry exactly once.  Any insert
+ * invalidates iterators.  Not thread-safe.
+ */
+template <typename V>
+class NTStatFlatMap
+{
+public:
+  struct Entry
+  {
+    uint64_t  first;    // key.  names match std::map for drop-in use
+    V         second;
+  };
+
+  class iterator
+  {
+  public:
+    iterator() : _map(0L), _step(0) {}
+    iterator(const NTStatFlatMap* map, uint32_t step) : _map(map), _step(step) { _skipEmpty(); }
+
+    Entry& operator*() const { return _map->_entries[_index()]; }
+    Entry* operator->() const { return &_map->_entries[_index()]; }
+
+    iterator& operator++() { _step++; _skipEmpty(); return *this; }
+    iterator operator++(int) { iterator prev = *this; ++(*this); return prev; }
+
+    bool operator==(const iterator& b) const { return _step == b._step; }
+    bool operator!=(const iterator& b) const { return _step != b._step; }
+
+  private:
+    friend class NTStatFlatMap;
+
+    uint32_t _index() const { return (_map->_start + _step) & _map->_mask; }
+
+    void _skipEmpty()
+    {
+      while (_step < _map->_capacity && _map->_entries[_index()].first == 0) _step++;
+    }
+
+    const NTStatFlatMap*  _map;
+    uint32_t              _step;    // slots from _map->_start, _capacity at end
+  };
+
+  NTStatFlatMap() : _entries(0L), _capacity(0), _mask(0), _size(0), _start(0), _firstStep(0) {}
+
+  ~NTStatFlatMap() { free(_entries); }
+
+  uint32_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  uint32_t capacity() const { return _capacity; }
+
+  /*
+   * Grow so that numEntries fit without rehashing.
+   */
+  void reserve(uint32_t numEntries)
+  {
+    uint32_t capacity = (_capacity > 0 ? _capacity : MIN_CAPACITY);
+    while (numEntries > _maxLoad(capacity)) capacity <<= 1;
+    if (capacity > _capacity) _rehash(capacity);
+  }
+
+  void clear()
+  {
+    if (_entries) memset(_entries, 0, sizeof(Entry) * _capacity);
+    _size = 0;
+    _start = 0;
+    _firstStep = 0;
+  }
+
+  /*
+   * Cheap when used as a queue (begin(), erase(), begin(), ...):
+   * the scan resumes where the last one found the first entry.
+   */
+  iterator begin() const
+  {
+    iterator it(this, _firstStep);
+    _firstStep = it._step;
+    return it;
+  }
+
+  iterator end() const { return iterator(this, _capacity); }
+
+  iterator find(uint64_t key) const
+  {
+    if (0 == _size || 0 == key) return end();
+
+    for (uint32_t i = _hash(key); ; i = (i + 1) & _mask) {
+      if (_entries[i].first == key) return iterator(this, (i - _start) & _mask);
+      if (_entries[i].first == 0) return end();
+    }
+  }
+
+  uint32_t count(uint64_t key) const { return (find(key) != end() ? 1 : 0); }
+
+  /*
+   * Value for key, inserting a zero-initialized one if not present.
+   */
+  V& operator[](uint64_t key)
+  {
+    if (_size + 1 > _maxLoad(_capacity)) _rehash(_capacity > 0 ? _capacity << 1 : MIN_CAPACITY);
+
+    uint32_t i = _hash(key);
+    while (_entries[i].first != 0 && _entries[i].first != key) i = (i + 1) & _mask;
+
+    if (_entries[i].first == 0) {
+      _entries[i].first = key;
+      _entries[i].second = V();
+      _size++;
+      if (((i + 1) & _mask) == _start) {
+        _start = _findStart();   // filled the slot before _start
+        _firstStep = 0;
+      } else if (((i - _start) & _mask) < _firstStep) {
+        _firstStep = (i - _start) & _mask;
+      }
+    }
+    return _entries[i].second;
+  }
+
+  /*
+   * Erase entry at it.  Returns iterator to the next entry.
+   */
+  iterator erase(iterator it)
+  {
+    _eraseIndex(it._index());
+    iterator next = it;
+    next._skipEmpty();   // an entry may have shifted into this slot
+    return next;
+  }
+
+  uint32_t erase(uint64_t key)
+  {
+    iterator it = find(key);
+    if (it == end()) return 0;
+    _eraseIndex(it._index());
+    return 1;
+  }
+
+private:
+  static const uint32_t MIN_CAPACITY = 16;
+
+  // 3/4 load keeps linear probe runs short
+  static uint32_t _maxLoad(uint32_t capacity) { return capacity - (capacity >> 2); }
+
+  // Fibonacci hashing.  srcRefs are sequential, so spread them out.
+  uint32_t _hash(uint64_t key) const
+  {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & _mask;
+  }
+
+  //----------------------------------------------------------
+  // remove entry at i, shifting back the rest of its probe run
+  //----------------------------------------------------------
+  void _eraseIndex(uint32_t i)
+  {
+    uint32_t hole = i;
+    for (uint32_t j = (i + 1) & _mask; _entries[j].first != 0; j = (j + 1) & _mask) {
+      // move j into hole, unless its home slot lies cyclically in (hole, j]
+      uint32_t home = _hash(_entries[j].first);
+      if (((j - home) & _mask) >= ((j - hole) & _mask)) {
+        _entries[hole] = _entries[j];
+        hole = j;
+      }
+    }
+    _entries[hole].first = 0;
+    _size--;
+  }
+
+  //----------------------------------------------------------
+  // index just after some empty slot (one always exists)
+  //----------------------------------------------------------
+  uint32_t _findStart() const
+  {
+    for (uint32_t i=0; i < _capacity; i++) {
+      if (_entries[i].first == 0) return (i + 1) & _mask;
+    }
+    return 0;
+  }
+
+  void _rehash(uint32_t capacity)
+  {
+    Entry* old = _entries;
+    uint32_t oldCapacity = _capacity;
+
+    _entries = (Entry*)calloc(capacity, sizeof(Entry));
+    if (0L == _entries) abort();
+    _capacity = capacity;
+    _mask = capacity - 1;
+    _size = 0;
+
+    for (uint32_t i=0; i < oldCapacity; i++) {
+      if (old[i].first == 0) continue;
+      uint32_t j = _hash(old[i].first);
+      while (_entries[j].first != 0) j = (j + 1) & _mask;
+      _entries[j] = old[i];
+      _size++;
+    }
+    free(old);
+
+    _start = _findStart();
+    _firstStep = 0;
+  }
+
+  Entry*      _entries;
+  uint32_t    _capacity;
+  uint32_t    _mask;
+  uint32_t    _size;
+  uint32_t    _start;     // iteration starts here, just after an empty slot
+  mutable uint32_t _firstStep;  // no entries before this step from _start
+};
+
+template <typename V>
+const uint32_t NTStatFlatMap<V>::MIN_CAPACITY;
+
+#endif // _NT_STAT_FLAT_MAP_H_
@@ -14,6 +14,41 @@ typedef struct nstat_msg_hdr
         uint16_t       flags;
 } nstat_msg_hdr;
 
+// provider of a source, independent of version-specific provider ids
+
+enum {
+  NTSTAT_PROVIDER_KIND_OTHER = 0
+  ,NTSTAT_PROVIDER_KIND_TCP
+  ,NTSTAT_PROVIDER_KIND_UDP
+  ,NTSTAT_PROVIDER_KIND_IFNET
+};
+
+/*
+ * A message decoded by NTStatKernelStructHandler::decode(): header, srcRef
+ * and provider read once, and the length checked against the struct for
+ * its type.  It points into the caller's buffer and copies nothing, so it
+ * is only good as long as the buffer is.
+ */
+struct NTStatMsgView
+{
+  nstat_msg_hdr*   hdr;
+  int              length;        // bytes in buffer
+  uint64_t         srcRef;        // 0 if not in message
+  uint32_t         providerId;    // 0 if not in message
+  uint32_t         providerKind;  // NTSTAT_PROVIDER_KIND_, if providerId is in message
+
+  // start decoding msg.  false if too short for a header
+  bool reset(nstat_msg_hdr* msg, int len)
+  {
+    hdr = msg;
+    length = len;
+    srcRef = 0L;
+    providerId = 0;
+    providerKind = NTSTAT_PROVIDER_KIND_OTHER;
+    return (len >= (int)sizeof(nstat_msg_hdr));
+  }
+};
+
 class MsgDest
 {
 public:
@@ -38,6 +73,7 @@ public:
 class NTStatKernelStructHandler
 {
 public:
+  virtual ~NTStatKernelStructHandler() {}
 
   /*
    * write NSTAT_MSG_TYPE_GET_SRC_DESC to dest
@@ -45,10 +81,23 @@ public:
   virtual void writeSrcDesc(MsgDest &dest, uint64_t providerId, uint64_t srcRef ) = 0;
 
   /*
-   * write NSTAT_MSG_TYPE_ADD_ALL_SRCS for TCP or UDP
+   * write NSTAT_MSG_TYPE_ADD_ALL_SRCS for TCP or UDP, with the parts of
+   * filter this version supports in the filter / target_pid fields.
+   */
+  virtual void writeAddAllTcpSrc(MsgDest &dest, const NTStatFilterConfig &filter) = 0;
+  virtual void writeAddAllUdpSrc(MsgDest &dest, const NTStatFilterConfig &filter) = 0;
+
+  /*
+   * NTSTAT_KFILTER_ mask of the filter fields applied by the kernel.
+   * The client applies the rest.
    */
-  virtual void writeAddAllTcpSrc(MsgDest &dest) = 0;
-  virtual void writeAddAllUdpSrc(MsgDest &dest) = 0;
+  virtual uint32_t kernelFilters() = 0;
+
+  /*
+   * Largest message the kernel sends (NSTAT_MAX_MSG_SIZE from xnu-3248).
+   * Receive buffers are at least this big.
+   */
+  virtual uint32_t maxMsgSize() = 0;
 
   /*
    * Provider IDs are abstracted.  Some versions have multiple TCP and UDP.
@@ -63,24 +112,108 @@ public:
    */
   virtual void writeQuerySrc(MsgDest &dest, uint64_t srcRef) = 0;
 
+  /*
+   * write NSTAT_MSG_TYPE_QUERY_SRC for NSTAT_SRC_REF_ALL.
+   * From xnu-3248 the kernel honors NSTAT_MSG_HDR_FLAG_CONTINUATION and
+   * replies in chunks, each ending with SUCCESS.  To request the next chunk
+   * pass the context of the query being continued, otherwise 0.
+   * Returns true if the continuation flag was set.
+   */
+  virtual bool writeQueryAllSrc(MsgDest &dest, uint64_t continueContext) = 0;
+
   
   /*
-   * Extract from msg and populate srcRef and providerId (if in message).
+   * NSTAT_MSG_TYPE_GET_UPDATE / NSTAT_MSG_TYPE_SRC_UPDATE (xnu-4570+).
+   * A SRC_UPDATE carries the descriptor and the counts in one message.
+   * supportsUpdate() is false before 4570, where the others do nothing.
+   */
+  virtual bool supportsUpdate() = 0;
+  virtual void writeGetUpdate(MsgDest &dest, uint64_t srcRef) = 0;
+
+  /*
+   * Read descriptor and counts of SRC_UPDATE into dest.
+   * Returns false if not a TCP or UDP source.
    */
-  virtual void getSrcRef(nstat_msg_hdr* msg, int structlen, uint64_t &srcRef, uint32_t &providerId) = 0;
+  virtual bool readUpdate(const NTStatMsgView &msg, NTStatStream* dest ) = 0;
+
+  /*
+   * Populate view from msg: srcRef, providerId and providerKind where the
+   * message has them.  Returns false if length is short of the struct for
+   * msg->type (including the descriptor, for SRC_DESC and SRC_UPDATE).
+   * The read functions below take a view that decoded successfully and
+   * don't check again.
+   */
+  virtual bool decode(nstat_msg_hdr* msg, int length, NTStatMsgView &view) = 0;
 
   /*
    * Read src desc and populate relevant fields in dest.
+   * Returns false if not a TCP or UDP source.
    */
-  virtual bool readSrcDesc(nstat_msg_hdr*msg, int structlen, NTStatStream* dest ) = 0;
+  virtual bool readSrcDesc(const NTStatMsgView &msg, NTStatStream* dest ) = 0;
 
   /*
    * Update dest counts using msg.
    */
-  virtual void readCounts(nstat_msg_hdr*msg, int structlen, NTStatCounters& dest ) = 0;
+  virtual void readCounts(const NTStatMsgView &msg, NTStatCounters& dest ) = 0;
+
+  /*
+   * Interfaces (NSTAT_PROVIDER_IFNET) have no ADD_ALL_SRCS.  Each is
+   * added with an ADD_SRC for its ifindex, answered with SRC_ADDED
+   * carrying the request's context, or ERROR.  The kernel also sends
+   * SRC_COUNTS each time threshold more bytes have crossed the interface.
+   */
+  virtual void writeAddInterfaceSrc(MsgDest &dest, uint32_t ifindex, uint64_t threshold) = 0;
+
+  /*
+   * Read the interface descriptor of SRC_DESC into dest, or for
+   * readInterfaceUpdate() the descriptor and counts of SRC_UPDATE.
+   * Return false if not an interface source (or, for
+   * readInterfaceUpdate(), before xnu-4570).
+   */
+  virtual bool readInterfaceDesc(const NTStatMsgView &msg, NTStatInterface* dest ) = 0;
+  virtual bool readInterfaceUpdate(const NTStatMsgView &msg, NTStatInterface* dest ) = 0;
 
 };
 
+// NTStatFilterConfig fields, for kernelFilters()
+
+#define NTSTAT_KFILTER_INTERFACES   (1 << 0)
+#define NTSTAT_KFILTER_LISTENERS    (1 << 1)
+#define NTSTAT_KFILTER_ZEROBYTES    (1 << 2)
+#define NTSTAT_KFILTER_PID          (1 << 3)
+
+// NSTAT_FILTER_* values of a version, for NTStatProviderFilter().
+// They move between versions (PROVIDER_NOZEROBYTES after 3248).
+
+struct NTStatProviderFilterFlags
+{
+  uint64_t acceptUnknown, acceptLoopback, acceptCellular, acceptWifi, acceptWired;
+  uint64_t tcpNoListener;
+  uint64_t noZeroBytes;
+  uint64_t userByPid;       // 0 if the version has no target_pid
+};
+
+// NTStatFilterConfig to ADD_ALL_SRCS provider filter flags.  No ACCEPT_
+// flags is accept-all to the kernel, so they are only set for a partial
+// mask.  configure() refuses an empty one.
+
+inline uint64_t NTStatProviderFilter(const NTStatProviderFilterFlags &f,
+                                     const NTStatFilterConfig &filter, bool isTcp)
+{
+  uint64_t flags = 0;
+  if ((filter.acceptInterfaces & NTSTAT_IFTYPE_ALL) != NTSTAT_IFTYPE_ALL) {
+    if (filter.acceptInterfaces & NTSTAT_IFTYPE_UNKNOWN) flags |= f.acceptUnknown;
+    if (filter.acceptInterfaces & NTSTAT_IFTYPE_LOOPBACK) flags |= f.acceptLoopback;
+    if (filter.acceptInterfaces & NTSTAT_IFTYPE_CELLULAR) flags |= f.acceptCellular;
+    if (filter.acceptInterfaces & NTSTAT_IFTYPE_WIFI) flags |= f.acceptWifi;
+    if (filter.acceptInterfaces & NTSTAT_IFTYPE_WIRED) flags |= f.acceptWired;
+  }
+  if (isTcp && filter.skipListeners) flags |= f.tcpNoListener;
+  if (filter.skipZeroBytes) flags |= f.noZeroBytes;
+  if (filter.pid != 0) flags |= f.userByPid;
+  return flags;
+}
+
 // macro for consistency in setting hdr fields.  context in particular
 
 #define NTSTAT_MSG_HDR(msg_struct, MsgDestRef, MSG_TYPE)  { \
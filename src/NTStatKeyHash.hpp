@@ -0,0 +1,170 @@
+#ifndef _NT_STAT_KEY_HASH_H_
+#define _NT_STAT_KEY_HASH_H_
+
+#include "../include/NetworkStatisticsClient.hpp"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Hash and equality for NTStatStreamKey, over the same fields as
+ * operator<: isV6, ipproto, ifindex, ports and addresses.  pad is
+ * ignored, and so are the 12 bytes past addr4 of an IPv4 key, so keys
+ * built field by field compare equal to the client's.
+ *
+ * Equality compares the whole key at once: three 16 byte loads (the
+ * last overlapping, as the key is 44 bytes), XOR, AND with the mask of
+ * bytes that count for the address family, then one test for zero.
+ * SSE2 on x86_64, NEON on arm64, field by field elsewhere.
+ */
+
+// the blocks are at 0, 16 and 28.  Masks below assume this layout.
+
+#define NTSTAT_KEY_BLOCK1 16
+#define NTSTAT_KEY_BLOCK2 28
+
+static_assert(offsetof(NTStatStreamKey, ifindex) == 4 && offsetof(NTStatStreamKey, lport) == 8 &&
+              offsetof(NTStatStreamKey, local) == 12 && offsetof(NTStatStreamKey, remote) == 28 &&
+              sizeof(NTStatStreamKey) == 44, "NTStatStreamKey layout changed, update key masks");
+
+// bytes that count in each block, by address family (0: IPv4, 1: IPv6)
+
+#define NTSTAT_KEY_FF4  0xFF, 0xFF, 0xFF, 0xFF
+#define NTSTAT_KEY_004  0, 0, 0, 0
+
+static const uint8_t s_ntstatKeyMask[2][3][16] __attribute__((aligned(16))) = {
+  {
+    { 0xFF, 0xFF, 0, 0, NTSTAT_KEY_FF4, NTSTAT_KEY_FF4, NTSTAT_KEY_FF4 },   // isV6 ipproto - ifindex ports addr4
+    { NTSTAT_KEY_004, NTSTAT_KEY_004, NTSTAT_KEY_004, NTSTAT_KEY_FF4 },     // - - - remote addr4
+    { NTSTAT_KEY_FF4, NTSTAT_KEY_004, NTSTAT_KEY_004, NTSTAT_KEY_004 }      // remote addr4 - - -
+  },
+  {
+    { 0xFF, 0xFF, 0, 0, NTSTAT_KEY_FF4, NTSTAT_KEY_FF4, NTSTAT_KEY_FF4 },
+    { NTSTAT_KEY_FF4, NTSTAT_KEY_FF4, NTSTAT_KEY_FF4, NTSTAT_KEY_FF4 },
+    { NTSTAT_KEY_FF4, NTSTAT_KEY_FF4, NTSTAT_KEY_FF4, NTSTAT_KEY_FF4 }
+  }
+};
+
+//----------------------------------------------------------
+// true if a and b are the same flow
+//----------------------------------------------------------
+inline bool NTStatKeyEqual(const NTStatStreamKey &a, const NTStatStreamKey &b)
+{
+  const uint8_t* pa = (const uint8_t*)&a;
+  const uint8_t* pb = (const uint8_t*)&b;
+  const uint8_t (*mask)[16] = s_ntstatKeyMask[a.isV6 ? 1 : 0];
+
+#if defined(__SSE2__)
+  __m128i d0 = _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)pa), _mm_loadu_si128((const __m128i*)pb)),
+                             _mm_load_si128((const __m128i*)mask[0]));
+  __m128i d1 = _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(pa + NTSTAT_KEY_BLOCK1)),
+                                           _mm_loadu_si128((const __m128i*)(pb + NTSTAT_KEY_BLOCK1))),
+                             _mm_load_si128((const __m128i*)mask[1]));
+  __m128i d2 = _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(pa + NTSTAT_KEY_BLOCK2)),
+                                           _mm_loadu_si128((const __m128i*)(pb + NTSTAT_KEY_BLOCK2))),
+                             _mm_load_si128((const __m128i*)mask[2]));
+  __m128i d = _mm_or_si128(_mm_or_si128(d0, d1), d2);
+  return (_mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_setzero_si128())) == 0xFFFF);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  uint8x16_t d0 = vandq_u8(veorq_u8(vld1q_u8(pa), vld1q_u8(pb)), vld1q_u8(mask[0]));
+  uint8x16_t d1 = vandq_u8(veorq_u8(vld1q_u8(pa + NTSTAT_KEY_BLOCK1), vld1q_u8(pb + NTSTAT_KEY_BLOCK1)), vld1q_u8(mask[1]));
+  uint8x16_t d2 = vandq_u8(veorq_u8(vld1q_u8(pa + NTSTAT_KEY_BLOCK2), vld1q_u8(pb + NTSTAT_KEY_BLOCK2)), vld1q_u8(mask[2]));
+  return (vmaxvq_u8(vorrq_u8(vorrq_u8(d0, d1), d2)) == 0);
+#else
+  (void)pa; (void)pb; (void)mask;
+  if (a.isV6 != b.isV6 || a.ipproto != b.ipproto || a.ifindex != b.ifindex ||
+      a.lport != b.lport || a.rport != b.rport) return false;
+  if (a.isV6)
+    return (memcmp(&a.local.addr6, &b.local.addr6, sizeof(in6_addr)) == 0 &&
+            memcmp(&a.remote.addr6, &b.remote.addr6, sizeof(in6_addr)) == 0);
+  return (a.local.addr4.s_addr == b.local.addr4.s_addr && a.remote.addr4.s_addr == b.remote.addr4.s_addr);
+#endif
+}
+
+//----------------------------------------------------------
+// multiply-xorshift steps, murmur3 finalizer
+//----------------------------------------------------------
+inline uint64_t _ntstatKeyMix(uint64_t h, uint64_t w)
+{
+  h ^= w;
+  h *= 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 29);
+}
+
+inline uint64_t _ntstatLoad64(const void* p)
+{
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+inline uint64_t _ntstatFmix64(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+inline uint64_t _ntstatMixAddr(uint64_t h, uint8_t isV6, const addr_t &addr)
+{
+  if (isV6) {
+    const uint8_t* p = (const uint8_t*)&addr.addr6;
+    h = _ntstatKeyMix(h, _ntstatLoad64(p));
+    return _ntstatKeyMix(h, _ntstatLoad64(p + 8));
+  }
+  return _ntstatKeyMix(h, addr.addr4.s_addr);
+}
+
+//----------------------------------------------------------
+// 64-bit hash of key.  NTStatKeyEqual keys hash the same.
+//----------------------------------------------------------
+inline uint64_t NTStatKeyHash(const NTStatStreamKey &key)
+{
+  uint64_t h = 0x2545F4914F6CDD1DULL;
+
+  h = _ntstatKeyMix(h, (uint64_t)key.isV6 | ((uint64_t)key.ipproto << 8) | ((uint64_t)key.ifindex << 32));
+  h = _ntstatKeyMix(h, (uint64_t)key.lport | ((uint64_t)key.rport << 16));
+
+  if (key.isV6) {
+    h = _ntstatMixAddr(h, 1, key.local);
+    h = _ntstatMixAddr(h, 1, key.remote);
+  } else {
+    h = _ntstatKeyMix(h, (uint64_t)key.local.addr4.s_addr | ((uint64_t)key.remote.addr4.s_addr << 32));
+  }
+  return _ntstatFmix64(h);
+}
+
+//----------------------------------------------------------
+// 64-bit hash of the remote end only: address, and with
+// withPort, ipproto and port too.
+//----------------------------------------------------------
+inline uint64_t NTStatRemoteHash(const NTStatStreamKey &key, bool withPort)
+{
+  uint64_t h = 0x2545F4914F6CDD1DULL;
+
+  h = _ntstatKeyMix(h, (uint64_t)key.isV6 | (withPort ? ((uint64_t)key.ipproto << 8) | ((uint64_t)key.rport << 16) : 0));
+  return _ntstatFmix64(_ntstatMixAddr(h, key.isV6, key.remote));
+}
+
+//----------------------------------------------------------
+// false for listeners and unconnected UDP
+//----------------------------------------------------------
+inline bool NTStatHasRemoteAddr(const NTStatStreamKey &key)
+{
+  if (key.isV6) {
+    const uint8_t* p = (const uint8_t*)&key.remote.addr6;
+    return (_ntstatLoad64(p) | _ntstatLoad64(p + 8)) != 0;
+  }
+  return key.remote.addr4.s_addr != 0;
+}
+
+#endif // _NT_STAT_KEY_HASH_H_
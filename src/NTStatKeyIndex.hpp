@@ -0,0 +1,159 @@
+#ifndef _NT_STAT_KEY_INDEX_H_
+#define _NT_STAT_KEY_INDEX_H_
+
+#include "NTStatKeyHash.hpp"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Open-addressing index from NTStatStreamKey to V, for flow lookups.
+ *
+ * Entries hold the key's NTStatKeyHash() and the value only; the key
+ * itself is read back through KeyOf()(value) when the hash matches, so
+ * the index never holds a stale copy of it.  Same layout as NTStatFlatMap:
+ * one power-of-2 array, linear probing, backward-shift erase.
+ *
+ * More than one value may have the same key (a stream closing while its
+ * replacement opens).  insert() keeps both, find() returns one of them,
+ * erase() removes exactly the value given.  Hash 0 marks an empty slot,
+ * and is stored as 1.
+ *
+ * V must be trivially copyable and V() means none (a pointer, typically).
+ * Not thread-safe.
+ */
+template <typename V, typename KeyOf>
+class NTStatKeyIndex
+{
+public:
+  NTStatKeyIndex() : _entries(0L), _capacity(0), _mask(0), _size(0) {}
+
+  ~NTStatKeyIndex() { free(_entries); }
+
+  uint32_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  /*
+   * Grow so that numEntries fit without rehashing.
+   */
+  void reserve(uint32_t numEntries)
+  {
+    uint32_t capacity = (_capacity > 0 ? _capacity : MIN_CAPACITY);
+    while (numEntries > _maxLoad(capacity)) capacity <<= 1;
+    if (capacity > _capacity) _rehash(capacity);
+  }
+
+  /*
+   * Add value under hash, which must be NTStatKeyHash(KeyOf()(value)).
+   */
+  void insert(uint64_t hash, V value)
+  {
+    if (_size + 1 > _maxLoad(_capacity)) _rehash(_capacity > 0 ? _capacity << 1 : MIN_CAPACITY);
+
+    hash = _stored(hash);
+    uint32_t i = _slot(hash);
+    while (_entries[i].hash != 0) i = (i + 1) & _mask;
+    _entries[i].hash = hash;
+    _entries[i].value = value;
+    _size++;
+  }
+
+  V find(const NTStatStreamKey &key) const { return find(key, NTStatKeyHash(key)); }
+
+  V find(const NTStatStreamKey &key, uint64_t hash) const
+  {
+    if (0 == _size) return V();
+
+    hash = _stored(hash);
+    KeyOf keyOf;
+    for (uint32_t i = _slot(hash); _entries[i].hash != 0; i = (i + 1) & _mask) {
+      if (_entries[i].hash == hash && NTStatKeyEqual(keyOf(_entries[i].value), key)) return _entries[i].value;
+    }
+    return V();
+  }
+
+  /*
+   * Remove value, inserted under hash.  Returns false if not present.
+   */
+  bool erase(uint64_t hash, V value)
+  {
+    if (0 == _size) return false;
+
+    hash = _stored(hash);
+    for (uint32_t i = _slot(hash); _entries[i].hash != 0; i = (i + 1) & _mask) {
+      if (_entries[i].hash == hash && _entries[i].value == value) {
+        _eraseIndex(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void clear()
+  {
+    if (_entries) memset(_entries, 0, sizeof(Entry) * _capacity);
+    _size = 0;
+  }
+
+private:
+  static const uint32_t MIN_CAPACITY = 16;
+
+  struct Entry
+  {
+    uint64_t  hash;
+    V         value;
+  };
+
+  static uint32_t _maxLoad(uint32_t capacity) { return capacity - (capacity >> 2); }
+
+  static uint64_t _stored(uint64_t hash) { return (hash != 0 ? hash : 1); }
+
+  // already mixed, the top bits will do
+  uint32_t _slot(uint64_t hash) const { return (uint32_t)(hash >> 32) & _mask; }
+
+  //----------------------------------------------------------
+  // remove entry at i, shifting back the rest of its probe run
+  //----------------------------------------------------------
+  void _eraseIndex(uint32_t i)
+  {
+    uint32_t hole = i;
+    for (uint32_t j = (i + 1) & _mask; _entries[j].hash != 0; j = (j + 1) & _mask) {
+      uint32_t home = _slot(_entries[j].hash);
+      if (((j - home) & _mask) >= ((j - hole) & _mask)) {
+        _entries[hole] = _entries[j];
+        hole = j;
+      }
+    }
+    _entries[hole].hash = 0;
+    _size--;
+  }
+
+  void _rehash(uint32_t capacity)
+  {
+    Entry* old = _entries;
+    uint32_t oldCapacity = _capacity;
+
+    _entries = (Entry*)calloc(capacity, sizeof(Entry));
+    if (0L == _entries) abort();
+    _capacity = capacity;
+    _mask = capacity - 1;
+
+    for (uint32_t i=0; i < oldCapacity; i++) {
+      if (old[i].hash == 0) continue;
+      uint32_t j = _slot(old[i].hash);
+      while (_entries[j].hash != 0) j = (j + 1) & _mask;
+      _entries[j] = old[i];
+    }
+    free(old);
+  }
+
+  Entry*      _entries;
+  uint32_t    _capacity;
+  uint32_t    _mask;
+  uint32_t    _size;
+};
+
+template <typename V, typename KeyOf>
+const uint32_t NTStatKeyIndex<V, KeyOf>::MIN_CAPACITY;
+
+#endif // _NT_STAT_KEY_INDEX_H_
@@ -0,0 +1,173 @@
+//  NTStatPoller.cpp
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "NTStatPoller.hpp"
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__APPLE__)
+#include <sys/event.h>
+#include <sys/time.h>
+#elif defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+// tags for the two registered fds
+
+#define POLLER_TAG_SOCKET 1
+#define POLLER_TAG_WAKE   2
+
+NTStatPoller::NTStatPoller() : _fd(-1), _pollFd(-1)
+{
+  _wakeFds[0] = _wakeFds[1] = -1;
+}
+
+NTStatPoller::~NTStatPoller()
+{
+  close();
+}
+
+//----------------------------------------------------------
+// open
+//----------------------------------------------------------
+bool NTStatPoller::open(int fd)
+{
+  close();
+
+  if (pipe(_wakeFds) != 0) {
+    fprintf(stderr,"pipe: %s\n", strerror(errno));
+    _wakeFds[0] = _wakeFds[1] = -1;
+    return false;
+  }
+  for (int i=0; i < 2; i++) {
+    fcntl(_wakeFds[i], F_SETFL, fcntl(_wakeFds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(_wakeFds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  _fd = fd;
+
+#if defined(__APPLE__)
+  if ((_pollFd = kqueue()) < 0) {
+    fprintf(stderr,"kqueue: %s\n", strerror(errno));
+    close();
+    return false;
+  }
+  struct kevent changes[2];
+  EV_SET(&changes[0], _fd, EVFILT_READ, EV_ADD, 0, 0, (void*)POLLER_TAG_SOCKET);
+  EV_SET(&changes[1], _wakeFds[0], EVFILT_READ, EV_ADD, 0, 0, (void*)POLLER_TAG_WAKE);
+  if (kevent(_pollFd, changes, 2, NULL, 0, NULL) < 0) {
+    fprintf(stderr,"kevent: %s\n", strerror(errno));
+    close();
+    return false;
+  }
+#elif defined(__linux__)
+  if ((_pollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    fprintf(stderr,"epoll_create1: %s\n", strerror(errno));
+    close();
+    return false;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = POLLER_TAG_SOCKET;
+  int rc = epoll_ctl(_pollFd, EPOLL_CTL_ADD, _fd, &ev);
+  ev.data.u32 = POLLER_TAG_WAKE;
+  if (rc == 0) rc = epoll_ctl(_pollFd, EPOLL_CTL_ADD, _wakeFds[0], &ev);
+  if (rc != 0) {
+    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
+    close();
+    return false;
+  }
+#endif
+
+  return true;
+}
+
+//----------------------------------------------------------
+// close
+//----------------------------------------------------------
+void NTStatPoller::close()
+{
+  if (_pollFd >= 0) ::close(_pollFd);
+  if (_wakeFds[0] >= 0) ::close(_wakeFds[0]);
+  if (_wakeFds[1] >= 0) ::close(_wakeFds[1]);
+  _pollFd = -1;
+  _wakeFds[0] = _wakeFds[1] = -1;
+  _fd = -1;
+}
+
+//----------------------------------------------------------
+// wait
+//----------------------------------------------------------
+int NTStatPoller::wait(int timeoutMs)
+{
+  if (_fd < 0) return -1;
+
+  bool readable = false;
+  bool woken = false;
+
+#if defined(__APPLE__)
+  struct timespec ts;
+  ts.tv_sec = timeoutMs / 1000;
+  ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+
+  struct kevent events[2];
+  int n = kevent(_pollFd, NULL, 0, events, 2, (timeoutMs < 0 ? NULL : &ts));
+  if (n < 0) return (errno == EINTR ? 0 : -1);
+
+  for (int i=0; i < n; i++) {
+    if ((uintptr_t)events[i].udata == POLLER_TAG_SOCKET) readable = true;
+    else woken = true;
+  }
+#elif defined(__linux__)
+  struct epoll_event events[2];
+  int n = epoll_wait(_pollFd, events, 2, timeoutMs);
+  if (n < 0) return (errno == EINTR ? 0 : -1);
+
+  for (int i=0; i < n; i++) {
+    if (events[i].data.u32 == POLLER_TAG_SOCKET) readable = true;
+    else woken = true;
+  }
+#else
+  struct pollfd pfds[2];
+  pfds[0].fd = _fd;
+  pfds[0].events = POLLIN;
+  pfds[0].revents = 0;
+  pfds[1].fd = _wakeFds[0];
+  pfds[1].events = POLLIN;
+  pfds[1].revents = 0;
+
+  int n = poll(pfds, 2, timeoutMs);
+  if (n < 0) return (errno == EINTR ? 0 : -1);
+
+  readable = (pfds[0].revents != 0);
+  woken = (pfds[1].revents != 0);
+#endif
+
+  if (woken) {
+    char tmp[64];
+    while (read(_wakeFds[0], tmp, sizeof(tmp)) > 0) ;
+  }
+
+  return (readable ? 1 : 0);
+}
+
+//----------------------------------------------------------
+// interrupt
+//----------------------------------------------------------
+void NTStatPoller::interrupt()
+{
+  if (_wakeFds[1] < 0) return;
+
+  char c = 0;
+  ssize_t rc = write(_wakeFds[1], &c, 1);
+  (void)rc;   // pipe full means a wakeup is already pending
+}
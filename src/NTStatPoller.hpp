@@ -0,0 +1,41 @@
+#ifndef _NT_STAT_POLLER_H_
+#define _NT_STAT_POLLER_H_
+
+/*
+ * Readiness wait on a single socket fd for the transports.
+ * The fd is registered once in open(): kqueue on Darwin, epoll on Linux,
+ * poll() elsewhere.  A self-pipe lets another thread interrupt a
+ * blocked wait(), so the caller can block with no timeout.
+ */
+class NTStatPoller
+{
+public:
+  NTStatPoller();
+  ~NTStatPoller();
+
+  /*
+   * Register fd.  Returns true on success.
+   */
+  bool open(int fd);
+
+  void close();
+
+  /*
+   * Block until fd is readable, timeoutMs elapses (< 0 means no timeout)
+   * or interrupt() is called.
+   * Returns 1 if readable, 0 on timeout or interrupt, -1 on error.
+   */
+  int wait(int timeoutMs);
+
+  /*
+   * Wake up a blocked wait().  Safe to call from any thread.
+   */
+  void interrupt();
+
+private:
+  int     _fd;
+  int     _pollFd;      // kqueue or epoll fd
+  int     _wakeFds[2];  // self-pipe
+};
+
+#endif // _NT_STAT_POLLER_H_
@@ -0,0 +1,164 @@
+#ifndef _NT_STAT_PROCESS_TABLE_H_
+#define _NT_STAT_PROCESS_TABLE_H_
+
+#include "../include/NetworkStatisticsClient.hpp"
+#include "NTStatFlatMap.hpp"
+#include "NTStatKeyHash.hpp"
+#include "NTStatHyperLogLog.hpp"
+#include <string.h>
+#include <vector>
+
+/*
+ * Per-process totals, updated incrementally as streams are reported:
+ *   addStream()     when the stream is first reported, with its counters
+ *   addDelta()      with each NTStatStreamDelta after that
+ *   removeStream()  when it closes, after the final delta
+ * so totals include closed streams and nothing is ever rescanned.
+ *
+ * Entries are keyed by pid.  A pid seen again under another name with no
+ * open streams starts over (the pid was reused).  Entries are kept for
+ * the life of the table, which the pid space bounds.  Stream holders keep
+ * the index addStream() returns and pass it back, so updates skip the
+ * lookup.
+ *
+ * Distinct remote hosts and endpoints are estimated with a pair of
+ * HyperLogLog sketches per process, allocated with its first stream that
+ * has a remote address.  Not thread-safe.
+ */
+class NTStatProcessTable
+{
+public:
+  enum { NONE = 0xFFFFFFFF };
+
+  NTStatProcessTable() : _index(), _procs(), _fanout() {}
+
+  ~NTStatProcessTable()
+  {
+    for (size_t i=0; i < _fanout.size(); i++) delete _fanout[i];
+  }
+
+  uint32_t size() const { return (uint32_t)_procs.size(); }
+
+  const std::vector<NTStatProcessStats>& all() const { return _procs; }
+
+  const NTStatProcessStats* find(uint32_t pid) const
+  {
+    NTStatFlatMap<uint32_t>::iterator it = _index.find(_key(pid));
+    return (it == _index.end() ? 0L : &_procs[it->second - 1]);
+  }
+
+  /*
+   * Count stream as open under its process.  Returns the process index.
+   */
+  uint32_t addStream(const NTStatStream &stream)
+  {
+    uint32_t &index = _index[_key(stream.process.pid)];
+    if (0 == index) {
+      _procs.push_back(NTStatProcessStats());
+      _fanout.push_back(0L);
+      index = (uint32_t)_procs.size();    // stored +1, 0 is a new entry
+    }
+
+    NTStatProcessStats &proc = _procs[index - 1];
+    Fanout* &fanout = _fanout[index - 1];
+    if (proc.activeStreams == 0 && strncmp(proc.process.name, stream.process.name, sizeof(proc.process.name)) != 0) {
+      memset(&proc, 0, sizeof(proc));
+      proc.process = stream.process;
+      if (fanout) { fanout->hosts.clear(); fanout->endpoints.clear(); }
+    }
+
+    proc.activeStreams++;
+    proc.totalStreams++;
+    _add(proc.totals, stream.stats);
+
+    if (NTStatHasRemoteAddr(stream.key)) {
+      if (0L == fanout) fanout = new Fanout();
+      fanout->hosts.add(NTStatRemoteHash(stream.key, false));
+      fanout->endpoints.add(NTStatRemoteHash(stream.key, true));
+      proc.remoteHosts = (uint32_t)fanout->hosts.estimate();
+      proc.remoteEndpoints = (uint32_t)fanout->endpoints.estimate();
+    }
+    return index - 1;
+  }
+
+  /*
+   * Fold in a stream's delta.  prevRate is the stream's perSecond from
+   * its previous delta, which the new one replaces in the process rate.
+   */
+  void addDelta(uint32_t index, const NTStatStreamDelta &delta, const NTStatRates &prevRate)
+  {
+    NTStatProcessStats &proc = _procs[index];
+    _add(proc.totals, delta.counts);
+    _addRates(proc.perSecond, delta.perSecond, prevRate);
+  }
+
+  /*
+   * Stream closed.  lastRate is the perSecond of its final delta.
+   */
+  void removeStream(uint32_t index, const NTStatRates &lastRate)
+  {
+    NTStatProcessStats &proc = _procs[index];
+    if (proc.activeStreams > 0) proc.activeStreams--;
+
+    // no open streams, no rate.  Also clears floating point residue.
+
+    if (0 == proc.activeStreams) {
+      memset(&proc.perSecond, 0, sizeof(proc.perSecond));
+    } else {
+      NTStatRates zero;
+      memset(&zero, 0, sizeof(zero));
+      _addRates(proc.perSecond, zero, lastRate);
+    }
+  }
+
+private:
+  struct Fanout
+  {
+    NTStatHyperLogLog   hosts;
+    NTStatHyperLogLog   endpoints;
+  };
+
+  // pid 0 (kernel_task) is a valid key, 0 is not
+  static uint64_t _key(uint32_t pid) { return (uint64_t)pid + 1; }
+
+  static void _add(NTStatCounters &dest, const NTStatCounters &src)
+  {
+    dest.rxpackets += src.rxpackets;
+    dest.txpackets += src.txpackets;
+    dest.rxbytes += src.rxbytes;
+    dest.txbytes += src.txbytes;
+    dest.cell_rxbytes += src.cell_rxbytes;
+    dest.cell_txbytes += src.cell_txbytes;
+    dest.wifi_rxbytes += src.wifi_rxbytes;
+    dest.wifi_txbytes += src.wifi_txbytes;
+    dest.wired_rxbytes += src.wired_rxbytes;
+    dest.wired_txbytes += src.wired_txbytes;
+  }
+
+  // dest += add - sub, not below 0
+  static void _addRates(NTStatRates &dest, const NTStatRates &add, const NTStatRates &sub)
+  {
+    _addRate(dest.rxpackets, add.rxpackets, sub.rxpackets);
+    _addRate(dest.txpackets, add.txpackets, sub.txpackets);
+    _addRate(dest.rxbytes, add.rxbytes, sub.rxbytes);
+    _addRate(dest.txbytes, add.txbytes, sub.txbytes);
+    _addRate(dest.cell_rxbytes, add.cell_rxbytes, sub.cell_rxbytes);
+    _addRate(dest.cell_txbytes, add.cell_txbytes, sub.cell_txbytes);
+    _addRate(dest.wifi_rxbytes, add.wifi_rxbytes, sub.wifi_rxbytes);
+    _addRate(dest.wifi_txbytes, add.wifi_txbytes, sub.wifi_txbytes);
+    _addRate(dest.wired_rxbytes, add.wired_rxbytes, sub.wired_rxbytes);
+    _addRate(dest.wired_txbytes, add.wired_txbytes, sub.wired_txbytes);
+  }
+
+  static void _addRate(double &dest, double add, double sub)
+  {
+    dest += add - sub;
+    if (dest < 0.0) dest = 0.0;
+  }
+
+  NTStatFlatMap<uint32_t>           _index;   // _key(pid) -> index in _procs, +1
+  std::vector<NTStatProcessStats>   _procs;
+  std::vector<Fanout*>              _fanout;  // same index as _procs, 0L until a remote is seen
+};
+
+#endif // _NT_STAT_PROCESS_TABLE_H_
@@ -0,0 +1,44 @@
+#ifndef _NT_STAT_RING_H_
+#define _NT_STAT_RING_H_
+
+#include <stdint.h>
+
+/*
+ * Fixed-capacity FIFO of inline T slots.  No allocation after construction,
+ * O(1) push_back/pop_front.  CAPACITY must be a power of 2.
+ * Not thread-safe.
+ */
+template <typename T, uint32_t CAPACITY>
+class NTStatRing
+{
+public:
+  NTStatRing() : _head(0), _tail(0) {}
+
+  bool empty() const { return _head == _tail; }
+  bool full() const { return (_tail - _head) == CAPACITY; }
+  uint32_t size() const { return _tail - _head; }
+  uint32_t capacity() const { return CAPACITY; }
+
+  /*
+   * Returns slot to fill in, or 0L if full.  The slot is not
+   * cleared, caller must set every field it uses.
+   */
+  T* push_back()
+  {
+    if (full()) return 0L;
+    return &_slots[_tail++ & (CAPACITY - 1)];
+  }
+
+  T& front() { return _slots[_head & (CAPACITY - 1)]; }
+
+  void pop_front() { if (!empty()) _head++; }
+
+private:
+  static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of 2");
+
+  T         _slots[CAPACITY];
+  uint32_t  _head;    // free-running, wraps
+  uint32_t  _tail;
+};
+
+#endif // _NT_STAT_RING_H_
@@ -0,0 +1,108 @@
+#ifndef _NT_STAT_SLAB_POOL_H_
+#define _NT_STAT_SLAB_POOL_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+/*
+ * Pool of T allocated SLAB_SIZE at a time, recycled through a free list.
+ * Slabs are only released when the pool is destroyed, so once the pool
+ * has grown to the working set (or reserve() was called), alloc() and
+ * free() do not touch the heap.
+ *
+ * Each slot has a generation that is incremented by free().  Holders of
+ * a T* that may outlive it keep generation(ptr) alongside and compare
+ * later, instead of dereferencing a recycled slot.
+ * Not thread-safe.
+ */
+template <typename T, uint32_t SLAB_SIZE = 256>
+class NTStatSlabPool
+{
+public:
+  NTStatSlabPool() : _slabs(), _freeList(0L), _numAllocated(0) {}
+
+  ~NTStatSlabPool()
+  {
+    // objects still allocated are not destructed, only their memory released
+
+    for (size_t i=0; i < _slabs.size(); i++) ::free(_slabs[i]);
+  }
+
+  /*
+   * Make room for capacity objects up front.
+   */
+  void reserve(uint32_t capacity)
+  {
+    while (this->capacity() < capacity) _addSlab();
+  }
+
+  /*
+   * Construct a T in a free slot.  Returns 0L if out of memory.
+   */
+  template <typename... Args>
+  T* alloc(Args&&... args)
+  {
+    if (0L == _freeList) _addSlab();
+    if (0L == _freeList) return 0L;
+
+    Slot* slot = _freeList;
+    _freeList = slot->next;
+    slot->next = 0L;
+    _numAllocated++;
+
+    return new (slot->storage) T(std::forward<Args>(args)...);
+  }
+
+  /*
+   * Destruct obj and return its slot to the free list.
+   */
+  void free(T* obj)
+  {
+    if (0L == obj) return;
+
+    Slot* slot = _slotOf(obj);
+    obj->~T();
+    slot->generation++;
+    slot->next = _freeList;
+    _freeList = slot;
+    _numAllocated--;
+  }
+
+  static uint32_t generation(const T* obj) { return _slotOf(obj)->generation; }
+
+  uint32_t size() const { return _numAllocated; }
+  uint32_t capacity() const { return (uint32_t)_slabs.size() * SLAB_SIZE; }
+
+private:
+  struct Slot
+  {
+    // storage first, so T* and Slot* are the same address
+    alignas(T) uint8_t  storage[sizeof(T)];
+    Slot*               next;
+    uint32_t            generation;
+  };
+
+  static Slot* _slotOf(const T* obj) { return (Slot*)(void*)obj; }
+
+  void _addSlab()
+  {
+    Slot* slab = (Slot*)malloc(sizeof(Slot) * SLAB_SIZE);
+    if (0L == slab) return;
+    _slabs.push_back(slab);
+
+    for (uint32_t i=SLAB_SIZE; i > 0; i--) {
+      slab[i-1].generation = 0;
+      slab[i-1].next = _freeList;
+      _freeList = &slab[i-1];
+    }
+  }
+
+  std::vector<Slot*>  _slabs;
+  Slot*               _freeList;
+  uint32_t            _numAllocated;
+};
+
+#endif // _NT_STAT_SLAB_POOL_H_
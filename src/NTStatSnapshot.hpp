@@ -0,0 +1,103 @@
+#ifndef _NT_STAT_SNAPSHOT_H_
+#define _NT_STAT_SNAPSHOT_H_
+
+#include "../include/NetworkStatisticsClient.hpp"
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+/*
+ * Snapshot storage.  NTStatSnapshot points into the vectors.
+ */
+struct NTStatSnapshotBuffer : public NTStatSnapshot
+{
+  NTStatSnapshotBuffer() : refs(0) {}
+
+  std::vector<NTStatStream>         streamData;
+  std::vector<NTStatProcessStats>   processData;
+  std::atomic<uint32_t>             refs;       // readers holding it (or about to check)
+};
+
+/*
+ * Hands snapshots built on one thread (the writer) to readers on any
+ * number of others, with no locks on either side.
+ *
+ * The writer fills a buffer no reader holds and publishes it as current.
+ * A reader counts itself on the current buffer, then checks that it is
+ * still current; if a publish got in between, it uncounts and retries.
+ * The writer only reuses a buffer that is not current and has no count,
+ * so a buffer is never written while a reader holds it, and a reader
+ * never uses a buffer it didn't see as current after counting itself.
+ * (Both steps are sequentially consistent, which is what makes the
+ * count visible to the writer's check.)
+ *
+ * At most MAX_BUFFERS exist.  If readers hold all but the current one,
+ * beginWrite() returns 0L and the writer skips that snapshot rather
+ * than wait.  Buffers keep their capacity, so steady state does not
+ * allocate.  Readers must release everything before destruction.
+ */
+class NTStatSnapshotPublisher
+{
+public:
+  enum { MAX_BUFFERS = 4 };
+
+  NTStatSnapshotPublisher() : _current(0L)
+  {
+    for (int i=0; i < MAX_BUFFERS; i++) _buffers[i] = 0L;
+  }
+
+  ~NTStatSnapshotPublisher()
+  {
+    for (int i=0; i < MAX_BUFFERS; i++) delete _buffers[i];
+  }
+
+  //----------------------------------------------------------
+  // writer: a buffer to fill, or 0L if readers hold them all
+  //----------------------------------------------------------
+  NTStatSnapshotBuffer* beginWrite()
+  {
+    NTStatSnapshotBuffer* current = _current.load();
+    for (int i=0; i < MAX_BUFFERS; i++) {
+      if (0L == _buffers[i]) return (_buffers[i] = new NTStatSnapshotBuffer());
+      if (_buffers[i] != current && 0 == _buffers[i]->refs.load()) return _buffers[i];
+    }
+    return 0L;
+  }
+
+  //----------------------------------------------------------
+  // writer: buffer from beginWrite() becomes current
+  //----------------------------------------------------------
+  void publish(NTStatSnapshotBuffer* buffer)
+  {
+    buffer->streams = buffer->streamData.data();
+    buffer->numStreams = (uint32_t)buffer->streamData.size();
+    buffer->processes = buffer->processData.data();
+    buffer->numProcesses = (uint32_t)buffer->processData.size();
+    _current.store(buffer);
+  }
+
+  //----------------------------------------------------------
+  // reader: current snapshot, 0L if none published yet
+  //----------------------------------------------------------
+  const NTStatSnapshot* acquire()
+  {
+    for (;;) {
+      NTStatSnapshotBuffer* buffer = _current.load();
+      if (0L == buffer) return 0L;
+      buffer->refs.fetch_add(1);
+      if (_current.load() == buffer) return buffer;
+      buffer->refs.fetch_sub(1);
+    }
+  }
+
+  void release(const NTStatSnapshot* snapshot)
+  {
+    if (snapshot) static_cast<NTStatSnapshotBuffer*>(const_cast<NTStatSnapshot*>(snapshot))->refs.fetch_sub(1);
+  }
+
+private:
+  NTStatSnapshotBuffer*               _buffers[MAX_BUFFERS];   // writer only, allocated as needed
+  std::atomic<NTStatSnapshotBuffer*>  _current;
+};
+
+#endif // _NT_STAT_SNAPSHOT_H_
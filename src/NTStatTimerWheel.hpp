@@ -0,0 +1,162 @@
+#ifndef _NT_STAT_TIMER_WHEEL_H_
+#define _NT_STAT_TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+ * Hierarchical timing wheel: 4 levels of 64 slots.  Level 0 slots are one
+ * tick wide, each level above is 64 times coarser, so with 100 ms ticks
+ * level 0 spans 6.4 s and level 3 about 19 days.  Deadlines further out
+ * are clamped to the top level and placed again when it comes around.
+ *
+ * schedule() is O(1).  advance() touches only the slots it passes and the
+ * items in them; items in coarser levels are moved down (cascaded) as
+ * their slot comes due, each at most once per level.
+ *
+ * There is no cancel.  Items are small values (ids, generations) that the
+ * owner checks when they fire, and reschedules if the deadline moved.
+ * Slot vectors keep their capacity, so steady state does not allocate.
+ * Not thread-safe.
+ */
+template <typename T>
+class NTStatTimerWheel
+{
+public:
+  NTStatTimerWheel(uint32_t tickMs = 100) : _tickMs(tickMs > 0 ? tickMs : 1), _nowTick(0), _size(0) {}
+
+  /*
+   * Start the clock at nowMs.  Drops anything scheduled.
+   */
+  void reset(uint64_t nowMs)
+  {
+    for (int level=0; level < LEVELS; level++)
+      for (int slot=0; slot < SLOTS; slot++) _slots[level][slot].clear();
+    _nowTick = nowMs / _tickMs;
+    _size = 0;
+  }
+
+  uint32_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  /*
+   * Fire item at or after deadlineMs (rounded up to a tick).
+   */
+  void schedule(uint64_t deadlineMs, const T& item)
+  {
+    uint64_t tick = (deadlineMs + _tickMs - 1) / _tickMs;
+    _place(tick > _nowTick ? tick : _nowTick + 1, item);
+    _size++;
+  }
+
+  /*
+   * Move the clock to nowMs, calling fn(item) for every item that came due.
+   * fn may schedule() more items.
+   */
+  template <typename F>
+  void advance(uint64_t nowMs, F fn)
+  {
+    uint64_t targetTick = nowMs / _tickMs;
+
+    while (_nowTick < targetTick)
+    {
+      if (0 == _size) { _nowTick = targetTick; return; }
+
+      _nowTick++;
+
+      // cascade coarser slots that start at this tick
+
+      for (int level=1; level < LEVELS; level++) {
+        if (_nowTick & ((1ULL << (SLOT_BITS * level)) - 1)) break;
+        _cascade(level, (_nowTick >> (SLOT_BITS * level)) & SLOT_MASK);
+      }
+
+      std::vector<Entry> &slot = _slots[0][_nowTick & SLOT_MASK];
+      if (slot.empty()) continue;
+
+      // swap out, so fn can schedule into this slot
+
+      _firing.swap(slot);
+      for (size_t i=0; i < _firing.size(); i++) {
+        _size--;
+        fn(_firing[i].item);
+      }
+      _firing.clear();
+    }
+  }
+
+  /*
+   * Milliseconds until advance() might have work, -1 if empty.
+   * Exact for items in level 0, otherwise the next cascade.
+   */
+  int msUntilNext(uint64_t nowMs) const
+  {
+    if (0 == _size) return -1;
+
+    uint64_t nextTick = (_nowTick | SLOT_MASK) + 1;   // next level 1 cascade
+    for (uint64_t tick = _nowTick + 1; tick < nextTick; tick++) {
+      if (!_slots[0][tick & SLOT_MASK].empty()) { nextTick = tick; break; }
+    }
+
+    uint64_t deadlineMs = nextTick * _tickMs;
+    if (deadlineMs <= nowMs) return 0;
+    uint64_t delta = deadlineMs - nowMs;
+    return (delta > 0x7fffffffULL ? 0x7fffffff : (int)delta);
+  }
+
+private:
+  enum { SLOT_BITS = 6, SLOTS = 1 << SLOT_BITS, SLOT_MASK = SLOTS - 1, LEVELS = 4 };
+
+  struct Entry
+  {
+    uint64_t  tick;
+    T         item;
+  };
+
+  //----------------------------------------------------------
+  // put item in the finest level whose span covers tick
+  //----------------------------------------------------------
+  void _place(uint64_t tick, const T& item)
+  {
+    Entry entry;
+    entry.tick = tick;
+    entry.item = item;
+
+    uint64_t delta = tick - _nowTick;
+    for (int level=0; level < LEVELS; level++) {
+      if (delta < (1ULL << (SLOT_BITS * (level + 1)))) {
+        _slots[level][(tick >> (SLOT_BITS * level)) & SLOT_MASK].push_back(entry);
+        return;
+      }
+    }
+
+    // beyond the top level: park in the top slot just behind now, replaced when it cascades
+
+    int top = LEVELS - 1;
+    _slots[top][((_nowTick >> (SLOT_BITS * top)) - 1) & SLOT_MASK].push_back(entry);
+  }
+
+  void _cascade(int level, uint64_t slotIndex)
+  {
+    std::vector<Entry> &slot = _slots[level][slotIndex];
+    if (slot.empty()) return;
+
+    _cascading.swap(slot);
+    for (size_t i=0; i < _cascading.size(); i++) {
+      Entry &entry = _cascading[i];
+      _place(entry.tick > _nowTick ? entry.tick : _nowTick, entry.item);
+    }
+    _cascading.clear();
+  }
+
+  uint32_t            _tickMs;
+  uint64_t            _nowTick;
+  uint32_t            _size;
+
+  std::vector<Entry>  _slots[LEVELS][SLOTS];
+  std::vector<Entry>  _firing;
+  std::vector<Entry>  _cascading;
+};
+
+#endif // _NT_STAT_TIMER_WHEEL_H_
@@ -0,0 +1,143 @@
+#ifndef _NT_STAT_TOP_K_H_
+#define _NT_STAT_TOP_K_H_
+
+#include "NTStatFlatMap.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+/*
+ * Heavy hitters by weight, in bounded memory (Space-Saving, Metwally et
+ * al.).  Keeps at most capacity counters.  A key not being counted takes
+ * over the smallest counter and inherits its count as error, so counts
+ * overestimate by at most error, and any key whose true total exceeds
+ * (sum of weights) / capacity is always among the counters.  Track a few
+ * times more keys than the top you report.
+ *
+ * Counters are a min-heap on count, indexed by key: add() is a lookup and
+ * an O(log capacity) sift, top() sorts only the counters it returns.
+ * T is a label the caller fills in when a key gets a counter, so the
+ * common case (key already counted) builds no label.  Key 0 can't be
+ * stored.  Not thread-safe.
+ */
+template <typename T>
+class NTStatTopK
+{
+public:
+  struct Counter
+  {
+    uint64_t  key;
+    uint64_t  count;
+    uint64_t  error;    // count overestimates by at most this
+    T         item;
+  };
+
+  NTStatTopK() : _capacity(0) {}
+
+  uint32_t capacity() const { return _capacity; }
+  uint32_t size() const { return (uint32_t)_heap.size(); }
+
+  /*
+   * Drop all counters and keep at most capacity from now on.
+   */
+  void reset(uint32_t capacity)
+  {
+    _capacity = capacity;
+    _heap.clear();
+    _heap.reserve(capacity);
+    _index.clear();
+    _index.reserve(capacity);
+  }
+
+  /*
+   * Add weight to key.  Returns the label to fill in if key just got a
+   * counter, 0L otherwise.
+   */
+  T* add(uint64_t key, uint64_t weight)
+  {
+    if (0 == _capacity || 0 == key || 0 == weight) return 0L;
+
+    NTStatFlatMap<uint32_t>::iterator it = _index.find(key);
+    if (it != _index.end()) {
+      uint32_t pos = it->second - 1;
+      _heap[pos].count += weight;
+      _siftDown(pos);
+      return 0L;
+    }
+
+    if (_heap.size() < _capacity) {
+      Counter c;
+      c.key = key;
+      c.count = weight;
+      c.error = 0;
+      _heap.push_back(c);
+      _index[key] = (uint32_t)_heap.size();
+      return &_heap[_siftUp((uint32_t)_heap.size() - 1)].item;
+    }
+
+    // evict the smallest, whose count the newcomer may already have had
+
+    Counter &min = _heap[0];
+    _index.erase(min.key);
+    min.error = min.count;
+    min.count += weight;
+    min.key = key;
+    _index[key] = 1;
+    return &_heap[_siftDown(0)].item;
+  }
+
+  /*
+   * Copy the largest maxEntries counters into dest, largest first.
+   * Returns the number copied.
+   */
+  uint32_t top(Counter* dest, uint32_t maxEntries) const
+  {
+    uint32_t n = std::min(maxEntries, (uint32_t)_heap.size());
+    std::partial_sort_copy(_heap.begin(), _heap.end(), dest, dest + n, _greater);
+    return n;
+  }
+
+private:
+  static bool _greater(const Counter &a, const Counter &b) { return a.count > b.count; }
+
+  void _swap(uint32_t a, uint32_t b)
+  {
+    std::swap(_heap[a], _heap[b]);
+    _index[_heap[a].key] = a + 1;
+    _index[_heap[b].key] = b + 1;
+  }
+
+  // both return where the counter ended up
+
+  uint32_t _siftUp(uint32_t pos)
+  {
+    while (pos > 0) {
+      uint32_t parent = (pos - 1) / 2;
+      if (_heap[parent].count <= _heap[pos].count) break;
+      _swap(parent, pos);
+      pos = parent;
+    }
+    return pos;
+  }
+
+  uint32_t _siftDown(uint32_t pos)
+  {
+    uint32_t size = (uint32_t)_heap.size();
+    for (;;) {
+      uint32_t least = pos;
+      uint32_t left = pos * 2 + 1, right = left + 1;
+      if (left < size && _heap[left].count < _heap[least].count) least = left;
+      if (right < size && _heap[right].count < _heap[least].count) least = right;
+      if (least == pos) break;
+      _swap(least, pos);
+      pos = least;
+    }
+    return pos;
+  }
+
+  uint32_t                  _capacity;
+  std::vector<Counter>      _heap;    // min-heap on count
+  NTStatFlatMap<uint32_t>   _index;   // key -> position in _heap, +1
+};
+
+#endif // _NT_STAT_TOP_K_H_
@@ -0,0 +1,175 @@
+//  NTStatTransportKctl.cpp
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "../include/NTStatTransport.hpp"
+#include "NTStatPoller.hpp"
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __APPLE__
+#include <sys/sys_domain.h>
+#include <sys/kern_control.h>
+#endif
+
+#define      NET_STAT_CONTROL_NAME   "com.apple.network.statistics"
+
+unsigned int getXnuVersion();
+
+/*
+ * Transport over the com.apple.network.statistics kernel control socket.
+ */
+class NTStatTransportKctl : public NTStatTransport
+{
+public:
+  NTStatTransportKctl() : _fd(0) {}
+
+  virtual ~NTStatTransportKctl() { close(); }
+
+  //------------------------------------------------------------------------
+  // returns true on success, false otherwise
+  //------------------------------------------------------------------------
+  virtual bool open()
+  {
+#ifdef __APPLE__
+    // create socket
+
+    if ((_fd = socket(PF_SYSTEM, SOCK_DGRAM, SYSPROTO_CONTROL)) == -1) {
+      fprintf(stderr,"socket(SYSPROTO_CONTROL): %s", strerror(errno));
+      _fd = 0;
+      return false;
+    }
+
+    // init ctl_info
+
+    struct ctl_info ctlInfo;
+    memset(&ctlInfo, 0, sizeof(ctlInfo));
+
+    // copy name and make sure the name isn't too long
+
+    if (strlcpy(ctlInfo.ctl_name, NET_STAT_CONTROL_NAME, sizeof(ctlInfo.ctl_name)) >=
+        sizeof(ctlInfo.ctl_name)) {
+      fprintf(stderr,"CONTROL NAME too long");
+      close();
+      return false;
+    }
+
+    // iotcl ctl info
+    if (ioctl(_fd, CTLIOCGINFO, &ctlInfo)) { //} == -1) {
+      fprintf(stderr,"ioctl(CTLIOCGINFO): %s", strerror(errno));
+      close();
+      return false;
+    }
+
+    // connect socket
+
+    struct sockaddr_ctl sc;
+    memset(&sc, 0, sizeof(sc));
+    sc.sc_id = ctlInfo.ctl_id;
+    sc.sc_len = sizeof(sc);
+    sc.sc_family = AF_SYSTEM;
+    sc.ss_sysaddr = AF_SYS_CONTROL;
+
+    sc.sc_unit = 0 ;           /* zero means unspecified */
+
+    if (connect(_fd, (struct sockaddr *)&sc, sizeof(sc)) != 0)
+    {
+      fprintf(stderr,"connect(AF_SYS_CONTROL): %s\n", strerror(errno));
+    } else if (_poller.open(_fd)) {
+      return true;
+    }
+
+    // no dice
+
+    close();
+    return false;
+#else
+    fprintf(stderr,"kernel control socket not available on this platform\n");
+    return false;
+#endif
+  }
+
+  virtual void close()
+  {
+    _poller.close();
+    if (_fd > 0) ::close(_fd);
+    _fd = 0;
+  }
+
+  virtual bool isOpen() { return (_fd > 0); }
+
+  virtual unsigned int getXnuVersion() { return ::getXnuVersion(); }
+
+  virtual bool send(const void* msg, size_t msglen)
+  {
+    ssize_t rc = write (_fd, msg, msglen);
+    return (rc == (ssize_t)msglen);
+  }
+
+  //----------------------------------------------------------
+  // The KCQ socket is really a queue.  Each recvmsg() returns
+  // one message.  Darwin has no recvmmsg(), so loop until
+  // the queue is empty or msgs is full.  recvmsg() rather
+  // than recv() for MSG_TRUNC.
+  //----------------------------------------------------------
+  virtual int recvBatch(NTStatRecvMsg* msgs, int maxMsgs)
+  {
+    int i = 0;
+    for (; i < maxMsgs; i++)
+    {
+      struct iovec iov;
+      struct msghdr hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      iov.iov_base = msgs[i].data;
+      iov.iov_len = msgs[i].capacity;
+      hdr.msg_iov = &iov;
+      hdr.msg_iovlen = 1;
+
+      ssize_t num_bytes = recvmsg (_fd, &hdr, MSG_DONTWAIT);
+      if (num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+      if (num_bytes <= 0) return (i > 0 ? i : -1);
+
+      msgs[i].length = (uint32_t)num_bytes;
+      msgs[i].truncated = ((hdr.msg_flags & MSG_TRUNC) != 0);
+    }
+    return i;
+  }
+
+  //----------------------------------------------------------
+  // SO_RCVBUF.  For a kernel control socket this is how much
+  // the kernel can queue for us before ntstat gets ENOBUFS and
+  // drops messages.  Fails above kern.ipc.maxsockbuf.  Returns
+  // what getsockopt() reports back.
+  //----------------------------------------------------------
+  virtual uint32_t setRecvBufferSize(uint32_t bytes)
+  {
+    int val = (int)bytes;
+    if (_fd <= 0 || setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)) != 0) return 0;
+
+    socklen_t len = sizeof(val);
+    if (getsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &val, &len) != 0 || val < 0) return 0;
+    return (uint32_t)val;
+  }
+
+  //----------------------------------------------------------
+  // socket is registered with the poller once, in open()
+  //----------------------------------------------------------
+  virtual int wait(int timeoutMs) { return _poller.wait(timeoutMs); }
+
+  virtual void interrupt() { _poller.interrupt(); }
+
+private:
+  NTStatPoller    _poller;
+  int             _fd;
+};
+
+NTStatTransport* NTStatTransportNewKctl() {
+  return new NTStatTransportKctl();
+}
@@ -0,0 +1,181 @@
+//  NTStatTransportUnix.cpp
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#include "../include/NTStatTransport.hpp"
+#include "NTStatPoller.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+using namespace std;
+
+#define RECV_BATCH_MAX 64
+
+/*
+ * Transport over an AF_UNIX SOCK_SEQPACKET socket.  SEQPACKET preserves
+ * message boundaries like the kernel control socket does, so the peer
+ * (e.g. the ntstat simulator) can write the same structs the kernel would.
+ * Note: Darwin does not support SOCK_SEQPACKET for AF_UNIX.
+ */
+class NTStatTransportUnix : public NTStatTransport
+{
+public:
+  NTStatTransportUnix(int fd, unsigned int xnuVersion) : _fd(fd), _path(), _xnuVersion(xnuVersion) {}
+
+  NTStatTransportUnix(const char* path, unsigned int xnuVersion) : _fd(0), _path(path), _xnuVersion(xnuVersion) {}
+
+  virtual ~NTStatTransportUnix() { close(); }
+
+  //------------------------------------------------------------------------
+  // returns true on success, false otherwise
+  //------------------------------------------------------------------------
+  virtual bool open()
+  {
+    if (_fd > 0) return _poller.open(_fd);   // adopted fd
+
+    if (_path.empty()) return false;
+
+    if ((_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+      fprintf(stderr,"socket(AF_UNIX): %s\n", strerror(errno));
+      _fd = 0;
+      return false;
+    }
+
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+
+    if (_path.size() >= sizeof(sa.sun_path)) {
+      fprintf(stderr,"unix socket path too long\n");
+      close();
+      return false;
+    }
+    strcpy(sa.sun_path, _path.c_str());
+
+    if (connect(_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+      fprintf(stderr,"connect(%s): %s\n", _path.c_str(), strerror(errno));
+      close();
+      return false;
+    }
+
+    if (!_poller.open(_fd)) {
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  virtual void close()
+  {
+    _poller.close();
+    if (_fd > 0) ::close(_fd);
+    _fd = 0;
+  }
+
+  virtual bool isOpen() { return (_fd > 0); }
+
+  virtual unsigned int getXnuVersion() { return _xnuVersion; }
+
+  virtual bool send(const void* msg, size_t msglen)
+  {
+    ssize_t rc = ::send(_fd, msg, msglen, 0);
+    return (rc == (ssize_t)msglen);
+  }
+
+  //----------------------------------------------------------
+  // One recvmmsg() per batch on Linux, recvmsg() loop elsewhere.
+  //----------------------------------------------------------
+  virtual int recvBatch(NTStatRecvMsg* msgs, int maxMsgs)
+  {
+#ifdef __linux__
+    if (maxMsgs > RECV_BATCH_MAX) maxMsgs = RECV_BATCH_MAX;
+    if (maxMsgs <= 0) return 0;
+
+    struct mmsghdr hdrs[RECV_BATCH_MAX];
+    struct iovec iovs[RECV_BATCH_MAX];
+    memset(hdrs, 0, sizeof(struct mmsghdr) * maxMsgs);
+    for (int i=0; i < maxMsgs; i++) {
+      iovs[i].iov_base = msgs[i].data;
+      iovs[i].iov_len = msgs[i].capacity;
+      hdrs[i].msg_hdr.msg_iov = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(_fd, hdrs, maxMsgs, MSG_DONTWAIT, NULL);
+    if (n < 0) return ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1);
+
+    // zero length message means peer closed
+
+    int i = 0;
+    for (; i < n && hdrs[i].msg_len > 0; i++) {
+      msgs[i].length = hdrs[i].msg_len;
+      msgs[i].truncated = ((hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0);
+    }
+    return ((i == 0 && n > 0) ? -1 : i);
+#else
+    int i = 0;
+    for (; i < maxMsgs; i++)
+    {
+      struct iovec iov;
+      struct msghdr hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      iov.iov_base = msgs[i].data;
+      iov.iov_len = msgs[i].capacity;
+      hdr.msg_iov = &iov;
+      hdr.msg_iovlen = 1;
+
+      ssize_t num_bytes = recvmsg(_fd, &hdr, MSG_DONTWAIT);
+      if (num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+      if (num_bytes <= 0) return (i > 0 ? i : -1);
+
+      msgs[i].length = (uint32_t)num_bytes;
+      msgs[i].truncated = ((hdr.msg_flags & MSG_TRUNC) != 0);
+    }
+    return i;
+#endif
+  }
+
+  //----------------------------------------------------------
+  // SO_RCVBUF.  Returns what getsockopt() reports back, which
+  // on Linux is double the request (bookkeeping overhead).
+  //----------------------------------------------------------
+  virtual uint32_t setRecvBufferSize(uint32_t bytes)
+  {
+    int val = (int)bytes;
+    if (_fd <= 0 || setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)) != 0) return 0;
+
+    socklen_t len = sizeof(val);
+    if (getsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &val, &len) != 0 || val < 0) return 0;
+    return (uint32_t)val;
+  }
+
+  //----------------------------------------------------------
+  // socket is registered with the poller once, in open()
+  //----------------------------------------------------------
+  virtual int wait(int timeoutMs) { return _poller.wait(timeoutMs); }
+
+  virtual void interrupt() { _poller.interrupt(); }
+
+private:
+  NTStatPoller    _poller;
+  int             _fd;
+  string          _path;
+  unsigned int    _xnuVersion;
+};
+
+NTStatTransport* NTStatTransportNewUnix(int fd, unsigned int xnuVersion) {
+  return new NTStatTransportUnix(fd, xnuVersion);
+}
+
+NTStatTransport* NTStatTransportNewUnix(const char* path, unsigned int xnuVersion) {
+  return new NTStatTransportUnix(path, xnuVersion);
+}
@@ -0,0 +1,2624 @@
+//  NetworkStatisticsClientImpl.hpp
+//
+//  Copyright © 2017 Alex Malone. All rights reserved.
+
+#ifndef _NT_STAT_CLIENT_IMPL_H_
+#define _NT_STAT_CLIENT_IMPL_H_
+
+// typical order of message received for a stream:
+//
+// T RECV <    0 type:SRC_ADDED(10001) len:28 srcRef:20
+// ..
+// T RECV <    0 type:SRC_COUNTS(10004) len:144 srcRef:20
+// T RECV <    0 type:SRC_DESC(10003) len:296 srcRef:20
+// T RECV <    0 type:SRC_REMOVED(10002) len:24 srcRef:20
+
+
+#include "NTStatKernelStructHandler.hpp"
+#include "../include/NTStatTransport.hpp"
+#include "NTStatDeadlineQueue.hpp"
+#include "NTStatRing.hpp"
+#include "NTStatSlabPool.hpp"
+#include "NTStatFlatMap.hpp"
+#include "NTStatTimerWheel.hpp"
+#include "NTStatProcessTable.hpp"
+#include "NTStatKeyIndex.hpp"
+#include "NTStatTopK.hpp"
+#include "NTStatSnapshot.hpp"
+#include "NTStatEventRing.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include <sys/utsname.h>
+#include <arpa/inet.h>
+
+#include <string.h> // memcmp
+#include <stddef.h> // offsetof
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <map>
+#include <vector>
+
+// references to the factory functions to allocate struct handlers for kernel versions
+
+NTStatKernelStructHandler* NewNTStatKernel2422();
+NTStatKernelStructHandler* NewNTStatKernel2782();
+NTStatKernelStructHandler* NewNTStatKernel3789();
+NTStatKernelStructHandler* NewNTStatKernel3248();
+NTStatKernelStructHandler* NewNTStatKernel4570();
+
+unsigned int getXnuVersion();
+void getInterfaceIndexes(std::vector<uint32_t> &dest);
+
+/*
+ * The client lives in this header so that each ntstat_kernel_XXXX.cpp can
+ * instantiate its run loop with the concrete struct handler (see runLoop).
+ * Those files also include their version's ntstat.h, so the definitions
+ * below are kept in their own namespace.
+ */
+
+namespace ntstat_client {
+
+class NetworkStatisticsClientImpl;
+
+// run loops specialized per version, defined in ntstat_kernel_XXXX.cpp
+
+typedef void (*RunLoopFn)(NetworkStatisticsClientImpl* client, NTStatKernelStructHandler* handler);
+
+void RunLoop2422(NetworkStatisticsClientImpl* client, NTStatKernelStructHandler* handler);
+void RunLoop2782(NetworkStatisticsClientImpl* client, NTStatKernelStructHandler* handler);
+void RunLoop3248(NetworkStatisticsClientImpl* client, NTStatKernelStructHandler* handler);
+void RunLoop3789(NetworkStatisticsClientImpl* client, NTStatKernelStructHandler* handler);
+void RunLoop4570(NetworkStatisticsClientImpl* client, NTStatKernelStructHandler* handler);
+
+// minimum ntstat.h definitions needed here
+
+enum
+{
+  // generic response messages
+  NSTAT_MSG_TYPE_SUCCESS                  = 0
+  ,NSTAT_MSG_TYPE_ERROR                   = 1
+
+  // Requests
+  ,NSTAT_MSG_TYPE_ADD_SRC                 = 1001
+  ,NSTAT_MSG_TYPE_ADD_ALL_SRCS            = 1002
+  ,NSTAT_MSG_TYPE_REM_SRC                 = 1003
+  ,NSTAT_MSG_TYPE_QUERY_SRC               = 1004
+  ,NSTAT_MSG_TYPE_GET_SRC_DESC            = 1005
+  ,NSTAT_MSG_TYPE_GET_UPDATE              = 1007
+
+  // Responses/Notfications
+  ,NSTAT_MSG_TYPE_SRC_ADDED               = 10001
+  ,NSTAT_MSG_TYPE_SRC_REMOVED             = 10002
+  ,NSTAT_MSG_TYPE_SRC_DESC                = 10003
+  ,NSTAT_MSG_TYPE_SRC_COUNTS              = 10004
+  ,NSTAT_MSG_TYPE_SRC_UPDATE              = 10006
+};
+
+#ifndef NSTAT_MSG_HDR_FLAG_CONTINUATION
+#define NSTAT_MSG_HDR_FLAG_CONTINUATION (1 << 1)   // xnu-3248+
+#endif
+
+
+typedef struct nstat_msg_error
+{
+  nstat_msg_hdr   hdr;
+  u_int32_t               error;  // errno error
+} nstat_msg_error;
+
+// local defs
+
+#define REMOVED_SOURCE_RETENTION_MS_DEFAULT 30000
+#define UPDATE_STATS_INTERVAL_SECONDS 30
+#define TIMER_WHEEL_TICK_MS 100
+#define MAX_INTERFACES 128    // ADD_SRC requests queued at once, within OUTQ_CAPACITY
+
+// request window (AIMD)
+
+#define REQUEST_WINDOW_INITIAL 4
+#define REQUEST_WINDOW_MAX_DEFAULT 64
+#define REQUEST_TIMEOUT_MS_DEFAULT 2000
+
+// run loop timers.  Per-source and per-request expiry is on the timer wheel.
+
+enum {
+  TIMER_UPDATE = 1,
+  TIMER_SNAPSHOT,
+  TIMER_SEND_RETRY
+};
+
+const uint32_t SEND_RETRY_MS = 100;   // pause after the transport fails SEND_FAILS_TO_PAUSE sends in a row
+const uint32_t SEND_FAILS_TO_PAUSE = 3;
+const int RECV_BATCH_SIZE = 32;   // messages per NTStatTransport::recvBatch()
+const uint32_t RECV_SLOT_ALIGN = 64;  // receive arena slots start on a cache line
+
+// async dispatch (setAsyncDispatch)
+
+const uint32_t DISPATCH_SPINS = 64;         // yields before the idle dispatch thread parks
+const int EVENT_BACKLOG_RETRY_MS = 1;       // run loop retries a coalescing backlog this often
+
+// getMetrics() reads NTStatClientMetrics as this many 64-bit words
+
+const int METRICS_WORDS = sizeof(NTStatClientMetrics) / sizeof(uint64_t);
+static_assert(sizeof(NTStatClientMetrics) % sizeof(uint64_t) == 0, "NTStatClientMetrics is not whole 64-bit words");
+
+std::string msg_name(uint32_t msg_type);
+char msg_dir(uint32_t msg_type);
+
+#define LOG_ERROR(a)     if (_logFlags & NTSTAT_LOGF_ERROR) printf a
+#define LOG_SENDRECV(a)  if (_logFlags & NTSTAT_LOGF_SENDRECV) printf a
+#define LOG_DEBUG(a)     if (_logFlags & NTSTAT_LOGF_DEBUG) printf a
+#define LOG_TRACE(a)     if (_logFlags & NTSTAT_LOGF_TRACE) printf a
+#define LOG_DROPS(a)     if (_logFlags & NTSTAT_LOGF_DROPS) printf a
+
+/*
+ * Wrapper around NTStatStream so we can track srcRef
+ */
+struct NetstatSource
+{
+  NetstatSource(uint64_t srcRef, uint32_t providerId) : _srcRef(srcRef), _providerId(providerId), obj(),
+   _haveDesc(false), _haveNotifiedAdded(false), _requestedCount(false), _descRequestQueued(false), _filteredOut(false),
+   _tsAdded(0L), _tsRemoved(0L), _tsLastUpdate(0L), _tsRemovedMs(0), _reportedStats(), _tsReportedMs(0),
+   _procIndex(NTStatProcessTable::NONE), _keyHash(0), _keyIndexed(false), _removedPrev(0L), _removedNext(0L), _iface(0L) {}
+
+  // run by SourcePool::free(), the only place a source is released
+  ~NetstatSource() { delete _iface; }
+
+  NetstatSource(const NetstatSource&) = delete;
+  NetstatSource& operator=(const NetstatSource&) = delete;
+
+  uint64_t _srcRef;
+  uint32_t _providerId;
+  NTStatStream obj;
+
+  bool     _haveDesc;
+  bool     _haveNotifiedAdded;
+  bool     _requestedCount;
+  bool     _descRequestQueued;  // GET_SRC_DESC in outq
+  bool     _filteredOut;        // rejected by client side of NTStatFilterConfig
+
+  time_t   _tsAdded;
+  time_t   _tsRemoved;
+  time_t   _tsLastUpdate;
+  uint64_t _tsRemovedMs;        // NTStatMonotonicMs()
+
+  NTStatCounters _reportedStats;  // obj.stats as last passed to the listener
+  uint64_t _tsReportedMs;         // NTStatMonotonicMs() of that
+  uint32_t _procIndex;            // in the process table, NONE until reported
+  uint64_t _keyHash;              // obj.key.hash() when put in the key index
+  bool     _keyIndexed;           // in the key index: reported, not yet removed
+  NetstatSource* _removedPrev;    // removed sources list, while _tsRemoved > 0
+  NetstatSource* _removedNext;
+
+  NTStatInterface* _iface;        // interface (ifnet) sources only, counts are kept here.  Owned
+};
+
+// NetstatSource objects are recycled once removed sources expire
+
+typedef NTStatSlabPool<NetstatSource> SourcePool;
+
+// srcRef -> source
+
+typedef NTStatFlatMap<NetstatSource*> SourceMap;
+
+// obj.key -> open, reported source
+
+struct NetstatSourceKeyOf
+{
+  const NTStatStreamKey& operator()(const NetstatSource* source) const { return source->obj.key; }
+};
+
+typedef NTStatKeyIndex<NetstatSource*, NetstatSourceKeyOf> SourceKeyIndex;
+
+// listener callback queued for the dispatch thread (setAsyncDispatch)
+
+enum {
+  EVENT_STREAM_ADDED = 1,
+  EVENT_STREAM_REMOVED,
+  EVENT_STREAM_UPDATE,
+  EVENT_INTERFACE_UPDATE
+};
+
+struct NTStatEvent
+{
+  uint32_t  type;     // EVENT_*
+  uint64_t  srcRef;   // updates of the same source coalesce
+  union {
+    NTStatStream     stream;
+    NTStatInterface  iface;
+  };
+};
+
+typedef NTStatEventRing<NTStatEvent> EventRing;
+
+/*
+ * Timer wheel entry.  id is the pool generation of source, or the
+ * seqnum of a request.
+ */
+enum {
+  WHEEL_SOURCE_EXPIRY = 1   // removed source retention is over
+  ,WHEEL_SOURCE_POLL        // time to request counts for source
+  ,WHEEL_REQUEST_TIMEOUT
+};
+
+struct WheelItem
+{
+  uint32_t        kind;
+  NetstatSource*  source;
+  uint64_t        id;
+};
+
+// tracking of messages.  Every request struct is under QMSG_MAX_LEN bytes
+// (56 for the largest, ADD_ALL_SRCS in 3789+), so bytes are kept inline and
+// a QMsg can be queued and copied without allocating.
+
+#define QMSG_MAX_LEN 64
+#define OUTQ_CAPACITY 256
+
+struct QMsg
+{
+  QMsg() : seqnum(0), ntsrc(0L), ntsrcGen(0), sendIndex(0), tsSentMs(0), msglen(0) {}
+
+  nstat_msg_hdr* hdr() { return (nstat_msg_hdr*)msgbytes; }
+
+  uint64_t         seqnum;
+  NetstatSource*   ntsrc;       // check ntsrcGen before use, see _liveSource()
+  uint32_t         ntsrcGen;
+  uint64_t         sendIndex;   // value of requestsSent when sent
+  uint64_t         tsSentMs;
+  uint16_t         msglen;      // 0 if empty
+  uint8_t          msgbytes[QMSG_MAX_LEN] __attribute__((aligned(8)));
+};
+
+// request waiting for a response, at _inflight[context % INFLIGHT_CAPACITY].
+// Only what is needed to match the response, adjust the window and retry;
+// the request bytes are not kept once sent.  Contexts are 64-bit and
+// never reused, so a stale response can't match a newer request.
+
+#define INFLIGHT_CAPACITY 1024    // power of 2, upper bound on the request window
+
+struct InFlightReq
+{
+  uint64_t         context;     // 0 if slot is free
+  uint64_t         srcRef;
+  uint64_t         sendIndex;   // value of requestsSent when sent
+  uint64_t         tsSentMs;
+  uint32_t         type;
+  uint32_t         providerId;
+};
+
+typedef enum {
+  STATE_START
+  ,STATE_REQUEST_IFNET_SRC
+  ,STATE_REQUEST_TCP_SRC
+  ,STATE_REQUEST_UDP_SRC
+  ,STATE_RUNNING
+} state_t;
+
+#define NOT_FATAL(errno) (ENOBUFS == (errno) || 0 == (errno))
+
+/*
+ * Implementation of NetworkStatisticsClient
+ */
+class NetworkStatisticsClientImpl final : public NetworkStatisticsClient, public MsgDest
+{
+public:
+  NetworkStatisticsClientImpl(NetworkStatisticsListener* listener): _listener(listener), _map(), _removedHead(0L), _removedTail(0L), _keepRunning(false),
+   _transport(0L), _structHandler(0L), _runLoop(0L), _virtualDispatch(false), _state(STATE_START), _sendPaused(false), _sendFailStreak(0), _seqnum(1), _numInFlight(0),
+   _wantTcp(true), _wantUdp(false), _wantKernel(false), _wantInterfaces(false), _ifnetThreshold(NTSTAT_IFNET_THRESHOLD_MIN),
+   _ifnetAddsPending(0), _updateIntervalSeconds(30), _filter(),
+   _recordEnabled(false), _recordFd(0), _numDrops(0), _numErrors(0),_logFlags(0),
+   _mapWaitingForDesc(), _mapWaitingForCount(), _recvBufferBytes(0), _rxArena(0L), _rxSlotSize(0),
+   _window(REQUEST_WINDOW_INITIAL),
+   _maxWindow(REQUEST_WINDOW_MAX_DEFAULT), _decreaseMark(0),
+   _wheel(TIMER_WHEEL_TICK_MS), _removedRetentionMs(REMOVED_SOURCE_RETENTION_MS_DEFAULT), _requestTimeoutMs(REQUEST_TIMEOUT_MS_DEFAULT),
+   _armedRetentionMs(REMOVED_SOURCE_RETENTION_MS_DEFAULT), _armedTimeoutMs(REQUEST_TIMEOUT_MS_DEFAULT),
+   _rand(0x2545F4914F6CDD1DULL),
+   _bulkCounts(false), _bulkQueryRejected(false), _bulkContinuation(false), _bulkQueryContext(0),
+   _metrics(), _topEntries(0),
+   _snapshotIntervalMs(0), _snapshotSeq(0),
+   _asyncCapacity(0), _overflowPolicy(NTSTAT_OVERFLOW_DROP_NEWEST), _events(0L), _backlogBase(0), _backlogSize(0),
+   _dispatchParked(false), _dispatchStop(false)
+  {
+    INC_QMSG();
+
+    memset(_inflight, 0, sizeof(_inflight));
+    memset(_rxMsgs, 0, sizeof(_rxMsgs));
+    _publishMetrics();
+  }
+
+  virtual ~NetworkStatisticsClientImpl()
+  {
+    for (auto it = _map.begin(); it != _map.end(); it++) _freeSource(it->second);
+    _map.clear();
+
+    delete _structHandler;
+    delete _transport;
+    free(_rxArena);
+  }
+
+  QMsg _workingMsg;
+  void INC_QMSG(NetstatSource* src = 0L)
+  {
+    _workingMsg.seqnum = _seqnum;
+    _workingMsg.msglen = 0;
+    _workingMsg.ntsrc = src;
+    _workingMsg.ntsrcGen = 0;
+    _workingMsg.sendIndex = 0;
+    _workingMsg.tsSentMs = 0;
+  }
+
+  virtual void configure(bool wantTcp, bool wantUdp, uint32_t updateIntervalSeconds) {
+    configure(wantTcp, wantUdp, updateIntervalSeconds, NTStatFilterConfig());
+  }
+
+  virtual void configure(bool wantTcp, bool wantUdp, uint32_t updateIntervalSeconds,
+                         const NTStatFilterConfig &filter) {
+    configure(wantTcp, wantUdp, updateIntervalSeconds, filter, 0);
+  }
+
+  virtual void configure(bool wantTcp, bool wantUdp, uint32_t updateIntervalSeconds,
+                         const NTStatFilterConfig &filter, uint32_t recvBufferBytes) {
+    _wantTcp = wantTcp; _wantUdp = wantUdp; _updateIntervalSeconds = updateIntervalSeconds;
+    if (_updateIntervalSeconds < 30) {
+      printf("E Invalid updateIntervalSeconds (%d).  Using 30\n", updateIntervalSeconds);
+      _updateIntervalSeconds = 30;
+    }
+    _filter = filter;
+    if (0 == (_filter.acceptInterfaces & NTSTAT_IFTYPE_ALL)) {
+      printf("E Invalid acceptInterfaces (0x%x).  Using NTSTAT_IFTYPE_ALL\n", filter.acceptInterfaces);
+      _filter.acceptInterfaces = NTSTAT_IFTYPE_ALL;
+    }
+    _recvBufferBytes = recvBufferBytes;
+  }
+
+  // MsgDest::seqnum
+  virtual uint64_t seqnum() { return _seqnum; }
+
+  // MsgDest::send
+  // The message gets enqueued, and later sent in sendNextMessage()
+  virtual void send(nstat_msg_hdr* hdr, size_t len)
+  {
+    if (_inReplayMode()) return;
+
+    LOG_TRACE(("T ENQ %s\n", _sprintMsg(hdr).c_str() ));
+
+    if (len > QMSG_MAX_LEN) {
+      LOG_ERROR(("E message too long (%d)\n", (int)len));
+      _onRequestNotQueued(hdr);
+      INC_QMSG();
+      return;
+    }
+
+    // copy into next outq slot
+
+    QMsg* qm = _outq.push_back();
+    if (0L == qm) {
+      LOG_ERROR(("E outq full\n"));
+      _onRequestNotQueued(hdr);
+      INC_QMSG();
+      return;
+    }
+
+    qm->seqnum = hdr->context;
+    qm->ntsrc = _workingMsg.ntsrc;
+    qm->ntsrcGen = (qm->ntsrc != 0L ? SourcePool::generation(qm->ntsrc) : 0);
+    qm->sendIndex = 0;
+    qm->tsSentMs = 0;
+    qm->msglen = (uint16_t)len;
+    memcpy(qm->msgbytes, hdr, len);
+
+    if (qm->ntsrc != 0L && _isDescRequest(hdr->type)) qm->ntsrc->_descRequestQueued = true;
+
+    // advance sequence number for each message queued
+
+    _seqnum++;
+
+    INC_QMSG();
+  }
+
+  //----------------------------------------------------------
+  // send() could not queue hdr.  Put its source back in the
+  // waiting map it came from, or finish what was waiting on
+  // the request, so nothing stalls on a request never sent.
+  //----------------------------------------------------------
+  void _onRequestNotQueued(nstat_msg_hdr* hdr)
+  {
+    if (_workingMsg.ntsrc != 0L) {
+      _requeueSource(_workingMsg.ntsrc, hdr->type);
+    } else if (hdr->type == NSTAT_MSG_TYPE_QUERY_SRC && hdr->context == _bulkQueryContext) {
+      _endBulkQuery();
+    } else if (hdr->type == NSTAT_MSG_TYPE_ADD_SRC) {
+      _onInterfaceAddDone();
+    }
+  }
+
+  bool _inReplayMode() { return (_recordFd > 0 && _recordEnabled == false); }
+
+  //------------------------------------------------------------------------
+  // returns true on success, false otherwise
+  //------------------------------------------------------------------------
+  bool connectToKernel()
+  {
+    return connectToTransport(NTStatTransportNewKctl());
+  }
+
+  //------------------------------------------------------------------------
+  // Use transport as the message source.  Takes ownership of transport.
+  // returns true on success, false otherwise
+  //------------------------------------------------------------------------
+  bool connectToTransport(NTStatTransport* transport)
+  {
+    if (_transport != 0L && _transport != transport) delete _transport;
+    _transport = transport;
+
+    if (_transport == 0L || !_transport->open()) {
+      return false;
+    }
+
+    LOG_DEBUG(("D connected, XNU version:%d\n", _transport->getXnuVersion()));
+    return true;
+  }
+
+  //----------------------------------------------------------
+  // return true if we have a socket connection active
+  //----------------------------------------------------------
+  bool isConnected()
+  {
+    return (_transport != 0L && _transport->isOpen());
+  }
+
+  void _loadStructHandler(unsigned int xnuVersion)
+  {
+    printf("XNU version:%d\n", xnuVersion);
+
+    delete _structHandler;
+
+    if (xnuVersion > 3800) {
+      _structHandler = NewNTStatKernel4570(); _runLoop = RunLoop4570;
+    } else if (xnuVersion > 3300) {
+      _structHandler = NewNTStatKernel3789(); _runLoop = RunLoop3789;
+    } else if (xnuVersion > 3200) {
+      _structHandler = NewNTStatKernel3248(); _runLoop = RunLoop3248;
+    } else if (xnuVersion > 2700) {
+      _structHandler = NewNTStatKernel2782(); _runLoop = RunLoop2782;
+    } else {
+      _structHandler = NewNTStatKernel2422(); _runLoop = RunLoop2422;
+    }
+
+    if (_virtualDispatch) _runLoop = 0L;
+
+    _sizeRxArena(_structHandler->maxMsgSize());
+  }
+
+  //----------------------------------------------------------
+  // Receive arena: RECV_BATCH_SIZE slots of at least maxMsgSize,
+  // one allocation, reused for every batch.  Only reallocated
+  // if a later version needs bigger slots.
+  //----------------------------------------------------------
+  void _sizeRxArena(uint32_t maxMsgSize)
+  {
+    uint32_t slotSize = (maxMsgSize + RECV_SLOT_ALIGN - 1) & ~(RECV_SLOT_ALIGN - 1);
+    if (slotSize <= _rxSlotSize) return;
+
+    free(_rxArena);
+    void* arena = 0L;
+    if (posix_memalign(&arena, RECV_SLOT_ALIGN, (size_t)slotSize * RECV_BATCH_SIZE) != 0) abort();
+    _rxArena = (uint8_t*)arena;
+    _rxSlotSize = slotSize;
+
+    for (int i=0; i < RECV_BATCH_SIZE; i++) {
+      _rxMsgs[i].data = _rxArena + (size_t)i * slotSize;
+      _rxMsgs[i].capacity = slotSize;
+      _rxMsgs[i].length = 0;
+      _rxMsgs[i].truncated = false;
+    }
+  }
+
+  //----------------------------------------------------------
+  // Run every version through the NTStatKernelStructHandler
+  // interface, as before the loops were specialized.  Not part
+  // of NetworkStatisticsClient; for benchmarks.  Call before run().
+  //----------------------------------------------------------
+  void setVirtualDispatch(bool enable) { _virtualDispatch = enable; }
+  
+  bool _useBulkCounts() { return (_bulkCounts && !_bulkQueryRejected); }
+
+  // listeners and filtered sources are not polled for counts
+
+  bool _wantsCounts(NetstatSource* source)
+  {
+    if (source->_iface != 0L) return true;
+    if (IS_LISTEN_PORT(&source->obj) || source->_filteredOut) return false;
+    if (source->obj.key.lport == 0 && source->obj.key.rport == 0) return false; // TODO: what are these?
+    return true;
+  }
+
+  //----------------------------------------------------------
+  // Each source has its own poll deadline on the timer wheel,
+  // so counts requests are spread out instead of sent in one
+  // burst per interval.  The first is at a random point in
+  // (0.5, 1.5] intervals, later ones one interval +/- 10% apart.
+  //----------------------------------------------------------
+  void _schedulePoll(NetstatSource* source, uint64_t nowMs, bool first)
+  {
+    if (_updateIntervalSeconds == 0) return;
+
+    uint64_t intervalMs = _updateIntervalSeconds * 1000ULL;
+    uint64_t delayMs = (first ? intervalMs / 2 + 1 + _random() % intervalMs
+                              : intervalMs - intervalMs / 10 + _random() % (intervalMs / 5 + 1));
+
+    WheelItem poll = { WHEEL_SOURCE_POLL, source, SourcePool::generation(source) };
+    _wheel.schedule(nowMs + delayMs, poll);
+  }
+
+  //----------------------------------------------------------
+  // poll deadline for source: queue a counts request.  In
+  // bulk mode the bulk query covers it, so just reschedule.
+  //----------------------------------------------------------
+  void _pollSource(NetstatSource* source, uint64_t nowMs)
+  {
+    if (source->_tsRemoved != 0) return;
+
+    if (!_useBulkCounts()) {
+      source->_requestedCount = true;
+      _mapWaitingForCount[source->_srcRef] = source;
+    }
+
+    _schedulePoll(source, nowMs, false);
+  }
+
+  // xorshift64*, for poll jitter
+
+  uint64_t _random()
+  {
+    _rand ^= _rand >> 12;
+    _rand ^= _rand << 25;
+    _rand ^= _rand >> 27;
+    return _rand * 2685821657736338717ULL;
+  }
+
+  //----------------------------------------------------------
+  // Bulk mode: one QUERY_SRC for all sources every
+  // _updateIntervalSeconds.  Sources not covered by the
+  // replies fall back to per-source queries (_endBulkQuery).
+  //----------------------------------------------------------
+  void _startBulkCountsRefresh()
+  {
+    for (auto it = _map.begin();it != _map.end(); it++)
+    {
+      NetstatSource* source = it->second;
+      if (source->_tsRemoved == 0 && _wantsCounts(source)) source->_requestedCount = true;
+    }
+
+    // previous bulk query still running will cover these
+
+    if (_bulkQueryContext == 0) {
+      _bulkQueryContext = _seqnum;
+      _bulkContinuation = _structHandler->writeQueryAllSrc(*this, 0);
+      _metrics.bulkQueries++;
+    }
+  }
+
+  //----------------------------------------------------------
+  // SUCCESS or ERROR for the bulk QUERY_SRC.  Request the next
+  // chunk if the kernel has more, otherwise finish the query.
+  //----------------------------------------------------------
+  void _handleBulkQueryReply(const NTStatMsgView &msg)
+  {
+    bool more = false;
+
+    if (msg.hdr->type == NSTAT_MSG_TYPE_SUCCESS) {
+      more = ((msg.hdr->flags & NSTAT_MSG_HDR_FLAG_CONTINUATION) != 0);
+    } else if (_isErrorNoBufs(msg)) {
+      more = _bulkContinuation;   // kernel keeps its place, pick up from there
+    } else {
+      LOG_ERROR(("E bulk QUERY_SRC rejected, using per-source queries\n"));
+      _bulkQueryRejected = true;
+    }
+
+    if (more) {
+      _structHandler->writeQueryAllSrc(*this, _bulkQueryContext);
+      _metrics.bulkQueries++;
+    } else {
+      _endBulkQuery();
+    }
+  }
+
+  //----------------------------------------------------------
+  // Sources the bulk query did not deliver counts for (query
+  // cut short by ENOBUFS, rejected, timed out) fall back to
+  // per-source QUERY_SRC.
+  //----------------------------------------------------------
+  void _endBulkQuery()
+  {
+    _bulkQueryContext = 0;
+
+    bool fallback = false;
+    for (auto it = _map.begin();it != _map.end(); it++)
+    {
+      NetstatSource* source = it->second;
+      if (source->_tsRemoved == 0 && source->_requestedCount) {
+        _mapWaitingForCount[source->_srcRef] = source;
+        fallback = true;
+      }
+    }
+    if (fallback) _metrics.bulkFallbacks++;
+  }
+
+  //----------------------------------------------------------
+  // run
+  //----------------------------------------------------------
+  void run()
+  {
+    if (!isConnected()) {
+      printf("E run() not connected.\n"); return;
+    }
+
+    _keepRunning = true;
+    unsigned int xnuVersion = _transport->getXnuVersion();
+
+    _loadStructHandler(xnuVersion);
+
+    if (_recvBufferBytes > 0) {
+      _metrics.recvBufferBytes = _transport->setRecvBufferSize(_recvBufferBytes);
+      if (0 == _metrics.recvBufferBytes) LOG_ERROR(("E unable to set receive buffer to %u bytes\n", _recvBufferBytes));
+    }
+
+    // need to start by subscribing to interfaces, or to either UDP or TCP
+
+    if (_wantInterfaces) _enterStateRequestIfnetSrc();
+    else _enterStateRequestStreams();
+
+    // periodic work is driven from the deadline queue
+
+    uint64_t nowMs = NTStatMonotonicMs();
+    _deadlines = NTStatDeadlineQueue();
+    _wheel.reset(nowMs);
+    _bulkQueryContext = 0;
+    _sendPaused = false;
+    _sendFailStreak = 0;
+    if (_updateIntervalSeconds > 0)
+      _deadlines.schedule(TIMER_UPDATE, nowMs + _updateIntervalSeconds * 1000ULL);
+    if (_snapshotIntervalMs > 0)
+      _deadlines.schedule(TIMER_SNAPSHOT, nowMs + _snapshotIntervalMs);
+
+    if (_asyncCapacity > 0) _startDispatch();
+
+    if (_runLoop != 0L)
+      _runLoop(this, _structHandler);
+    else
+      runLoop(_structHandler);
+
+    if (_events != 0L) _stopDispatch();
+
+    _publishMetrics();
+    _transport->close();
+  }
+
+  //----------------------------------------------------------
+  // Wait for and handle messages until stopped.  H is the
+  // type of _structHandler; with the concrete (final) handler
+  // class the message path calls it directly and can inline
+  // it.  With NTStatKernelStructHandler it is virtual.
+  //----------------------------------------------------------
+  template <class H>
+  void runLoop(H* handler)
+  {
+    uint64_t nowMs;
+
+    while (_keepRunning)
+    {
+      _runExpiredTimers(NTStatMonotonicMs());
+
+      if (_backlogSize > 0) _flushEventBacklog();
+
+      sendNextMsg(handler);
+
+      // block until the next message or timer, unless there are requests to send
+
+      int timeoutMs = 0;
+      if (!(_haveRequestsToSend() && _windowOpen())) {
+        nowMs = NTStatMonotonicMs();
+        timeoutMs = _deadlines.msUntilNext(nowMs);
+        int wheelMs = _wheel.msUntilNext(nowMs);
+        if (wheelMs >= 0 && (timeoutMs < 0 || wheelMs < timeoutMs)) timeoutMs = wheelMs;
+        if (_backlogSize > 0 && (timeoutMs < 0 || timeoutMs > EVENT_BACKLOG_RETRY_MS)) timeoutMs = EVENT_BACKLOG_RETRY_MS;
+      }
+
+      _publishMetrics();
+
+      int rc = _transport->wait(timeoutMs);
+      if (rc > 0)
+        rc = _readMessages(handler);
+      if (rc < 0) {
+        LOG_ERROR(("E transport failed\n"));
+        break;
+      }
+    }
+  }
+
+
+
+private:
+
+  //---------------------------------------------------------------
+  // write message to socket fd
+  // returns true if successful.  Only then is it tracked in flight.
+  //---------------------------------------------------------------
+  template <class H>
+  bool SEND(H* handler, QMsg &qm)
+  {
+    nstat_msg_hdr* hdr = qm.hdr();
+
+    if (!_transport->send(qm.msgbytes, qm.msglen)) return false;
+
+    if (_recordEnabled) RECORD(qm.msgbytes, qm.msglen);
+
+    // track until the response arrives
+
+    InFlightReq &req = _addInFlight(handler, hdr, (int)qm.msglen, _metrics.requestsSent++, NTStatMonotonicMs());
+
+    LOG_SENDRECV(("T SEND %s\n", _sprintMsg(hdr, req.srcRef).c_str()));
+
+    WheelItem timeout = { WHEEL_REQUEST_TIMEOUT, 0L, req.context };
+    _wheel.schedule(req.tsSentMs + _requestTimeoutMs, timeout);
+
+    return true;
+  }
+
+  //----------------------------------------------------------
+  // in-flight request slot for hdr->context.  A request still
+  // in the slot was sent INFLIGHT_CAPACITY requests ago and
+  // never answered, so it is expired.
+  //----------------------------------------------------------
+  template <class H>
+  InFlightReq& _addInFlight(H* handler, nstat_msg_hdr* hdr, int len, uint64_t sendIndex, uint64_t nowMs)
+  {
+    InFlightReq &req = _inflight[hdr->context & (INFLIGHT_CAPACITY - 1)];
+    if (req.context != 0 && req.context != hdr->context) _expireInFlight(req);
+    if (req.context == 0) _numInFlight++;
+
+    req.context = hdr->context;
+    req.type = hdr->type;
+    NTStatMsgView msg;
+    handler->decode(hdr, len, msg);
+    req.srcRef = msg.srcRef;
+    req.providerId = msg.providerId;
+    req.sendIndex = sendIndex;
+    req.tsSentMs = nowMs;
+    return req;
+  }
+
+  // request for context, or 0L if none in flight (unsolicited messages have context 0)
+
+  InFlightReq* _findInFlight(uint64_t context)
+  {
+    if (0 == context) return 0L;
+    InFlightReq &req = _inflight[context & (INFLIGHT_CAPACITY - 1)];
+    return (req.context == context ? &req : 0L);
+  }
+
+  void _removeInFlight(InFlightReq &req)
+  {
+    req.context = 0;
+    _numInFlight--;
+  }
+
+  //----------------------------------------------------------
+  // Send from outq while the request window has room.
+  // SEND() tracks each one in _inflight so we can look it up when the
+  // corresponding response arrives
+  //----------------------------------------------------------
+  template <class H>
+  void sendNextMsg(H* handler)
+  {
+    if (_sendPaused) return;
+
+    while (_windowOpen())
+    {
+      // no message waiting, do we have any sources that need descriptions or counts?
+
+      if (_outq.empty() && !_mapWaitingForDesc.empty())
+      {
+        auto it = _mapWaitingForDesc.begin();
+        NetstatSource* source = it->second;
+        _mapWaitingForDesc.erase(it);   // before send(), which puts it back if it can't queue
+        _workingMsg.ntsrc = source;
+        if (handler->supportsUpdate())
+          handler->writeGetUpdate(*this, source->_srcRef);   // desc and counts in one
+        else
+          handler->writeSrcDesc(*this, source->_providerId, source->_srcRef);
+      }
+
+      if (_outq.empty() && !_mapWaitingForCount.empty())
+      {
+        auto it = _mapWaitingForCount.begin();
+        NetstatSource* source = it->second;
+        _mapWaitingForCount.erase(it);
+
+        // make sure we still want this data
+
+        if (source->_tsRemoved == 0 && source->_requestedCount) {
+          _workingMsg.ntsrc = source;
+          if (handler->supportsUpdate())
+            handler->writeGetUpdate(*this, source->_srcRef);
+          else
+            handler->writeQuerySrc(*this, source->_srcRef);
+        }
+        continue;
+      }
+
+      if (_outq.empty()) break;
+
+      // get ref to first message in outq
+
+      QMsg &qm = _outq.front();
+
+      // try to write to KCQ socket
+
+      if (!SEND(handler, qm))
+      {
+        // nothing reached the kernel.  Keep the request at the head of
+        // the outq, unless its source is gone, and try again on the next
+        // pass, or after a pause if the transport keeps failing.
+
+        LOG_ERROR(("E Failed to send\n"));
+        _metrics.sendFailures++;
+        if (qm.ntsrc != 0L && 0L == _liveSource(qm)) _outq.pop_front();
+        if (++_sendFailStreak >= SEND_FAILS_TO_PAUSE) {
+          _sendFailStreak = 0;
+          _sendPaused = true;
+          _deadlines.schedule(TIMER_SEND_RETRY, NTStatMonotonicMs() + SEND_RETRY_MS);
+        }
+        break;
+      }
+      _sendFailStreak = 0;
+
+      NetstatSource* source = _liveSource(qm);
+      if (source != 0L && _isDescRequest(qm.hdr()->type)) source->_descRequestQueued = false;
+
+      // pop off message sent
+      _outq.pop_front();
+    }
+  }
+
+  //----------------------------------------------------------
+  // request window (AIMD)
+  //----------------------------------------------------------
+  bool _windowOpen()
+  {
+    return (_numInFlight < (uint32_t)_window);
+  }
+
+  // clean response: grow by about one request per window's worth of responses
+
+  void _onRequestAcked()
+  {
+    uint32_t before = (uint32_t)_window;
+    _window += 1.0 / _window;
+    if (_window > _maxWindow) _window = _maxWindow;
+    if ((uint32_t)_window > before) _metrics.windowIncreases++;
+  }
+
+  // ENOBUFS: halve, once per window of requests already sent
+
+  void _onRequestDropped(const InFlightReq &req)
+  {
+    if (req.context != 0 && req.sendIndex < _decreaseMark) return;
+
+    _window = _window / 2;
+    if (_window < 1) _window = 1;
+    _decreaseMark = _metrics.requestsSent;
+    _metrics.windowDecreases++;
+    LOG_DROPS(("  window:%u\n", (uint32_t)_window));
+  }
+
+  // GET_UPDATE also returns the descriptor
+
+  bool _isDescRequest(uint32_t msgType)
+  {
+    return (msgType == NSTAT_MSG_TYPE_GET_SRC_DESC || msgType == NSTAT_MSG_TYPE_GET_UPDATE);
+  }
+
+  //----------------------------------------------------------
+  // requeue GET_SRC_DESC / QUERY_SRC / GET_UPDATE for source after ENOBUFS
+  //----------------------------------------------------------
+  void _retryRequest(const InFlightReq &req)
+  {
+    if (0 == req.context) return;
+
+    auto fit = _map.find(req.srcRef);
+    if (fit == _map.end()) return;
+
+    if (_requeueSource(fit->second, req.type)) _metrics.requestRetries++;
+  }
+
+  //----------------------------------------------------------
+  // put source back in _mapWaitingForDesc or _mapWaitingForCount
+  // if it still needs what a request of msgType was for.
+  // returns true if requeued
+  //----------------------------------------------------------
+  bool _requeueSource(NetstatSource* source, uint32_t msgType)
+  {
+    if (source->_tsRemoved != 0) return false;
+
+    if (_isDescRequest(msgType) && !source->_haveDesc) {
+      addToWaitingForDescQueue(source);
+      return true;
+    }
+    if ((msgType == NSTAT_MSG_TYPE_QUERY_SRC || msgType == NSTAT_MSG_TYPE_GET_UPDATE) && source->_requestedCount) {
+      _mapWaitingForCount[source->_srcRef] = source;
+      return true;
+    }
+    return false;
+  }
+
+  //----------------------------------------------------------
+  // Timer wheel callback.  Entries are never cancelled, so
+  // check each one is still current, and reschedule if its
+  // deadline moved (bulk query reply, retention changed).
+  //----------------------------------------------------------
+  void _onWheelItem(const WheelItem &item, uint64_t nowMs)
+  {
+    if (item.kind == WHEEL_REQUEST_TIMEOUT) {
+      _expireRequest(item.id, nowMs);
+      return;
+    }
+
+    NetstatSource* source = item.source;
+    if (SourcePool::generation(source) != item.id) return;
+
+    if (item.kind == WHEEL_SOURCE_POLL) {
+      _pollSource(source, nowMs);
+      return;
+    }
+
+    if (source->_tsRemoved == 0) return;
+
+    uint64_t expiresMs = source->_tsRemovedMs + _removedRetentionMs;
+    if (expiresMs > nowMs) {
+      _wheel.schedule(expiresMs, item);
+      return;
+    }
+
+    auto fit = _map.find(source->_srcRef);
+    if (fit != _map.end() && fit->second == source) _map.erase(fit);
+    _freeSource(source);
+  }
+
+  //----------------------------------------------------------
+  // forget a request that never got a response, so it doesn't
+  // hold the window closed
+  //----------------------------------------------------------
+  void _expireRequest(uint64_t context, uint64_t nowMs)
+  {
+    InFlightReq* req = _findInFlight(context);
+    if (0L == req) return;
+
+    uint64_t expiresMs = req->tsSentMs + _requestTimeoutMs;
+    if (expiresMs > nowMs) {
+      WheelItem timeout = { WHEEL_REQUEST_TIMEOUT, 0L, context };
+      _wheel.schedule(expiresMs, timeout);
+      return;
+    }
+
+    _expireInFlight(*req);
+  }
+
+  void _expireInFlight(InFlightReq &req)
+  {
+    LOG_DEBUG(("D request timeout %4llu type:%s srcRef:%llu\n", req.context, msg_name(req.type).c_str(), req.srcRef));
+    _metrics.requestTimeouts++;
+    bool isBulk = (req.context == _bulkQueryContext);
+    bool isAddSrc = (req.type == NSTAT_MSG_TYPE_ADD_SRC);
+    _removeInFlight(req);
+    if (isBulk) _endBulkQuery();
+    if (isAddSrc) _onInterfaceAddDone();
+  }
+
+  //----------------------------------------------------------
+  // markSourceForRemove.  Freed after _removedRetentionMs.
+  //----------------------------------------------------------
+  void _markSourceForRemove(NetstatSource *source)
+  {
+    if (source->_tsRemoved > 0) _unlinkRemoved(source);
+    source->_tsRemoved = time(NULL);
+    source->_tsRemovedMs = NTStatMonotonicMs();
+    _linkRemoved(source);
+
+    WheelItem expiry = { WHEEL_SOURCE_EXPIRY, source, SourcePool::generation(source) };
+    _wheel.schedule(source->_tsRemovedMs + _removedRetentionMs, expiry);
+  }
+
+  //----------------------------------------------------------
+  // removed sources list, so a shorter retention only needs
+  // to visit those
+  //----------------------------------------------------------
+  void _linkRemoved(NetstatSource *source)
+  {
+    source->_removedPrev = _removedTail;
+    source->_removedNext = 0L;
+    if (_removedTail != 0L) _removedTail->_removedNext = source;
+    else _removedHead = source;
+    _removedTail = source;
+  }
+
+  void _unlinkRemoved(NetstatSource *source)
+  {
+    if (source->_removedPrev != 0L) source->_removedPrev->_removedNext = source->_removedNext;
+    else _removedHead = source->_removedNext;
+    if (source->_removedNext != 0L) source->_removedNext->_removedPrev = source->_removedPrev;
+    else _removedTail = source->_removedPrev;
+    source->_removedPrev = source->_removedNext = 0L;
+  }
+
+  //----------------------------------------------------------
+  // run timers that are due and reschedule them
+  //----------------------------------------------------------
+  void _runExpiredTimers(uint64_t nowMs)
+  {
+    _rearmShortenedDeadlines();
+
+    _wheel.advance(nowMs, [this, nowMs](const WheelItem &item) { _onWheelItem(item, nowMs); });
+
+    int timerId;
+    while (_deadlines.popExpired(nowMs, timerId))
+    {
+      switch (timerId)
+      {
+        case TIMER_UPDATE:
+          if (_useBulkCounts()) _startBulkCountsRefresh();
+          _deadlines.schedule(TIMER_UPDATE, nowMs + _updateIntervalSeconds * 1000ULL);
+          break;
+        case TIMER_SNAPSHOT:
+          _takeSnapshot(nowMs);
+          _deadlines.schedule(TIMER_SNAPSHOT, nowMs + _snapshotIntervalMs);
+          break;
+        case TIMER_SEND_RETRY:
+          _sendPaused = false;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+  //----------------------------------------------------------
+  // Wheel entries are scheduled with the retention and timeout
+  // in effect at the time.  They reschedule themselves if those
+  // grew, but if either shrank, add an entry at the earlier
+  // deadline for each removed source or request in flight.
+  // Whichever fires first does the work; the other then finds
+  // the source recycled or the request gone.
+  //----------------------------------------------------------
+  void _rearmShortenedDeadlines()
+  {
+    uint32_t retentionMs = _removedRetentionMs;
+    if (retentionMs < _armedRetentionMs) {
+      for (NetstatSource* source = _removedHead; source != 0L; source = source->_removedNext) {
+        WheelItem expiry = { WHEEL_SOURCE_EXPIRY, source, SourcePool::generation(source) };
+        _wheel.schedule(source->_tsRemovedMs + retentionMs, expiry);
+      }
+    }
+    _armedRetentionMs = retentionMs;
+
+    uint32_t timeoutMs = _requestTimeoutMs;
+    if (timeoutMs < _armedTimeoutMs) {
+      for (int i=0; i < INFLIGHT_CAPACITY; i++) {
+        const InFlightReq &req = _inflight[i];
+        if (req.context == 0) continue;
+        WheelItem timeout = { WHEEL_REQUEST_TIMEOUT, 0L, req.context };
+        _wheel.schedule(req.tsSentMs + timeoutMs, timeout);
+      }
+    }
+    _armedTimeoutMs = timeoutMs;
+  }
+
+  //----------------------------------------------------------
+  // copy open streams and process totals for other threads.
+  // Skipped if readers hold every buffer we could write.
+  //----------------------------------------------------------
+  void _takeSnapshot(uint64_t nowMs)
+  {
+    NTStatSnapshotBuffer* snap = _snapshots.beginWrite();
+    if (0L == snap) {
+      _metrics.snapshotsSkipped++;
+      return;
+    }
+
+    snap->sequence = ++_snapshotSeq;
+    snap->timestampMs = nowMs;
+
+    snap->streamData.clear();
+    for (auto it = _map.begin(); it != _map.end(); it++) {
+      const NetstatSource* source = it->second;
+      if (source->_procIndex != NTStatProcessTable::NONE) snap->streamData.push_back(source->obj);
+    }
+    snap->processData = _procs.all();
+
+    _snapshots.publish(snap);
+    _metrics.snapshotsTaken++;
+  }
+
+  //----------------------------------------------------------
+  // true if sendNextMsg() has something to do
+  //----------------------------------------------------------
+  bool _haveRequestsToSend()
+  {
+    if (_sendPaused) return false;
+    return (!_outq.empty() || !_mapWaitingForDesc.empty() || !_mapWaitingForCount.empty());
+  }
+
+  //----------------------------------------------------------
+  // return source to pool.  Caller erases it from _map.
+  // Queued requests still pointing to it see a new generation.
+  //----------------------------------------------------------
+  void _freeSource(NetstatSource* source)
+  {
+    auto wit = _mapWaitingForDesc.find(source->_srcRef);
+    if (wit != _mapWaitingForDesc.end() && wit->second == source) _mapWaitingForDesc.erase(wit);
+    wit = _mapWaitingForCount.find(source->_srcRef);
+    if (wit != _mapWaitingForCount.end() && wit->second == source) _mapWaitingForCount.erase(wit);
+
+    _unindexKey(source);
+    if (source->_tsRemoved > 0) _unlinkRemoved(source);
+
+    _sources.free(source);
+  }
+
+  //----------------------------------------------------------
+  // msg.ntsrc, or 0L if it was recycled since msg was queued
+  //----------------------------------------------------------
+  NetstatSource* _liveSource(const QMsg &msg)
+  {
+    if (0L == msg.ntsrc || SourcePool::generation(msg.ntsrc) != msg.ntsrcGen) return 0L;
+    return msg.ntsrc;
+  }
+
+  //----------------------------------------------------------
+  // resetSource : allocate and assign to map
+  //----------------------------------------------------------
+  NetstatSource* _resetSource(uint64_t srcRef, uint32_t providerId)
+  {
+    NetstatSource* src = 0L;
+    auto fit = _map.find(srcRef);
+    if (fit != _map.end()) {
+      // already have it
+      if (fit->second->_tsRemoved > 0) {
+        _freeSource(fit->second);
+        _map.erase(fit);
+      } else {
+        LOG_ERROR(("add for existing src\n"));
+        src = fit->second;
+      }
+    }
+
+    if (0L == src) {
+      src = _sources.alloc(srcRef, providerId);
+      if (0L == src) {
+        LOG_ERROR(("E out of memory for source\n"));
+        return 0L;
+      }
+      src->obj.id = srcRef;
+      src->_tsAdded = time(NULL);
+      _map[srcRef] = src;
+    }
+
+    return src;
+  }
+
+  //----------------------------------------------------------
+  // lookupSource
+  //----------------------------------------------------------
+  NetstatSource* _lookupSource(uint64_t srcRef)
+  {
+    NetstatSource* retval = 0L;
+
+    auto fit = _map.find(srcRef);
+    if (fit != _map.end()) {
+      retval = fit->second;
+    }
+
+    return retval;
+  }
+
+  //----------------------------------------------------------
+  // return message detail string for consistent logging
+  //----------------------------------------------------------
+  std::string _sprintMsg(nstat_msg_hdr* hdr, uint64_t srcRef = 0L)
+  {
+    char tmp[256];
+
+    if (hdr == 0L) return "NULL";
+
+    sprintf(tmp, "%c %4llu type:%s(%d) hdr->len:%d srcRef:%llu", msg_dir(hdr->type), hdr->context, msg_name(hdr->type).c_str(), hdr->type, hdr->length, srcRef);
+
+    return std::string(tmp);
+  }
+
+  //----------------------------------------------------------
+  // Isolates read from transport.  Non-blocking.
+  // If record-mode enabled, also writes to file
+  // returns number of messages read, 0 if none, -1 on error
+  //----------------------------------------------------------
+  int _socketRead(NTStatRecvMsg* msgs, int maxMsgs)
+  {
+    int num_msgs = _transport->recvBatch(msgs, maxMsgs);
+
+    for (int i=0; i < num_msgs; i++) {
+      LOG_DEBUG(("D READ %d bytes\n", msgs[i].length));
+
+      if (_recordEnabled) RECORD(msgs[i].data, msgs[i].length);
+    }
+
+    return num_msgs;
+  }
+
+  //----------------------------------------------------------
+  // RECORD()
+  // persist message to file.
+  //
+  //   uint32_t timestamp
+  //   uint32_t length
+  //   char     data[length]
+  //----------------------------------------------------------
+  void RECORD(const void *src, uint32_t num_bytes)
+  {
+    uint32_t now = (uint32_t)time(NULL);      // hardcode to 32-bit for platform consistency
+    write(_recordFd, &now, sizeof(now));
+    write(_recordFd, &num_bytes, sizeof(num_bytes));
+
+    write(_recordFd, src, num_bytes);
+  }
+
+  //----------------------------------------------------------
+  // _readMessages()
+  // The KCQ socket is really a queue.  The kernel send buffer is
+  // only 2048 bytes, so drain everything queued on each wakeup,
+  // RECV_BATCH_SIZE messages at a time into the receive arena.
+  // returns number of messages read, -1 on transport error
+  //----------------------------------------------------------
+  template <class H>
+  int _readMessages(H* handler)
+  {
+    int total = 0;
+
+    while (true)
+    {
+      int num_msgs = _socketRead(_rxMsgs, RECV_BATCH_SIZE);
+      if (num_msgs < 0) return -1;
+      if (num_msgs == 0) break;
+
+      _handleResponseBatch(handler, _rxMsgs, num_msgs);
+      total += num_msgs;
+
+      // a short batch means the queue was empty
+
+      if (num_msgs < RECV_BATCH_SIZE) break;
+    }
+
+    return total;
+  }
+
+  //----------------------------------------------------------
+  // _handleResponseBatch()
+  //----------------------------------------------------------
+  template <class H>
+  void _handleResponseBatch(H* handler, NTStatRecvMsg* msgs, int num_msgs)
+  {
+    for (int i=0; i < num_msgs; i++)
+    {
+      if (msgs[i].truncated) {
+        // can't happen with slots of maxMsgSize, unless the kernel grew its messages
+        _metrics.msgsTruncated++;
+        LOG_ERROR(("E truncated message len:%u capacity:%u\n", msgs[i].length, msgs[i].capacity));
+        continue;
+      }
+      if (msgs[i].length < sizeof(nstat_msg_hdr)) {
+        LOG_ERROR(("E short message len:%u\n", msgs[i].length));
+        continue;
+      }
+      _handleResponseMessage(handler, (nstat_msg_hdr *)msgs[i].data, (int)msgs[i].length);
+    }
+  }
+  
+  //----------------------------------------------------------
+  // Given the request to ADD_ALL_SRC, request GET_SRC_DESC
+  // for ALL of its provider.
+  //----------------------------------------------------------
+  void _queryAllSrcDesc(const InFlightReq &addAllSrcReq)
+  {
+    _structHandler->writeSrcDesc(*this, addAllSrcReq.providerId, (uint64_t)-1);
+  }
+
+  //----------------------------------------------------------
+  // true if msg is an ENOBUFS error
+  //----------------------------------------------------------
+  bool _isErrorNoBufs(const NTStatMsgView &msg)
+  {
+    return (msg.hdr->type == NSTAT_MSG_TYPE_ERROR &&
+            msg.length >= (int)(offsetof(nstat_msg_error, error) + sizeof(uint32_t)) &&
+            ((nstat_msg_error*)msg.hdr)->error == ENOBUFS);
+  }
+
+  //----------------------------------------------------------
+  // returns errno code and logs if enabled
+  //----------------------------------------------------------
+  int _getAndLogError(const NTStatMsgView &msg, const InFlightReq &req)
+  {
+    nstat_msg_error* perr = (nstat_msg_error*)msg.hdr;
+    
+    // consider special case errors
+
+    _numErrors++;
+
+    // pre-3248 kernels pack this struct to 4 bytes, so don't require tail padding
+
+    if (msg.length < (int)(offsetof(nstat_msg_error, error) + sizeof(perr->error)))
+    {
+      LOG_ERROR(("E error struct size mismatch\n"));
+      return EFAULT;
+    }
+
+    if (perr->error == ENOBUFS) {
+      _numDrops++;
+    }
+
+    // log if desired
+
+    if (_logFlags & NTSTAT_LOGF_ERROR) {
+      if (perr->error == ENOBUFS)
+      {
+        LOG_DROPS(("  ENOBUFS drop\n"));
+        LOG_ERROR(("T error ENOBUFS - app not keeping up\n"));
+      } else {
+        LOG_ERROR(("T error code:%d (0x%x) \n", perr->error, perr->error));
+        if (req.context != 0) {
+          LOG_ERROR(("  for REQUEST (%4llu type:%s) srcRef:%llu\n", req.context, msg_name(req.type).c_str(), req.srcRef));
+        }
+      }
+    }
+
+    return perr->error;
+  }
+
+  //----------------------------------------------------------
+  // _enterStateRequestUdpSrc
+  // @returns 0
+  //----------------------------------------------------------
+  int _enterStateRequestUdpSrc()
+  {
+    _state = STATE_REQUEST_UDP_SRC;
+
+    _structHandler->writeAddAllUdpSrc(*this, _filter);
+
+    return 0;
+  }
+
+  //----------------------------------------------------------
+  // _enterStateRequestTcpSrc
+  // @returns 0
+  //----------------------------------------------------------
+  int _enterStateRequestTcpSrc()
+  {
+    _state = STATE_REQUEST_TCP_SRC;
+    
+    _structHandler->writeAddAllTcpSrc(*this, _filter);
+    
+    return 0;
+  }
+
+  //----------------------------------------------------------
+  // _enterStateRequestStreams
+  // TCP first if wanted, then UDP.
+  // @returns 0
+  //----------------------------------------------------------
+  int _enterStateRequestStreams()
+  {
+    if (_wantTcp) return _enterStateRequestTcpSrc();
+    return _enterStateRequestUdpSrc();
+  }
+
+  //----------------------------------------------------------
+  // _enterStateRequestIfnetSrc
+  // ADD_SRC for each interface.  Moves on to the streams once
+  // every one is answered (SRC_ADDED or ERROR) or timed out.
+  // @returns 0
+  //----------------------------------------------------------
+  int _enterStateRequestIfnetSrc()
+  {
+    _state = STATE_REQUEST_IFNET_SRC;
+
+    std::vector<uint32_t> ifindexes;
+    getInterfaceIndexes(ifindexes);
+    if (ifindexes.size() > MAX_INTERFACES) {
+      LOG_ERROR(("E %u interfaces, only the first %u are added\n", (uint32_t)ifindexes.size(), MAX_INTERFACES));
+      ifindexes.resize(MAX_INTERFACES);
+    }
+
+    _ifnetAddsPending = (uint32_t)ifindexes.size();
+    if (0 == _ifnetAddsPending) return _enterStateRequestStreams();
+
+    for (size_t i=0; i < ifindexes.size(); i++)
+      _structHandler->writeAddInterfaceSrc(*this, ifindexes[i], _ifnetThreshold);
+
+    return 0;
+  }
+
+  //----------------------------------------------------------
+  // an interface ADD_SRC was answered or timed out.  An
+  // interface that couldn't be added is just left out.
+  //----------------------------------------------------------
+  void _onInterfaceAddDone()
+  {
+    if (_state != STATE_REQUEST_IFNET_SRC || 0 == _ifnetAddsPending) return;
+
+    if (--_ifnetAddsPending == 0) _enterStateRequestStreams();
+  }
+
+  
+  //----------------------------------------------------------
+  // _enterRunningState
+  // The "running" state is mostly passive... listening to events.
+  // We can get here even if there was an error on initialization.
+  // @returns 0
+  //----------------------------------------------------------
+  int _enterRunningState(const NTStatMsgView &msg, const InFlightReq &req)
+  {
+    _state = STATE_RUNNING;
+    return 0;
+  }
+  
+  //----------------------------------------------------------
+  // handleState
+  //----------------------------------------------------------
+  int _handleState(const NTStatMsgView &msg, const InFlightReq &req)
+  {
+    bool isSuccessResponse = (msg.hdr->type == NSTAT_MSG_TYPE_SUCCESS && req.context != 0);
+
+    int err = (msg.hdr->type == NSTAT_MSG_TYPE_ERROR ? _getAndLogError(msg, req) : 0);
+
+    switch(_state)
+    {
+      case STATE_REQUEST_IFNET_SRC:
+      {
+        // ERROR for an ADD_SRC.  Success is SRC_ADDED, handled below.
+        if (req.type == NSTAT_MSG_TYPE_ADD_SRC) _onInterfaceAddDone();
+        break;
+      }
+      case STATE_REQUEST_TCP_SRC:
+      {
+        if (isSuccessResponse || NOT_FATAL(err))
+        {
+          if (_wantUdp)
+            return _enterStateRequestUdpSrc();
+          else
+            return _enterRunningState(msg, req);
+        }
+        else
+        {
+          return _enterRunningState(msg, req);
+        }
+        break;
+      }
+      case STATE_REQUEST_UDP_SRC:
+      {
+        if (isSuccessResponse || NOT_FATAL(err))
+        {
+            return _enterRunningState(msg, req);
+        }
+        else
+        {
+          return _enterRunningState(msg, req);
+        }
+        break;
+      }
+      default:
+        // unexpected.  Enter passive listening state ... _getAndLogError() above logs error
+        return _enterRunningState(msg, req);
+        break;
+    }
+    
+    return 0;
+  }
+
+  //----------------------------------------------------------
+  // source->obj has descriptor (SRC_DESC or SRC_UPDATE)
+  //----------------------------------------------------------
+  void _onSourceDesc(NetstatSource* source)
+  {
+    source->_haveDesc = true;
+
+    // misc cleanups
+
+    if (source->obj.process.pid == 0) strcpy(source->obj.process.name, "kernel_task");
+
+    // notify application (it not already done)
+
+    if (!source->_haveNotifiedAdded) {
+      if (source->obj.key.lport == 0 && source->obj.key.rport == 0) {
+        // ignore... TODO: not sure what these are.
+      } else if (_isFilteredOut(source->obj)) {
+        source->_filteredOut = true;
+        _metrics.sourcesFiltered++;
+      } else {
+        uint64_t nowMs = NTStatMonotonicMs();
+        source->_reportedStats = source->obj.stats;
+        source->_tsReportedMs = nowMs;
+        source->_procIndex = _procs.addStream(source->obj);
+        _countTop(source->obj, source->obj.stats.rxbytes + source->obj.stats.txbytes, 1);
+        _indexKey(source);
+        _emitStream(EVENT_STREAM_ADDED, source);
+        if (_wantsCounts(source)) _schedulePoll(source, nowMs, true);
+      }
+    } else if (source->_keyIndexed && source->obj.key.hash() != source->_keyHash) {
+      // a later descriptor moved the flow (rare: UDP connect, interface change)
+      _unindexKey(source);
+      _indexKey(source);
+    }
+
+    source->_haveNotifiedAdded = true;
+  }
+
+  //----------------------------------------------------------
+  // key index membership, for getStream()
+  //----------------------------------------------------------
+  void _indexKey(NetstatSource* source)
+  {
+    source->_keyHash = source->obj.key.hash();
+    source->_keyIndexed = true;
+    _keyIndex.insert(source->_keyHash, source);
+  }
+
+  void _unindexKey(NetstatSource* source)
+  {
+    if (!source->_keyIndexed) return;
+    _keyIndex.erase(source->_keyHash, source);
+    source->_keyIndexed = false;
+  }
+
+  //----------------------------------------------------------
+  // Fill in obj.delta against the stats last reported, then
+  // call onStreamStatsUpdate.  Unsolicited SRC_COUNTS in between
+  // are not reported, so their bytes land in the next delta.
+  //----------------------------------------------------------
+  void _notifyStatsUpdate(NetstatSource* source)
+  {
+    if (_isZeroBytesFilteredOut(source->obj)) return;
+    _takeDelta(source);
+    _emitStream(EVENT_STREAM_UPDATE, source);
+  }
+
+  //----------------------------------------------------------
+  // Stream closed: final delta, out of the process table,
+  // then onStreamRemoved.
+  //----------------------------------------------------------
+  void _notifyRemoved(NetstatSource* source)
+  {
+    if (source->_procIndex != NTStatProcessTable::NONE) {
+      _takeDelta(source);
+      _procs.removeStream(source->_procIndex, source->obj.delta.perSecond);
+      source->_procIndex = NTStatProcessTable::NONE;
+    }
+    _unindexKey(source);
+    _emitStream(EVENT_STREAM_REMOVED, source);
+  }
+
+  //----------------------------------------------------------
+  // obj.delta = obj.stats since last report, folded into
+  // the process table.  obj.stats becomes the last report.
+  //----------------------------------------------------------
+  void _takeDelta(NetstatSource* source)
+  {
+    NTStatRates prevRate = source->obj.delta.perSecond;
+
+    _computeDelta(source->obj.stats, source->_reportedStats, source->_tsReportedMs, NTStatMonotonicMs(), source->obj.delta);
+
+    if (source->_procIndex != NTStatProcessTable::NONE) {
+      _procs.addDelta(source->_procIndex, source->obj.delta, prevRate);
+      _countTop(source->obj, source->obj.delta.counts.rxbytes + source->obj.delta.counts.txbytes, 0);
+    }
+  }
+
+  //----------------------------------------------------------
+  // Count bytes and newly opened streams against the stream's
+  // process, remote address and remote port.  Unspecified
+  // remotes (listeners, unconnected UDP) are not ranked.
+  //----------------------------------------------------------
+  void _countTop(const NTStatStream &stream, uint64_t bytes, uint64_t streams)
+  {
+    if (0 == _topEntries) return;
+
+    const NTStatStreamKey &key = stream.key;
+    uint64_t procKey = (uint64_t)stream.process.pid + 1;
+    uint64_t addrKey = 0;
+    uint64_t portKey = (key.rport != 0 ? ((uint64_t)key.ipproto << 16) | key.rport : 0);
+
+    if (NTStatHasRemoteAddr(key)) addrKey = NTStatRemoteHash(key, false) | 1;
+
+    for (int by=0; by < 2; by++) {
+      uint64_t weight = (by == NTSTAT_TOPBY_BYTES ? bytes : streams);
+      if (0 == weight) continue;
+
+      NTStatTopEntry* label = _top[NTSTAT_TOP_PROCESS][by].add(procKey, weight);
+      if (label) {
+        memset(label, 0, sizeof(*label));
+        label->process = stream.process;
+      }
+      if (0 != addrKey && 0L != (label = _top[NTSTAT_TOP_REMOTE_ADDR][by].add(addrKey, weight))) {
+        memset(label, 0, sizeof(*label));
+        label->isV6 = key.isV6;
+        label->addr = key.remote;
+      }
+      if (0 != portKey && 0L != (label = _top[NTSTAT_TOP_REMOTE_PORT][by].add(portKey, weight))) {
+        memset(label, 0, sizeof(*label));
+        label->ipproto = key.ipproto;
+        label->port = key.rport;
+      }
+    }
+  }
+
+  //----------------------------------------------------------
+  // delta = cur - prev, over the time since tsPrevMs.  Then
+  // cur and nowMs become prev and tsPrevMs.
+  //----------------------------------------------------------
+  static void _computeDelta(const NTStatCounters &cur, NTStatCounters &prev, uint64_t &tsPrevMs, uint64_t nowMs,
+                            NTStatStreamDelta &delta)
+  {
+    delta.intervalMs = (tsPrevMs > 0 && nowMs > tsPrevMs ? nowMs - tsPrevMs : 0);
+
+    delta.counts.rxpackets = _counterDelta(cur.rxpackets, prev.rxpackets);
+    delta.counts.txpackets = _counterDelta(cur.txpackets, prev.txpackets);
+    delta.counts.rxbytes = _counterDelta(cur.rxbytes, prev.rxbytes);
+    delta.counts.txbytes = _counterDelta(cur.txbytes, prev.txbytes);
+    delta.counts.cell_rxbytes = _counterDelta(cur.cell_rxbytes, prev.cell_rxbytes);
+    delta.counts.cell_txbytes = _counterDelta(cur.cell_txbytes, prev.cell_txbytes);
+    delta.counts.wifi_rxbytes = _counterDelta(cur.wifi_rxbytes, prev.wifi_rxbytes);
+    delta.counts.wifi_txbytes = _counterDelta(cur.wifi_txbytes, prev.wifi_txbytes);
+    delta.counts.wired_rxbytes = _counterDelta(cur.wired_rxbytes, prev.wired_rxbytes);
+    delta.counts.wired_txbytes = _counterDelta(cur.wired_txbytes, prev.wired_txbytes);
+
+    _computeRates(delta);
+
+    prev = cur;
+    tsPrevMs = nowMs;
+  }
+
+  //----------------------------------------------------------
+  // delta.perSecond from delta.counts and intervalMs
+  //----------------------------------------------------------
+  static void _computeRates(NTStatStreamDelta &delta)
+  {
+    double perMs = (delta.intervalMs > 0 ? 1000.0 / delta.intervalMs : 0.0);
+    delta.perSecond.rxpackets = delta.counts.rxpackets * perMs;
+    delta.perSecond.txpackets = delta.counts.txpackets * perMs;
+    delta.perSecond.rxbytes = delta.counts.rxbytes * perMs;
+    delta.perSecond.txbytes = delta.counts.txbytes * perMs;
+    delta.perSecond.cell_rxbytes = delta.counts.cell_rxbytes * perMs;
+    delta.perSecond.cell_txbytes = delta.counts.cell_txbytes * perMs;
+    delta.perSecond.wifi_rxbytes = delta.counts.wifi_rxbytes * perMs;
+    delta.perSecond.wifi_txbytes = delta.counts.wifi_txbytes * perMs;
+    delta.perSecond.wired_rxbytes = delta.counts.wired_rxbytes * perMs;
+    delta.perSecond.wired_txbytes = delta.counts.wired_txbytes * perMs;
+  }
+
+  //----------------------------------------------------------
+  // Interface source has its descriptor.  SRC_UPDATE brings
+  // the counts too, otherwise ask for them, so the listener
+  // hears about the interface right away.  Then it is polled
+  // like a stream.
+  //----------------------------------------------------------
+  void _onInterfaceDesc(NetstatSource* source, bool haveCounts)
+  {
+    bool first = !source->_haveDesc;
+    source->_haveDesc = true;
+
+    if (haveCounts) {
+      _notifyInterfaceUpdate(source);
+    } else if (first) {
+      source->_requestedCount = true;
+      _mapWaitingForCount[source->_srcRef] = source;
+    }
+
+    if (first) _schedulePoll(source, NTStatMonotonicMs(), true);
+  }
+
+  //----------------------------------------------------------
+  // Fill in iface->delta against the counts last reported,
+  // then call onInterfaceStatsUpdate.  The first report has
+  // an empty delta.
+  //----------------------------------------------------------
+  void _notifyInterfaceUpdate(NetstatSource* source)
+  {
+    NTStatInterface* iface = source->_iface;
+    uint64_t nowMs = NTStatMonotonicMs();
+
+    if (!source->_haveNotifiedAdded) {
+      source->_reportedStats = iface->stats;
+      source->_tsReportedMs = nowMs;
+      source->_haveNotifiedAdded = true;
+    }
+
+    _computeDelta(iface->stats, source->_reportedStats, source->_tsReportedMs, nowMs, iface->delta);
+    _emitInterface(source);
+  }
+
+  static uint64_t _counterDelta(uint64_t cur, uint64_t prev) { return (cur > prev ? cur - prev : 0); }
+
+  //----------------------------------------------------------
+  // Listener callbacks: made here, or with setAsyncDispatch()
+  // copied into the event ring for the dispatch thread.
+  //----------------------------------------------------------
+  void _emitStream(uint32_t type, NetstatSource* source)
+  {
+    if (0L == _events) {
+      switch (type) {
+        case EVENT_STREAM_ADDED: _listener->onStreamAdded(&source->obj); break;
+        case EVENT_STREAM_REMOVED: _listener->onStreamRemoved(&source->obj); break;
+        default: _listener->onStreamStatsUpdate(&source->obj); break;
+      }
+      return;
+    }
+
+    NTStatEvent event;
+    event.type = type;
+    event.srcRef = source->_srcRef;
+    event.stream = source->obj;
+    _queueEvent(event);
+  }
+
+  void _emitInterface(NetstatSource* source)
+  {
+    if (0L == _events) {
+      _listener->onInterfaceStatsUpdate(source->_iface);
+      return;
+    }
+
+    NTStatEvent event;
+    event.type = EVENT_INTERFACE_UPDATE;
+    event.srcRef = source->_srcRef;
+    event.iface = *source->_iface;
+    _queueEvent(event);
+  }
+
+  static bool _isUpdate(const NTStatEvent &event)
+  {
+    return (event.type == EVENT_STREAM_UPDATE || event.type == EVENT_INTERFACE_UPDATE);
+  }
+
+  //----------------------------------------------------------
+  // Never waits.  A full ring drops the new event, or the
+  // oldest, per _overflowPolicy.  COALESCE instead backs events
+  // up in _backlog, folding a source's updates into its queued
+  // one, and the run loop hands them over as the ring drains.
+  //----------------------------------------------------------
+  void _queueEvent(const NTStatEvent &event)
+  {
+    if (_overflowPolicy != NTSTAT_OVERFLOW_COALESCE) {
+      if (!_pushEvent(event, _overflowPolicy == NTSTAT_OVERFLOW_DROP_OLDEST))
+        _metrics.eventsDropped++;
+      return;
+    }
+
+    // stay behind anything already backed up
+
+    _flushEventBacklog();
+    if (0 == _backlogSize && _pushEvent(event, false)) return;
+
+    if (_isUpdate(event)) {
+      NTStatFlatMap<uint64_t>::iterator it = _backlogUpdates.find(event.srcRef);
+      if (it != _backlogUpdates.end()) {
+        _mergeUpdate(_backlogAt(it->second), event);
+        _metrics.eventsCoalesced++;
+        return;
+      }
+    }
+
+    if (_backlogSize == _backlog.size()) {
+      _metrics.eventsDropped++;
+      return;
+    }
+    uint64_t seq = _backlogBase + _backlogSize++;
+    _backlogAt(seq) = event;
+    if (_isUpdate(event)) _backlogUpdates[event.srcRef] = seq;
+  }
+
+  void _flushEventBacklog()
+  {
+    while (_backlogSize > 0) {
+      const NTStatEvent &event = _backlogAt(_backlogBase);
+      if (!_pushEvent(event, false)) return;
+      _popBacklog();
+    }
+  }
+
+  // _backlog is a circular buffer of ring capacity, indexed by sequence
+
+  NTStatEvent& _backlogAt(uint64_t seq) { return _backlog[seq & (_backlog.size() - 1)]; }
+
+  void _popBacklog()
+  {
+    const NTStatEvent &event = _backlogAt(_backlogBase);
+    if (_isUpdate(event)) {
+      NTStatFlatMap<uint64_t>::iterator it = _backlogUpdates.find(event.srcRef);
+      if (it != _backlogUpdates.end() && it->second == _backlogBase) _backlogUpdates.erase(it);
+    }
+    _backlogBase++;
+    _backlogSize--;
+  }
+
+  //----------------------------------------------------------
+  // into the ring, waking the dispatch thread if it is parked.
+  // Only the first push after it parks pays for the wakeup.
+  //----------------------------------------------------------
+  bool _pushEvent(const NTStatEvent &event, bool dropOldest)
+  {
+    if (!_events->push(event, dropOldest, _metrics.eventsDropped)) return false;
+
+    // the push must be visible before we look, see _parkDispatch()
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_dispatchParked.load() && _dispatchParked.exchange(false)) {
+      std::lock_guard<std::mutex> lock(_dispatchMutex);
+      _dispatchWake.notify_one();
+    }
+    return true;
+  }
+
+  //----------------------------------------------------------
+  // queued update takes event's state, with both deltas
+  //----------------------------------------------------------
+  static void _mergeUpdate(NTStatEvent &queued, const NTStatEvent &event)
+  {
+    bool isIface = (event.type == EVENT_INTERFACE_UPDATE);
+    NTStatStreamDelta prior = (isIface ? queued.iface.delta : queued.stream.delta);
+
+    queued = event;
+
+    NTStatStreamDelta &delta = (isIface ? queued.iface.delta : queued.stream.delta);
+    delta.counts.rxpackets += prior.counts.rxpackets;
+    delta.counts.txpackets += prior.counts.txpackets;
+    delta.counts.rxbytes += prior.counts.rxbytes;
+    delta.counts.txbytes += prior.counts.txbytes;
+    delta.counts.cell_rxbytes += prior.counts.cell_rxbytes;
+    delta.counts.cell_txbytes += prior.counts.cell_txbytes;
+    delta.counts.wifi_rxbytes += prior.counts.wifi_rxbytes;
+    delta.counts.wifi_txbytes += prior.counts.wifi_txbytes;
+    delta.counts.wired_rxbytes += prior.counts.wired_rxbytes;
+    delta.counts.wired_txbytes += prior.counts.wired_txbytes;
+    delta.intervalMs += prior.intervalMs;
+    _computeRates(delta);
+  }
+
+  //----------------------------------------------------------
+  // The coalescing backlog and its index are sized here, so
+  // queueing events never allocates.
+  //----------------------------------------------------------
+  void _startDispatch()
+  {
+    _events = new EventRing(_asyncCapacity);
+    if (_overflowPolicy == NTSTAT_OVERFLOW_COALESCE) {
+      _backlog.resize(_events->capacity());
+      _backlogUpdates.reserve(_events->capacity());
+    }
+    _dispatchStop = false;
+    _dispatchThread = std::thread(&NetworkStatisticsClientImpl::_dispatchLoop, this);
+  }
+
+  //----------------------------------------------------------
+  // Let the dispatch thread empty the ring and exit, then make
+  // the callbacks for anything still backed up here, after it,
+  // so order is kept.
+  //----------------------------------------------------------
+  void _stopDispatch()
+  {
+    _dispatchStop = true;
+    {
+      std::lock_guard<std::mutex> lock(_dispatchMutex);
+      _dispatchWake.notify_one();
+    }
+    _dispatchThread.join();
+
+    while (_backlogSize > 0) {
+      _dispatchEvent(_backlogAt(_backlogBase));
+      _popBacklog();
+    }
+
+    delete _events;
+    _events = 0L;
+    _backlogUpdates.clear();
+  }
+
+  //----------------------------------------------------------
+  // dispatch thread: the listener callbacks, in queue order
+  //----------------------------------------------------------
+  void _dispatchLoop()
+  {
+    NTStatEvent event;
+    uint32_t idle = 0;
+
+    for (;;) {
+      if (_events->pop(event)) {
+        _dispatchEvent(event);
+        idle = 0;
+        continue;
+      }
+
+      if (_dispatchStop.load()) {
+        while (_events->pop(event)) _dispatchEvent(event);   // anything queued before stop is in by now
+        break;
+      }
+
+      if (++idle < DISPATCH_SPINS) {
+        std::this_thread::yield();
+      } else {
+        _parkDispatch();
+        idle = 0;
+      }
+    }
+  }
+
+  //----------------------------------------------------------
+  // dispatch thread, ring empty: sleep until _pushEvent() or
+  // _stopDispatch() wakes us.  We set _dispatchParked before
+  // looking at the ring, and the run thread pushes before it
+  // looks at _dispatchParked, so one of the two sees the other.
+  //----------------------------------------------------------
+  void _parkDispatch()
+  {
+    std::unique_lock<std::mutex> lock(_dispatchMutex);
+    _dispatchParked.store(true);
+    while (0 == _events->size() && !_dispatchStop.load()) _dispatchWake.wait(lock);
+    _dispatchParked.store(false);
+  }
+
+  void _dispatchEvent(const NTStatEvent &event)
+  {
+    switch (event.type) {
+      case EVENT_STREAM_ADDED: _listener->onStreamAdded(&event.stream); break;
+      case EVENT_STREAM_REMOVED: _listener->onStreamRemoved(&event.stream); break;
+      case EVENT_STREAM_UPDATE: _listener->onStreamStatsUpdate(&event.stream); break;
+      case EVENT_INTERFACE_UPDATE: _listener->onInterfaceStatsUpdate(&event.iface); break;
+      default: break;
+    }
+  }
+
+  //----------------------------------------------------------
+  // Parts of _filter the kernel version can't apply.
+  // Interface type is not in every descriptor, so only
+  // loopback is recognized, by address.
+  //----------------------------------------------------------
+  bool _isFilteredOut(const NTStatStream &obj)
+  {
+    uint32_t kernelFilters = _structHandler->kernelFilters();
+
+    if (_filter.pid != 0 && !(kernelFilters & NTSTAT_KFILTER_PID) && obj.process.pid != _filter.pid)
+      return true;
+
+    if (_filter.skipListeners && !(kernelFilters & NTSTAT_KFILTER_LISTENERS) &&
+        obj.key.ipproto == IPPROTO_TCP && IS_LISTEN_PORT(&obj))
+      return true;
+
+    if (!(kernelFilters & NTSTAT_KFILTER_INTERFACES)) {
+      uint32_t iftypes = (_isLoopback(obj.key) ? NTSTAT_IFTYPE_LOOPBACK : (NTSTAT_IFTYPE_ALL & ~NTSTAT_IFTYPE_LOOPBACK));
+      if ((_filter.acceptInterfaces & iftypes) == 0) return true;
+    }
+
+    return false;
+  }
+
+  // skipZeroBytes where the kernel can't apply it: the stream is
+  // still added and removed, but gets no stats updates until it
+  // has sent or received something.
+  bool _isZeroBytesFilteredOut(const NTStatStream &obj)
+  {
+    return (_filter.skipZeroBytes && !(_structHandler->kernelFilters() & NTSTAT_KFILTER_ZEROBYTES) &&
+            0 == obj.stats.rxbytes + obj.stats.txbytes);
+  }
+
+  bool _isLoopback(const NTStatStreamKey &key)
+  {
+    if (key.isV6) return IN6_IS_ADDR_LOOPBACK(&key.local.addr6) || IN6_IS_ADDR_LOOPBACK(&key.remote.addr6);
+    return ((ntohl(key.local.addr4.s_addr) >> 24) == IN_LOOPBACKNET ||
+            (ntohl(key.remote.addr4.s_addr) >> 24) == IN_LOOPBACKNET);
+  }
+
+  //----------------------------------------------------------
+  //
+  //----------------------------------------------------------
+  void addToWaitingForDescQueue(NetstatSource* src)
+  {
+    _mapWaitingForDesc[src->_srcRef] = src;
+  }
+  
+  void removeFromWaitingForDescQueue(NetstatSource* src)
+  {
+    _mapWaitingForDesc.erase(src->_srcRef); // TODO: exception if not found?
+  }
+  
+  //----------------------------------------------------------
+  // _handleResponseMessage()
+  // Separated from _socketRead for testing purposes.
+  //----------------------------------------------------------
+  template <class H>
+  int _handleResponseMessage(H* handler, nstat_msg_hdr* ns, int num_bytes)
+  {
+    // decode once, everything below works from msg
+
+    NTStatMsgView msg;
+    if (!handler->decode(ns, num_bytes, msg)) {
+      _numErrors++;
+      LOG_ERROR(("E short message (%d bytes) type:%d\n", num_bytes, (num_bytes >= (int)sizeof(nstat_msg_hdr) ? (int)ns->type : -1)));
+      return 0;
+    }
+    uint64_t srcRef = msg.srcRef;
+    uint32_t providerId = msg.providerId;
+
+    LOG_SENDRECV(("T RECV %s\n", _sprintMsg(ns, srcRef).c_str()));
+
+    // get corresponding request message (if possible)
+    // SRC_ADDED, SRC_REMOVED, SRC_DESC, SRC_COUNTS, etc. all have context == 0
+
+    InFlightReq* pending = _findInFlight(ns->context);
+    InFlightReq req = InFlightReq();    // context 0 if there isn't one
+    bool isBulkReply = (_bulkQueryContext != 0 && ns->context == _bulkQueryContext);
+    bool isFinal = (ns->type == NSTAT_MSG_TYPE_SUCCESS || ns->type == NSTAT_MSG_TYPE_ERROR);
+
+    if (pending != 0L) {
+      if (isBulkReply && !isFinal) {
+        // bulk query gets many SRC_COUNTS, then SUCCESS.  Keep request until then.
+        pending->tsSentMs = NTStatMonotonicMs();
+      } else {
+        req = *pending;
+        _removeInFlight(*pending);
+      }
+    }
+
+    // adjust request window
+
+    if (_isErrorNoBufs(msg)) {
+      _onRequestDropped(req);
+      _retryRequest(req);
+    } else if (req.context != 0) {
+      _onRequestAcked();
+    }
+
+    if (isBulkReply && isFinal) _handleBulkQueryReply(msg);
+
+    // until we are in RUNNING state, handle changes
+
+    if (_state != STATE_RUNNING && (ns->type == NSTAT_MSG_TYPE_ERROR || ns->type == NSTAT_MSG_TYPE_SUCCESS))
+    {
+      return _handleState(msg, req);
+    }
+    
+    switch (ns->type)
+    {
+
+      case NSTAT_MSG_TYPE_SRC_ADDED:
+      {
+        // it's possible to get SRC_ADDED for one that you already have.
+        // SRC_ADDED are typically sent (resent) right before the SRC_REMOVED
+
+        NetstatSource* src = _resetSource(srcRef, providerId);
+        if (src != 0L && msg.providerKind == NTSTAT_PROVIDER_KIND_IFNET && src->_iface == 0L)
+          src->_iface = new NTStatInterface();
+        if (src != 0L && !src->_haveDesc)
+          addToWaitingForDescQueue(src);
+
+        // reply to our ADD_SRC for an interface
+
+        if (req.type == NSTAT_MSG_TYPE_ADD_SRC) _onInterfaceAddDone();
+
+      }
+      break;
+      case NSTAT_MSG_TYPE_SRC_REMOVED:
+      {
+        NetstatSource* source = _lookupSource(srcRef);
+
+        if (source != 0L) {
+          _markSourceForRemove(source);
+          removeFromWaitingForDescQueue(source);
+
+          if (source->_iface == 0L && !(source->obj.key.lport == 0 && source->obj.key.rport == 0) && !source->_filteredOut) {
+            _notifyRemoved(source);
+          }
+        }
+      }
+      break;
+      case NSTAT_MSG_TYPE_SRC_DESC:
+      {
+        NetstatSource* source = _lookupSource(srcRef);
+
+        if (source != 0L)
+        {
+          removeFromWaitingForDescQueue(source);
+
+          if (source->_iface != 0L)
+          {
+            if (handler->readInterfaceDesc(msg, source->_iface)) _onInterfaceDesc(source, false);
+          }
+          else if (handler->readSrcDesc(msg, &source->obj))
+          {
+            _onSourceDesc(source);
+          } else {
+            LOG_DEBUG(("E not TCP or UDP provider:%u\n", providerId));
+          }
+        } else {
+          LOG_ERROR(("desc before src defined\n"));
+        }
+      }
+      break;
+      case NSTAT_MSG_TYPE_SRC_UPDATE:
+      {
+        // descriptor and counts (xnu-4570+)
+
+        NetstatSource* source = _lookupSource(srcRef);
+        if (source != 0L)
+        {
+          removeFromWaitingForDescQueue(source);
+
+          bool notifiedAdded = source->_haveNotifiedAdded;
+
+          if (source->_iface != 0L)
+          {
+            if (handler->readInterfaceUpdate(msg, source->_iface)) _onInterfaceDesc(source, true);
+            source->_tsLastUpdate = time(NULL);
+            source->_requestedCount = false;
+          }
+          else if (handler->readUpdate(msg, &source->obj))
+          {
+            _onSourceDesc(source);
+
+            if (notifiedAdded && !source->_filteredOut && source->_requestedCount && (source->obj.stats.rxpackets > 0 || source->obj.stats.txpackets > 0))
+              _notifyStatsUpdate(source);
+
+            source->_tsLastUpdate = time(NULL);
+            source->_requestedCount = false;
+          } else {
+            LOG_DEBUG(("E not TCP or UDP provider:%u\n", providerId));
+          }
+        } else {
+          LOG_ERROR(("update before src defined\n"));
+        }
+      }
+      break;
+      case NSTAT_MSG_TYPE_SRC_COUNTS:
+      {
+        NetstatSource* source = _lookupSource(srcRef);
+        if (source != 0L && source->_iface != 0L) {
+
+          // interfaces report all counts: polled, and each threshold crossed
+
+          handler->readCounts(msg, source->_iface->stats);
+          if (source->_haveDesc) _notifyInterfaceUpdate(source);
+
+          source->_tsLastUpdate = time(NULL);
+          source->_requestedCount = false;
+        }
+        else if (source != 0L) {
+
+          handler->readCounts(msg, source->obj.stats);
+
+          if (source->_haveDesc && !source->_filteredOut) {
+
+            if (source->_requestedCount && (source->obj.stats.rxpackets > 0 || source->obj.stats.txpackets > 0))
+                _notifyStatsUpdate(source);
+
+          } else {
+            // typically we receive ADDED,COUNTS,DESC,REMOVED
+            // So if we don't have DESC, we can't report anything yet.
+          }
+
+          // update count state
+
+          source->_tsLastUpdate = time(NULL);
+          source->_requestedCount = false;
+        }
+        else {
+          LOG_ERROR(("counts before src defined\n"));
+        }
+      }
+      break;
+      case NSTAT_MSG_TYPE_SUCCESS:
+      {
+        // the success message doesn't tell us anything.. have to lookup request to get context (done above)
+        
+        if (req.context != 0)
+        {
+
+        } else {
+          LOG_DEBUG(("E unhandled success response\n"));
+        }
+      }
+      break;
+
+      case NSTAT_MSG_TYPE_ERROR:
+      {
+        int err = _getAndLogError(msg, req);
+        return (NOT_FATAL(err) ? 0 : -1);
+      }
+      default:
+        LOG_ERROR(("E unknown message type:%d\n", ns->type));
+        return -1;
+    }
+
+    return 0;
+  }
+
+  void enqueueRequestForSrcDesc(NetstatSource* source)
+  {
+    // first check to make sure we don't already have a request queued
+
+    if (source->_descRequestQueued) return;
+
+    // don't have any matching outstanding requests, so send it
+
+    _workingMsg.ntsrc = source;
+    _structHandler->writeSrcDesc(*this, source->_providerId, source->_srcRef);
+  }
+
+  virtual void stop()
+  {
+    _keepRunning = false;
+    if (_transport != 0L) _transport->interrupt();
+  }
+
+  //----------------------------------------------------------
+  // enableRecording()
+  //----------------------------------------------------------
+  virtual void enableRecording()
+  {
+    char filename[64];
+    sprintf(filename, "ntstat-xnu-%d.bin", getXnuVersion());
+
+    _recordFd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_SYNC, 0664);
+    if (_recordFd <= 0) {
+      printf("ERROR: unable to open %s for writing\n", filename);
+      return;
+    }
+    _recordEnabled = true;
+  }
+
+  //----------------------------------------------------------
+  // emulate run() without an actual kernel connection by
+  // reading and processing ntstat messages from file
+  //----------------------------------------------------------
+  virtual void runRecording(char *filename, unsigned int xnuVersion)
+  {
+    uint32_t lastMsgTimestamp = 0;
+    _recordFd = open(filename, O_RDONLY);
+    if (_recordFd <= 0) {
+      printf("ERROR: unable to open %s for reading\n", filename);
+      return;
+    }
+
+    _loadStructHandler(xnuVersion);
+
+    // By default, use running state.  We try to detect based on first message below
+
+    _state = STATE_RUNNING;
+
+    int replayMsgCount = 0;
+    while (true)
+    {
+      uint32_t msgTimestamp;
+      uint32_t msgLength;
+
+      // read timestamp
+      int num_bytes = (int)read(_recordFd, &msgTimestamp, sizeof(msgTimestamp));
+      if (num_bytes < sizeof(msgTimestamp)) {
+        // end of file?
+        break;
+      }
+
+      num_bytes = (int)read(_recordFd, &msgLength, sizeof(msgLength));
+      if (num_bytes < sizeof(msgLength)) {
+        printf("ERROR: invalid replay header\n");
+        break;
+      }
+
+      // sanity check
+      if (msgLength > _rxMsgs[0].capacity) _metrics.msgsTruncated++;
+      if (msgLength < sizeof(nstat_msg_hdr) ||  msgLength > _rxMsgs[0].capacity) {
+        printf("ERROR: invalid length in recorded message: %d\n", msgLength);
+        break;
+      }
+
+      // read message into the receive arena
+      nstat_msg_hdr *hdr = (nstat_msg_hdr*)_rxMsgs[0].data;
+      num_bytes = (int)read(_recordFd, _rxMsgs[0].data, msgLength);
+
+      if (num_bytes != msgLength) {
+        printf("WARN: partial msg in recording\n");
+        break;
+      }
+
+      // if first message in file is an ADD_ALL, then assume it contains the start of a session
+
+      if (replayMsgCount == 0 && (hdr->type == NSTAT_MSG_TYPE_ADD_ALL_SRCS || hdr->type == NSTAT_MSG_TYPE_ADD_SRC)) _state = STATE_START;
+
+      replayMsgCount++;
+
+      switch(hdr->type) {
+        case NSTAT_MSG_TYPE_ADD_SRC:
+        case NSTAT_MSG_TYPE_QUERY_SRC:
+        case NSTAT_MSG_TYPE_GET_SRC_DESC:
+        case NSTAT_MSG_TYPE_GET_UPDATE:
+        case NSTAT_MSG_TYPE_ADD_ALL_SRCS:
+        case NSTAT_MSG_TYPE_REM_SRC:
+        {
+          // this is a request
+
+          InFlightReq &req = _addInFlight(_structHandler, hdr, msgLength, 0, 0);
+          LOG_SENDRECV(("T SEND %s\n", _sprintMsg(hdr, req.srcRef).c_str()));
+        }
+        break;
+        default:
+          // response
+          int secDelay = msgTimestamp - lastMsgTimestamp;
+          if (secDelay > 0 && lastMsgTimestamp != 0) sleep(secDelay);  // try to somewhat emulate natural rate
+          _handleResponseMessage(_structHandler, hdr, msgLength);
+          break;
+      }
+
+      lastMsgTimestamp = msgTimestamp;
+      _publishMetrics();
+    }
+
+  }
+
+  //-------------------------------------------------------
+  // configure logging. Default flags == 0, no logging.
+  //-------------------------------------------------------
+  virtual void setLogging(uint8_t flags) { _logFlags = flags; }
+  
+  //-------------------------------------------------------
+  // returns the number of ENOBUFS errors received from kernel, indicating
+  // the inability to send some requested information due to full buffer.
+  // For example, attempting to send stream counts or descriptions.  The
+  // default send buffer size for kernel is 2048 bytes.
+  //-------------------------------------------------------
+  virtual uint32_t getNumDrops() { return _numDrops; }
+
+  virtual void setBulkCountsRefresh(bool enable) { _bulkCounts = enable; }
+
+  virtual void setMaxRequestsInFlight(uint32_t maxInFlight)
+  {
+    _maxWindow = (maxInFlight > 0 ? maxInFlight : 1);
+    if (_maxWindow > INFLIGHT_CAPACITY) _maxWindow = INFLIGHT_CAPACITY;
+    if (_window > _maxWindow) _window = _maxWindow;
+  }
+
+  // both wake the run loop, so a shorter value takes effect now (see _rearmShortenedDeadlines)
+
+  virtual void setRemovedStreamRetentionMs(uint32_t ms)
+  {
+    _removedRetentionMs = ms;
+    if (_transport != 0L) _transport->interrupt();
+  }
+
+  virtual void setRequestTimeoutMs(uint32_t ms)
+  {
+    _requestTimeoutMs = (ms > 0 ? ms : 1);
+    if (_transport != 0L) _transport->interrupt();
+  }
+
+  virtual void setSourceCapacityHint(uint32_t numSources)
+  {
+    _sources.reserve(numSources);
+    _map.reserve(numSources);
+    _keyIndex.reserve(numSources);
+  }
+
+  virtual void setInterfaceStats(bool enable, uint64_t thresholdBytes)
+  {
+    _wantInterfaces = enable;
+    _ifnetThreshold = (thresholdBytes > NTSTAT_IFNET_THRESHOLD_MIN ? thresholdBytes : NTSTAT_IFNET_THRESHOLD_MIN);
+  }
+
+  virtual bool getProcessStats(uint32_t pid, NTStatProcessStats &dest)
+  {
+    const NTStatProcessStats* proc = _procs.find(pid);
+    if (0L == proc) return false;
+    dest = *proc;
+    return true;
+  }
+
+  virtual void setTopTalkers(uint32_t maxEntries)
+  {
+    _topEntries = maxEntries;
+    for (uint32_t kind=0; kind < NTSTAT_TOP_NUM_KINDS; kind++)
+      for (int by=0; by < 2; by++) _top[kind][by].reset(maxEntries > 0 ? std::max(maxEntries * TOP_COUNTERS_PER_ENTRY, (uint32_t)TOP_COUNTERS_MIN) : 0);
+  }
+
+  virtual uint32_t getTopTalkers(uint32_t kind, uint32_t by, NTStatTopEntry *dest, uint32_t maxEntries)
+  {
+    if (kind >= NTSTAT_TOP_NUM_KINDS || by > NTSTAT_TOPBY_STREAMS || 0L == dest) return 0;
+    if (maxEntries > _topEntries) maxEntries = _topEntries;
+
+    _topScratch.resize(maxEntries);
+    uint32_t n = _top[kind][by].top(_topScratch.data(), maxEntries);
+    for (uint32_t i=0; i < n; i++) {
+      dest[i] = _topScratch[i].item;
+      dest[i].count = _topScratch[i].count;
+      dest[i].error = _topScratch[i].error;
+    }
+    return n;
+  }
+
+  virtual void setSnapshotInterval(uint32_t intervalMs) { _snapshotIntervalMs = intervalMs; }
+
+  virtual void setAsyncDispatch(uint32_t capacity, uint32_t overflowPolicy)
+  {
+    _asyncCapacity = capacity;
+    _overflowPolicy = (overflowPolicy <= NTSTAT_OVERFLOW_COALESCE ? overflowPolicy : NTSTAT_OVERFLOW_DROP_NEWEST);
+  }
+
+  virtual const NTStatSnapshot* acquireSnapshot() { return _snapshots.acquire(); }
+
+  virtual void releaseSnapshot(const NTStatSnapshot* snapshot) { _snapshots.release(snapshot); }
+
+  virtual bool getStream(const NTStatStreamKey &key, NTStatStream &dest)
+  {
+    const NetstatSource* source = _keyIndex.find(key);
+    if (0L == source) return false;
+    dest = source->obj;
+    return true;
+  }
+
+  virtual void getMetrics(NTStatClientMetrics &dest)
+  {
+    uint64_t words[METRICS_WORDS];
+    for (int i=0; i < METRICS_WORDS; i++) words[i] = _publishedMetrics[i].load(std::memory_order_relaxed);
+    memcpy(&dest, words, sizeof(dest));
+  }
+
+  //----------------------------------------------------------
+  // copy _metrics where getMetrics() can read it from another
+  // thread.  Word by word, each a relaxed atomic, so a reader
+  // may see counters from two publishes but never a torn one.
+  // Run thread only, once per pass through the run loop.
+  //----------------------------------------------------------
+  void _publishMetrics()
+  {
+    NTStatClientMetrics metrics = _metrics;
+    metrics.sourcesTracked = _sources.size();
+    metrics.requestWindow = (uint32_t)_window;
+    metrics.requestsInFlight = _numInFlight;
+
+    uint64_t words[METRICS_WORDS];
+    memcpy(words, &metrics, sizeof(metrics));
+    for (int i=0; i < METRICS_WORDS; i++) _publishedMetrics[i].store(words[i], std::memory_order_relaxed);
+  }
+  
+  // private data members
+
+  NetworkStatisticsListener*    _listener;
+
+  SourceMap                     _map;
+  SourcePool                    _sources;
+  NetstatSource*                _removedHead;   // removed sources awaiting expiry, oldest first
+  NetstatSource*                _removedTail;
+
+  bool                          _keepRunning;
+
+  NTStatTransport*              _transport;
+
+  NTStatKernelStructHandler*    _structHandler;
+  RunLoopFn                     _runLoop;       // 0L: runLoop(_structHandler)
+  bool                          _virtualDispatch;
+
+  state_t                       _state;
+
+  NTStatRing<QMsg, OUTQ_CAPACITY> _outq;  // messages that need to be sent
+  bool                          _sendPaused;  // transport keeps failing sends, until TIMER_SEND_RETRY
+  uint32_t                      _sendFailStreak;
+
+  uint64_t                      _seqnum;  // request context, 0 is never used
+
+  InFlightReq                   _inflight[INFLIGHT_CAPACITY]; // requests waiting for response
+  uint32_t                      _numInFlight;
+
+  bool                          _wantTcp;
+  bool                          _wantUdp;
+  bool                          _wantKernel;
+  bool                          _wantInterfaces;
+  uint64_t                      _ifnetThreshold;
+  uint32_t                      _ifnetAddsPending;  // ADD_SRC not yet answered, in STATE_REQUEST_IFNET_SRC
+  
+  uint32_t                      _updateIntervalSeconds;
+  NTStatFilterConfig            _filter;
+
+  NTStatDeadlineQueue           _deadlines;
+
+  bool                          _recordEnabled;
+  int                           _recordFd;
+  uint32_t                      _numDrops;
+  uint32_t                      _numErrors;
+  
+  int                           _logFd;
+  uint8_t                       _logFlags;
+  
+  SourceMap                     _mapWaitingForDesc;
+  SourceMap                     _mapWaitingForCount;
+
+  // receive arena (see _sizeRxArena)
+
+  uint32_t                      _recvBufferBytes;   // SO_RCVBUF to ask for, 0 for system default
+  uint8_t*                      _rxArena;
+  uint32_t                      _rxSlotSize;
+  NTStatRecvMsg                 _rxMsgs[RECV_BATCH_SIZE];
+
+  // request window (AIMD)
+
+  double                        _window;
+  uint32_t                      _maxWindow;
+  uint64_t                      _decreaseMark;  // requestsSent at last decrease
+
+  // source retention and request timeouts
+
+  NTStatTimerWheel<WheelItem>   _wheel;
+  std::atomic<uint32_t>         _removedRetentionMs;
+  std::atomic<uint32_t>         _requestTimeoutMs;
+  uint32_t                      _armedRetentionMs;  // values wheel entries were last scheduled with
+  uint32_t                      _armedTimeoutMs;
+  uint64_t                      _rand;          // poll jitter
+
+  // bulk counts refresh
+
+  bool                          _bulkCounts;
+  bool                          _bulkQueryRejected;   // kernel said no, per-source from now on
+  bool                          _bulkContinuation;    // query uses NSTAT_MSG_HDR_FLAG_CONTINUATION
+  uint64_t                      _bulkQueryContext;    // 0 if no bulk query in progress
+
+  NTStatClientMetrics           _metrics;       // run thread only
+  std::atomic<uint64_t>         _publishedMetrics[METRICS_WORDS];   // see _publishMetrics()
+
+  NTStatProcessTable            _procs;     // per-process totals
+  SourceKeyIndex                _keyIndex;  // flow lookups for getStream()
+
+  // heavy hitters, see setTopTalkers().  Counting several times more keys
+  // than are reported keeps the reported ones accurate unless traffic is
+  // spread evenly over more keys than counters.
+
+  enum { TOP_COUNTERS_PER_ENTRY = 8, TOP_COUNTERS_MIN = 256 };
+  typedef NTStatTopK<NTStatTopEntry> TopTalkers;
+
+  uint32_t                      _topEntries;    // 0 if off
+  TopTalkers                    _top[NTSTAT_TOP_NUM_KINDS][2];    // [kind][by]
+  std::vector<TopTalkers::Counter> _topScratch;
+
+  uint32_t                      _snapshotIntervalMs;  // 0 if off
+  uint64_t                      _snapshotSeq;
+  NTStatSnapshotPublisher       _snapshots;
+
+  // async dispatch, see setAsyncDispatch().  _events is 0L when off.
+
+  uint32_t                      _asyncCapacity;
+  uint32_t                      _overflowPolicy;      // NTSTAT_OVERFLOW_*
+  EventRing*                    _events;
+  std::vector<NTStatEvent>      _backlog;             // COALESCE only, waiting for ring space
+  uint64_t                      _backlogBase;         // sequence of the oldest in _backlog
+  uint32_t                      _backlogSize;
+  NTStatFlatMap<uint64_t>       _backlogUpdates;      // srcRef -> sequence of its backlogged update
+  std::thread                   _dispatchThread;
+  std::mutex                    _dispatchMutex;       // only to park the dispatch thread
+  std::condition_variable       _dispatchWake;
+  std::atomic<bool>             _dispatchParked;      // waiting on _dispatchWake, or about to
+  std::atomic<bool>             _dispatchStop;
+
+};
+
+} // namespace ntstat_client
+
+#endif // _NT_STAT_CLIENT_IMPL_H_
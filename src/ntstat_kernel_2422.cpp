@@ -7,11 +7,13 @@
 
 #include "ntstat_kernel_2422.h"
 
+#include <stdio.h>
 #include <string.h>
+#include <stddef.h> // offsetof
 #include <vector>
 using namespace std;
 
-class NTStatKernel2422 : public NTStatKernelStructHandler
+class NTStatKernel2422 final : public NTStatKernelStructHandler
 {
 public:
   virtual bool isProviderTcp(uint64_t providerId){
@@ -50,6 +52,22 @@ public:
     dest.send(&msg.hdr, sizeof(msg));
   }
 
+  //--------------------------------------------------------------------
+  // write QUERY_SRC for all sources.  No continuation before xnu-3248.
+  //--------------------------------------------------------------------
+  virtual bool writeQueryAllSrc(MsgDest &dest, uint64_t continueContext)
+  {
+    writeQuerySrc(dest, NSTAT_SRC_REF_ALL);
+    return false;
+  }
+
+  //--------------------------------------------------------------------
+  // no GET_UPDATE before xnu-4570
+  //--------------------------------------------------------------------
+  virtual bool supportsUpdate() { return false; }
+  virtual void writeGetUpdate(MsgDest &dest, uint64_t srcRef) { }
+  virtual bool readUpdate(const NTStatMsgView &msg, NTStatStream* dest ) { return false; }
+
   //--------------------------------------------------------------------
   // write ADD_ADD_SRCS message to dest
   //--------------------------------------------------------------------
@@ -66,65 +84,132 @@ public:
 
   // xnu-3789 is first time we see split _KERNEL and _USERLAND
 
-  virtual void writeAddAllTcpSrc(MsgDest &dest) {
+  virtual void writeAddAllTcpSrc(MsgDest &dest, const NTStatFilterConfig &filter) {
     writeAddAllSrc(dest, NSTAT_PROVIDER_TCP);
   }
 
-  virtual void writeAddAllUdpSrc(MsgDest &dest) {
+  virtual void writeAddAllUdpSrc(MsgDest &dest, const NTStatFilterConfig &filter) {
     writeAddAllSrc(dest, NSTAT_PROVIDER_UDP);
   }
 
-  virtual void writeAddAllInterfaces(MsgDest &dest) {
-    writeAddAllSrc(dest, NSTAT_PROVIDER_IFNET);
+  // no provider filters in ADD_ALL_SRCS before xnu-3248
+
+  virtual uint32_t kernelFilters() { return 0; }
+
+  // no NSTAT_MAX_MSG_SIZE yet.  Largest message is SRC_DESC, well under this.
+  virtual uint32_t maxMsgSize() { return 2048; }
+
+  //--------------------------------------------------------------------
+  // write ADD_SRC for interface ifindex to dest.  The ifnet provider
+  // has no ADD_ALL_SRCS.
+  //--------------------------------------------------------------------
+  virtual void writeAddInterfaceSrc(MsgDest &dest, uint32_t ifindex, uint64_t threshold)
+  {
+    // provider parameters follow the request
+
+    uint8_t buf[offsetof(nstat_msg_add_src_req, param) + sizeof(nstat_ifnet_add_param)] __attribute__((aligned(8)));
+    memset(buf, 0, sizeof(buf));
+
+    nstat_msg_add_src_req* msg = (nstat_msg_add_src_req*)buf;
+    nstat_ifnet_add_param* param = (nstat_ifnet_add_param*)msg->param;
+
+    msg->hdr.type = NSTAT_MSG_TYPE_ADD_SRC;
+    msg->hdr.length = sizeof(buf);
+    msg->hdr.context = dest.seqnum();
+    msg->provider = NSTAT_PROVIDER_IFNET;
+    param->ifindex = ifindex;
+    param->threshold = threshold;
+
+    dest.send(&msg->hdr, sizeof(buf));
   }
 
   //--------------------------------------------------------------------
-  // extract srcRef, providerId (if possible) from message
+  // provider id to NTSTAT_PROVIDER_KIND_
   //--------------------------------------------------------------------
-  virtual void getSrcRef(nstat_msg_hdr* msg, int structlen, uint64_t &srcRef, uint32_t &providerId) {
+  uint32_t providerKind(uint32_t providerId)
+  {
+    switch (providerId)
+    {
+      case NSTAT_PROVIDER_TCP: return NTSTAT_PROVIDER_KIND_TCP;
+      case NSTAT_PROVIDER_UDP: return NTSTAT_PROVIDER_KIND_UDP;
+      case NSTAT_PROVIDER_IFNET: return NTSTAT_PROVIDER_KIND_IFNET;
+      default: return NTSTAT_PROVIDER_KIND_OTHER;
+    }
+  }
+
+  // bytes of descriptor after SRC_DESC (or SRC_UPDATE) data
+
+  size_t descriptorSize(uint32_t providerKind)
+  {
+    switch (providerKind)
+    {
+      case NTSTAT_PROVIDER_KIND_TCP: return sizeof(nstat_tcp_descriptor);
+      case NTSTAT_PROVIDER_KIND_UDP: return sizeof(nstat_udp_descriptor);
+      case NTSTAT_PROVIDER_KIND_IFNET: return sizeof(nstat_ifnet_descriptor);
+      default: return 0;
+    }
+  }
+
+  //--------------------------------------------------------------------
+  // decode srcRef, providerId (if possible) from message, checking
+  // length against the struct for its type
+  //--------------------------------------------------------------------
+  virtual bool decode(nstat_msg_hdr* msg, int length, NTStatMsgView &view)
+  {
+    if (!view.reset(msg, length)) return false;
+
     switch(msg->type)
     {
       case NSTAT_MSG_TYPE_SRC_COUNTS:
-        srcRef = ((nstat_msg_src_counts*)msg)->srcref;
+        if (length < (int)sizeof(nstat_msg_src_counts)) return false;
+        view.srcRef = ((nstat_msg_src_counts*)msg)->srcref;
         break;
       case NSTAT_MSG_TYPE_SRC_DESC:
-        srcRef = ((nstat_msg_src_description*)msg)->srcref;
-        providerId = ((nstat_msg_src_description*)msg)->provider;
-        break;
+      {
+        nstat_msg_src_description* desc = (nstat_msg_src_description*)msg;
+        if (length < (int)offsetof(nstat_msg_src_description, data)) return false;
+        view.srcRef = desc->srcref;
+        view.providerId = desc->provider;
+        view.providerKind = providerKind(desc->provider);
+        return (length >= (int)(offsetof(nstat_msg_src_description, data) + descriptorSize(view.providerKind)));
+      }
       case NSTAT_MSG_TYPE_SRC_ADDED:
-        srcRef = ((nstat_msg_src_added*)msg)->srcref;
-        providerId = ((nstat_msg_src_added*)msg)->provider;
+        if (length < (int)sizeof(nstat_msg_src_added)) return false;
+        view.srcRef = ((nstat_msg_src_added*)msg)->srcref;
+        view.providerId = ((nstat_msg_src_added*)msg)->provider;
+        view.providerKind = providerKind(view.providerId);
         break;
       case NSTAT_MSG_TYPE_SRC_REMOVED:
-        srcRef = ((nstat_msg_src_removed*)msg)->srcref;
+        if (length < (int)sizeof(nstat_msg_src_removed)) return false;
+        view.srcRef = ((nstat_msg_src_removed*)msg)->srcref;
         break;
       case NSTAT_MSG_TYPE_QUERY_SRC:
-        srcRef = ((nstat_msg_query_src*)msg)->srcref;
+        if (length < (int)sizeof(nstat_msg_query_src_req)) return false;
+        view.srcRef = ((nstat_msg_query_src_req*)msg)->srcref;
         break;
       case NSTAT_MSG_TYPE_GET_SRC_DESC:
-        srcRef = ((nstat_msg_get_src_description*)msg)->srcref;
+        if (length < (int)sizeof(nstat_msg_get_src_description)) return false;
+        view.srcRef = ((nstat_msg_get_src_description*)msg)->srcref;
         break;
       case NSTAT_MSG_TYPE_REM_SRC:
-        srcRef = ((nstat_msg_rem_src*)msg)->srcref;
+        if (length < (int)sizeof(nstat_msg_rem_src_req)) return false;
+        view.srcRef = ((nstat_msg_rem_src_req*)msg)->srcref;
         break;
-      //case NSTAT_MSG_TYPE_ADD_SRC:
-      //case NSTAT_MSG_TYPE_ADD_ALL_SRCS:
       default:
-        //printf("E getSrcRef not implemented for type %d\n", msg->type);
         break;
     }
+    return true;
   }
 
   //--------------------------------------------------------------------
   // populate dest with message data
   //--------------------------------------------------------------------
-  virtual bool readSrcDesc(nstat_msg_hdr*hdr, int structlen, NTStatStream* dest )
+  virtual bool readSrcDesc(const NTStatMsgView &msg, NTStatStream* dest )
   {
-    nstat_msg_src_description *msg = (nstat_msg_src_description*)hdr;
-    if (msg->provider == NSTAT_PROVIDER_TCP) {
-      readTcpSrcDesc(hdr, structlen, dest);
-    } else if (msg->provider == NSTAT_PROVIDER_UDP) {
-      readUdpSrcDesc(hdr, structlen, dest);
+    if (msg.providerKind == NTSTAT_PROVIDER_KIND_TCP) {
+      readTcpSrcDesc(msg.hdr, msg.length, dest);
+    } else if (msg.providerKind == NTSTAT_PROVIDER_KIND_UDP) {
+      readUdpSrcDesc(msg.hdr, msg.length, dest);
     } else {
       // ??
       return false;
@@ -135,20 +220,28 @@ public:
   //--------------------------------------------------------------------
   // populate dest with message ifnet data
   //--------------------------------------------------------------------
-  /*
-  virtual bool readSrcDesc(nstat_msg_hdr* hdr, int structlen, NTStatInterface* dest )
+  virtual bool readInterfaceDesc(const NTStatMsgView &msg, NTStatInterface* dest )
+  {
+    if (msg.providerKind != NTSTAT_PROVIDER_KIND_IFNET) return false;
+
+    nstat_msg_src_description *desc = (nstat_msg_src_description*)msg.hdr;
+    readIfnetDescriptor((nstat_ifnet_descriptor*)desc->data, dest);
+    return true;
+  }
+
+  virtual bool readInterfaceUpdate(const NTStatMsgView &msg, NTStatInterface* dest ) { return false; }
+
+  void readIfnetDescriptor(const nstat_ifnet_descriptor* ifnet, NTStatInterface* dest)
   {
-    nstat_msg_src_description *msg = (nstat_msg_src_description*)hdr;
-    if (msg->provider != NSTAT_PROVIDER_IFNET) return false;
-    
-    nstat_ifnet_descriptor* ifnet = (nstat_ifnet_descriptor*)msg->data;
-    dest->name = string(ifnet->name);
-    dest->description = string(ifnet->description);
     dest->ifindex = ifnet->ifindex;
     dest->type = ifnet->type;
-    
-    return false;
-  }*/
+    dest->threshold = ifnet->threshold;
+
+    // kernel strings may fill their arrays
+
+    snprintf(dest->name, sizeof(dest->name), "%.*s", (int)sizeof(ifnet->name), ifnet->name);
+    snprintf(dest->description, sizeof(dest->description), "%.*s", (int)sizeof(ifnet->description), ifnet->description);
+  }
   
   //--------------------------------------------------------------------
   // TCP: populate dest with message data
@@ -216,9 +309,9 @@ public:
   //--------------------------------------------------------------------
   // populate dest with message counts data
   //--------------------------------------------------------------------
-  virtual void readCounts(nstat_msg_hdr*hdr, int structlen, NTStatCounters& dest )
+  virtual void readCounts(const NTStatMsgView &view, NTStatCounters& dest )
   {
-    nstat_msg_src_counts *msg = (nstat_msg_src_counts*)hdr;
+    nstat_msg_src_counts *msg = (nstat_msg_src_counts*)view.hdr;
     dest.rxbytes = msg->counts.nstat_rxbytes;
     dest.txbytes = msg->counts.nstat_txbytes;
     dest.rxpackets = msg->counts.nstat_rxpackets;
@@ -237,3 +330,14 @@ public:
 NTStatKernelStructHandler* NewNTStatKernel2422() {
   return new NTStatKernel2422();
 }
+
+//--------------------------------------------------------------------
+// client run loop with NTStatKernel2422 calls resolved at compile time
+//--------------------------------------------------------------------
+
+#include "NetworkStatisticsClientImpl.hpp"
+
+void ntstat_client::RunLoop2422(NetworkStatisticsClientImpl* client, NTStatKernelStructHandler* handler)
+{
+  client->runLoop(static_cast<NTStatKernel2422*>(handler));
+}
@@ -53,6 +53,36 @@ enum
   ,NSTAT_SRC_REF_INVALID  = 0
 };
 
+enum
+{
+  NSTAT_FILTER_ACCEPT_UNKNOWN          = 0x00000001
+  ,NSTAT_FILTER_ACCEPT_LOOPBACK        = 0x00000002
+  ,NSTAT_FILTER_ACCEPT_CELLULAR        = 0x00000004
+  ,NSTAT_FILTER_ACCEPT_WIFI            = 0x00000008
+  ,NSTAT_FILTER_ACCEPT_WIRED           = 0x00000010
+  ,NSTAT_FILTER_ACCEPT_AWDL            = 0x00000020
+  ,NSTAT_FILTER_ACCEPT_EXPENSIVE       = 0x00000040
+  ,NSTAT_FILTER_IFNET_FLAGS            = 0x000000FF
+
+  ,NSTAT_FILTER_TCP_NO_LISTENER        = 0x00001000
+  ,NSTAT_FILTER_TCP_ONLY_LISTENER      = 0x00002000
+  ,NSTAT_FILTER_TCP_INTERFACE_ATTACH   = 0x00004000
+  ,NSTAT_FILTER_TCP_NO_EARLY_CLOSE     = 0x00008000
+  ,NSTAT_FILTER_TCP_FLAGS              = 0x0000F000
+
+  ,NSTAT_FILTER_UDP_INTERFACE_ATTACH   = 0x00010000
+  ,NSTAT_FILTER_UDP_FLAGS              = 0x000F0000
+
+  ,NSTAT_FILTER_SUPPRESS_SRC_ADDED     = 0x00100000
+  ,NSTAT_FILTER_REQUIRE_SRC_ADDED      = 0x00200000
+  ,NSTAT_FILTER_PROVIDER_NOZEROBYTES   = 0x00400000
+
+  ,NSTAT_FILTER_SPECIFIC_USER_BY_PID   = 0x01000000
+  ,NSTAT_FILTER_SPECIFIC_USER_BY_EPID  = 0x02000000
+  ,NSTAT_FILTER_SPECIFIC_USER_BY_UUID  = 0x04000000
+  ,NSTAT_FILTER_SPECIFIC_USER          = 0x07000000
+};
+
 
 #pragma pack(push, 4)
 #define __NSTAT_REVISION__      8
@@ -172,6 +202,12 @@ typedef struct nstat_udp_descriptor
   uint16_t        ifnet_properties;
 } nstat_udp_descriptor;
 
+typedef struct nstat_ifnet_add_param
+{
+  u_int32_t                       ifindex;
+  u_int64_t                       threshold;
+} nstat_ifnet_add_param;
+
 typedef struct nstat_ifnet_desc_cellular_status
 {
   u_int32_t valid_bitmask; /* indicates which fields are valid */
@@ -7,20 +7,29 @@
 
 #include "ntstat_kernel_4570.h"
 
+#include <stdio.h>
 #include <string.h>
+#include <stddef.h> // offsetof
 #include <vector>
 #include <string>
 using namespace std;
 
-class NTStatKernel4570 : public NTStatKernelStructHandler
+static const NTStatProviderFilterFlags PROVIDER_FILTER_FLAGS = {
+  NSTAT_FILTER_ACCEPT_UNKNOWN, NSTAT_FILTER_ACCEPT_LOOPBACK, NSTAT_FILTER_ACCEPT_CELLULAR,
+  NSTAT_FILTER_ACCEPT_WIFI, NSTAT_FILTER_ACCEPT_WIRED,
+  NSTAT_FILTER_TCP_NO_LISTENER, NSTAT_FILTER_PROVIDER_NOZEROBYTES,
+  NSTAT_FILTER_SPECIFIC_USER_BY_PID
+};
+
+class NTStatKernel4570 final : public NTStatKernelStructHandler
 {
 public:
 
   virtual bool isProviderTcp(uint64_t providerId){
-    return (NSTAT_PROVIDER_TCP_KERNEL == providerId)||(NSTAT_PROVIDER_TCP_USERLAND);}
+    return (NSTAT_PROVIDER_TCP_KERNEL == providerId)||(NSTAT_PROVIDER_TCP_USERLAND == providerId);}
 
   virtual bool isProviderUdp(uint64_t providerId) {
-    return (NSTAT_PROVIDER_UDP_KERNEL == providerId)||(NSTAT_PROVIDER_UDP_USERLAND);}
+    return (NSTAT_PROVIDER_UDP_KERNEL == providerId)||(NSTAT_PROVIDER_UDP_USERLAND == providerId);}
 
   virtual bool isProviderInterface(uint64_t providerId) { return NSTAT_PROVIDER_IFNET == providerId; }
 
@@ -52,76 +61,204 @@ public:
     dest.send(&msg.hdr, sizeof(msg));
   }
 
+  //--------------------------------------------------------------------
+  // write QUERY_SRC for all sources, in chunks
+  //--------------------------------------------------------------------
+  virtual bool writeQueryAllSrc(MsgDest &dest, uint64_t continueContext)
+  {
+    nstat_msg_query_src_req msg = nstat_msg_query_src_req();
+
+    NTSTAT_MSG_HDR(msg, dest, NSTAT_MSG_TYPE_QUERY_SRC);
+
+    msg.hdr.flags = NSTAT_MSG_HDR_FLAG_CONTINUATION;
+    if (continueContext != 0) msg.hdr.context = continueContext;
+    msg.srcref = NSTAT_SRC_REF_ALL;
+
+    dest.send(&msg.hdr, sizeof(msg));
+    return true;
+  }
+
+  //--------------------------------------------------------------------
+  // write GET_UPDATE message to dest.  Same struct as QUERY_SRC.
+  //--------------------------------------------------------------------
+  virtual bool supportsUpdate() { return true; }
+
+  virtual void writeGetUpdate(MsgDest &dest, uint64_t srcRef)
+  {
+    nstat_msg_query_src_req msg = nstat_msg_query_src_req();
+
+    NTSTAT_MSG_HDR(msg, dest, NSTAT_MSG_TYPE_GET_UPDATE);
+
+    msg.srcref= srcRef;
+
+    dest.send(&msg.hdr, sizeof(msg));
+  }
+
   //--------------------------------------------------------------------
   // write ADD_ADD_SRCS message to dest
   //--------------------------------------------------------------------
-  virtual void writeAddAllSrc(MsgDest &dest, uint32_t providerId)
+  virtual void writeAddAllSrc(MsgDest &dest, uint32_t providerId, uint64_t filter = 0, uint32_t targetPid = 0)
   {
     nstat_msg_add_all_srcs msg = nstat_msg_add_all_srcs();
 
     NTSTAT_MSG_HDR(msg, dest, NSTAT_MSG_TYPE_ADD_ALL_SRCS);
 
     msg.provider = providerId ;
+    msg.filter = filter;
+    msg.target_pid = targetPid;
 
     dest.send(&msg.hdr, sizeof(msg));
   }
 
   // xnu-3789 is first time we see split _KERNEL and _USERLAND
 
-  virtual void writeAddAllTcpSrc(MsgDest &dest) {
-      writeAddAllSrc(dest, NSTAT_PROVIDER_TCP_KERNEL);
+  virtual void writeAddAllTcpSrc(MsgDest &dest, const NTStatFilterConfig &filter) {
+      writeAddAllSrc(dest, NSTAT_PROVIDER_TCP_KERNEL, NTStatProviderFilter(PROVIDER_FILTER_FLAGS, filter, true), filter.pid);
     //writeAddAllSrc(dest, NSTAT_PROVIDER_TCP_USERLAND);
   }
 
-  virtual void writeAddAllUdpSrc(MsgDest &dest) {
-      writeAddAllSrc(dest, NSTAT_PROVIDER_UDP_KERNEL);
+  virtual void writeAddAllUdpSrc(MsgDest &dest, const NTStatFilterConfig &filter) {
+      writeAddAllSrc(dest, NSTAT_PROVIDER_UDP_KERNEL, NTStatProviderFilter(PROVIDER_FILTER_FLAGS, filter, false), filter.pid);
     //writeAddAllSrc(dest, NSTAT_PROVIDER_UDP_USERLAND);
   }
 
-  virtual void writeAddAllInterfaces(MsgDest &dest) {
-    writeAddAllSrc(dest, NSTAT_PROVIDER_IFNET);
+  virtual uint32_t kernelFilters() {
+    return NTSTAT_KFILTER_INTERFACES | NTSTAT_KFILTER_LISTENERS | NTSTAT_KFILTER_ZEROBYTES | NTSTAT_KFILTER_PID;
+  }
+
+  virtual uint32_t maxMsgSize() { return NSTAT_MAX_MSG_SIZE; }
+
+  //--------------------------------------------------------------------
+  // write ADD_SRC for interface ifindex to dest.  The ifnet provider
+  // has no ADD_ALL_SRCS.
+  //--------------------------------------------------------------------
+  virtual void writeAddInterfaceSrc(MsgDest &dest, uint32_t ifindex, uint64_t threshold)
+  {
+    // provider parameters follow the request
+
+    uint8_t buf[offsetof(nstat_msg_add_src_req, param) + sizeof(nstat_ifnet_add_param)] __attribute__((aligned(8)));
+    memset(buf, 0, sizeof(buf));
+
+    nstat_msg_add_src_req* msg = (nstat_msg_add_src_req*)buf;
+    nstat_ifnet_add_param* param = (nstat_ifnet_add_param*)msg->param;
+
+    msg->hdr.type = NSTAT_MSG_TYPE_ADD_SRC;
+    msg->hdr.length = sizeof(buf);
+    msg->hdr.context = dest.seqnum();
+    msg->provider = NSTAT_PROVIDER_IFNET;
+    param->ifindex = ifindex;
+    param->threshold = threshold;
+
+    dest.send(&msg->hdr, sizeof(buf));
   }
   
 
   //--------------------------------------------------------------------
-  // extract srcRef, providerId (if possible) from message
+  // provider id to NTSTAT_PROVIDER_KIND_
+  //--------------------------------------------------------------------
+  uint32_t providerKind(uint32_t providerId)
+  {
+    switch (providerId)
+    {
+      case NSTAT_PROVIDER_TCP_KERNEL:
+      case NSTAT_PROVIDER_TCP_USERLAND: return NTSTAT_PROVIDER_KIND_TCP;
+      case NSTAT_PROVIDER_UDP_KERNEL:
+      case NSTAT_PROVIDER_UDP_USERLAND: return NTSTAT_PROVIDER_KIND_UDP;
+      case NSTAT_PROVIDER_IFNET: return NTSTAT_PROVIDER_KIND_IFNET;
+      default: return NTSTAT_PROVIDER_KIND_OTHER;
+    }
+  }
+
+  // bytes of descriptor after SRC_DESC (or SRC_UPDATE) data
+
+  size_t descriptorSize(uint32_t providerKind)
+  {
+    switch (providerKind)
+    {
+      case NTSTAT_PROVIDER_KIND_TCP: return sizeof(nstat_tcp_descriptor);
+      case NTSTAT_PROVIDER_KIND_UDP: return sizeof(nstat_udp_descriptor);
+      case NTSTAT_PROVIDER_KIND_IFNET: return sizeof(nstat_ifnet_descriptor);
+      default: return 0;
+    }
+  }
+
+  //--------------------------------------------------------------------
+  // decode srcRef, providerId (if possible) from message, checking
+  // length against the struct for its type
   //--------------------------------------------------------------------
-  virtual void getSrcRef(nstat_msg_hdr* msg, int structlen, uint64_t &srcRef, uint32_t &providerId) {
+  virtual bool decode(nstat_msg_hdr* msg, int length, NTStatMsgView &view)
+  {
+    if (!view.reset(msg, length)) return false;
+
     switch(msg->type)
     {
       case NSTAT_MSG_TYPE_SRC_COUNTS:
-        srcRef = ((nstat_msg_src_counts*)msg)->srcref;
+        if (length < (int)sizeof(nstat_msg_src_counts)) return false;
+        view.srcRef = ((nstat_msg_src_counts*)msg)->srcref;
         break;
       case NSTAT_MSG_TYPE_SRC_DESC:
-        srcRef = ((nstat_msg_src_description*)msg)->srcref;
-        providerId = ((nstat_msg_src_description*)msg)->provider;
-        break;
+      {
+        nstat_msg_src_description* desc = (nstat_msg_src_description*)msg;
+        if (length < (int)offsetof(nstat_msg_src_description, data)) return false;
+        view.srcRef = desc->srcref;
+        view.providerId = desc->provider;
+        view.providerKind = providerKind(desc->provider);
+        return (length >= (int)(offsetof(nstat_msg_src_description, data) + descriptorSize(view.providerKind)));
+      }
       case NSTAT_MSG_TYPE_SRC_ADDED:
-        srcRef = ((nstat_msg_src_added*)msg)->srcref;
-        providerId = ((nstat_msg_src_added*)msg)->provider;
+        if (length < (int)sizeof(nstat_msg_src_added)) return false;
+        view.srcRef = ((nstat_msg_src_added*)msg)->srcref;
+        view.providerId = ((nstat_msg_src_added*)msg)->provider;
+        view.providerKind = providerKind(view.providerId);
         break;
       case NSTAT_MSG_TYPE_SRC_REMOVED:
-        srcRef = ((nstat_msg_src_removed*)msg)->srcref;
+        if (length < (int)sizeof(nstat_msg_src_removed)) return false;
+        view.srcRef = ((nstat_msg_src_removed*)msg)->srcref;
+        break;
+      case NSTAT_MSG_TYPE_SRC_UPDATE:
+      {
+        nstat_msg_src_update* update = (nstat_msg_src_update*)msg;
+        if (length < (int)offsetof(nstat_msg_src_update, data)) return false;
+        view.srcRef = update->srcref;
+        view.providerId = update->provider;
+        view.providerKind = providerKind(update->provider);
+        return (length >= (int)(offsetof(nstat_msg_src_update, data) + descriptorSize(view.providerKind)));
+      }
+      case NSTAT_MSG_TYPE_GET_UPDATE:
+        if (length < (int)sizeof(nstat_msg_query_src_req)) return false;
+        view.srcRef = ((nstat_msg_query_src_req*)msg)->srcref;
+        break;
+      case NSTAT_MSG_TYPE_QUERY_SRC:
+        if (length < (int)sizeof(nstat_msg_query_src_req)) return false;
+        view.srcRef = ((nstat_msg_query_src_req*)msg)->srcref;
+        break;
+      case NSTAT_MSG_TYPE_GET_SRC_DESC:
+        if (length < (int)sizeof(nstat_msg_get_src_description)) return false;
+        view.srcRef = ((nstat_msg_get_src_description*)msg)->srcref;
+        break;
+      case NSTAT_MSG_TYPE_REM_SRC:
+        if (length < (int)sizeof(nstat_msg_rem_src_req)) return false;
+        view.srcRef = ((nstat_msg_rem_src_req*)msg)->srcref;
         break;
       default:
-        //printf("E getSrcRef not implemented for type %d\n", msg->type);
         break;
     }
+    return true;
   }
 
 
   //--------------------------------------------------------------------
   // populate dest with message data
   //--------------------------------------------------------------------
-  virtual bool readSrcDesc(nstat_msg_hdr*hdr, int structlen, NTStatStream* dest )
+  virtual bool readSrcDesc(const NTStatMsgView &msg, NTStatStream* dest )
   {
-    nstat_msg_src_description *msg = (nstat_msg_src_description*)hdr;
-    if (msg->provider == NSTAT_PROVIDER_TCP_KERNEL || msg->provider == NSTAT_PROVIDER_TCP_USERLAND) {
-      readTcpSrcDesc(hdr, structlen, dest);
-    } else if (msg->provider == NSTAT_PROVIDER_UDP_KERNEL || msg->provider == NSTAT_PROVIDER_UDP_USERLAND) {
-      readUdpSrcDesc(hdr, structlen, dest);
+    if (msg.providerKind == NTSTAT_PROVIDER_KIND_TCP) {
+      readTcpSrcDesc(msg.hdr, msg.length, dest);
+    } else if (msg.providerKind == NTSTAT_PROVIDER_KIND_UDP) {
+      readUdpSrcDesc(msg.hdr, msg.length, dest);
     } else {
       // ??
+      return false;
     }
     return true;
   }
@@ -130,20 +267,36 @@ public:
   //--------------------------------------------------------------------
   // populate dest with message ifnet data
   //--------------------------------------------------------------------
-  /*
-  virtual bool readSrcDesc(nstat_msg_hdr* hdr, int structlen, NTStatInterface* dest )
+  virtual bool readInterfaceDesc(const NTStatMsgView &msg, NTStatInterface* dest )
+  {
+    if (msg.providerKind != NTSTAT_PROVIDER_KIND_IFNET) return false;
+
+    nstat_msg_src_description *desc = (nstat_msg_src_description*)msg.hdr;
+    readIfnetDescriptor((nstat_ifnet_descriptor*)desc->data, dest);
+    return true;
+  }
+
+  virtual bool readInterfaceUpdate(const NTStatMsgView &msg, NTStatInterface* dest )
+  {
+    if (msg.providerKind != NTSTAT_PROVIDER_KIND_IFNET) return false;
+
+    nstat_msg_src_update *update = (nstat_msg_src_update*)msg.hdr;
+    readIfnetDescriptor((nstat_ifnet_descriptor*)update->data, dest);
+    readCounts(update->counts, dest->stats);
+    return true;
+  }
+
+  void readIfnetDescriptor(const nstat_ifnet_descriptor* ifnet, NTStatInterface* dest)
   {
-    nstat_msg_src_description *msg = (nstat_msg_src_description*)hdr;
-    if (msg->provider != NSTAT_PROVIDER_IFNET) return false;
-    
-    nstat_ifnet_descriptor* ifnet = (nstat_ifnet_descriptor*)msg->data;
-    dest->name = string(ifnet->name);
-    dest->description = string(ifnet->description);
     dest->ifindex = ifnet->ifindex;
     dest->type = ifnet->type;
-    
-    return false;
-  }*/
+    dest->threshold = ifnet->threshold;
+
+    // kernel strings may fill their arrays
+
+    snprintf(dest->name, sizeof(dest->name), "%.*s", (int)sizeof(ifnet->name), ifnet->name);
+    snprintf(dest->description, sizeof(dest->description), "%.*s", (int)sizeof(ifnet->description), ifnet->description);
+  }
 
   //--------------------------------------------------------------------
   // TCP: populate dest with message data
@@ -151,7 +304,11 @@ public:
   virtual void readTcpSrcDesc(nstat_msg_hdr*hdr, int structlen, NTStatStream* dest )
   {
     nstat_msg_src_description *msg = (nstat_msg_src_description*)hdr;
-    nstat_tcp_descriptor*tcp = (nstat_tcp_descriptor*)msg->data;
+    readTcpDescriptor((nstat_tcp_descriptor*)msg->data, dest);
+  }
+
+  void readTcpDescriptor(nstat_tcp_descriptor* tcp, NTStatStream* dest)
+  {
 
     dest->key.ifindex = tcp->ifindex;
     dest->key.ipproto = IPPROTO_TCP;
@@ -184,7 +341,11 @@ public:
   virtual void readUdpSrcDesc(nstat_msg_hdr*hdr, int structlen, NTStatStream* dest )
   {
     nstat_msg_src_description *msg = (nstat_msg_src_description*)hdr;
-    nstat_udp_descriptor*udp = (nstat_udp_descriptor*)msg->data;
+    readUdpDescriptor((nstat_udp_descriptor*)msg->data, dest);
+  }
+
+  void readUdpDescriptor(nstat_udp_descriptor* udp, NTStatStream* dest)
+  {
 
     dest->key.ifindex = udp->ifindex;
     dest->key.ipproto = IPPROTO_UDP;
@@ -210,22 +371,46 @@ public:
   //--------------------------------------------------------------------
   // populate dest with message counts data
   //--------------------------------------------------------------------
-  virtual void readCounts(nstat_msg_hdr*hdr, int structlen, NTStatCounters& dest )
+  virtual void readCounts(const NTStatMsgView &view, NTStatCounters& dest )
   {
-    nstat_msg_src_counts *msg = (nstat_msg_src_counts*)hdr;
-    dest.rxbytes = msg->counts.nstat_rxbytes;
-    dest.txbytes = msg->counts.nstat_txbytes;
-    dest.rxpackets = msg->counts.nstat_rxpackets;
-    dest.txpackets = msg->counts.nstat_txpackets;
+    nstat_msg_src_counts *msg = (nstat_msg_src_counts*)view.hdr;
+    readCounts(msg->counts, dest);
+  }
+
+  void readCounts(const nstat_counts& counts, NTStatCounters& dest)
+  {
+    dest.rxbytes = counts.nstat_rxbytes;
+    dest.txbytes = counts.nstat_txbytes;
+    dest.rxpackets = counts.nstat_rxpackets;
+    dest.txpackets = counts.nstat_txpackets;
+
+    dest.cell_rxbytes = counts.nstat_cell_rxbytes;
+    dest.cell_txbytes = counts.nstat_cell_txbytes;
+
+    dest.wifi_rxbytes = counts.nstat_wifi_rxbytes;
+    dest.wifi_txbytes = counts.nstat_wifi_txbytes;
+
+    dest.wired_rxbytes = counts.nstat_wired_rxbytes;
+    dest.wired_txbytes = counts.nstat_wired_txbytes;
+  }
 
-    dest.cell_rxbytes = msg->counts.nstat_cell_rxbytes;
-    dest.cell_txbytes = msg->counts.nstat_cell_txbytes;
+  //--------------------------------------------------------------------
+  // SRC_UPDATE: descriptor and counts
+  //--------------------------------------------------------------------
+  virtual bool readUpdate(const NTStatMsgView &view, NTStatStream* dest )
+  {
+    nstat_msg_src_update *msg = (nstat_msg_src_update*)view.hdr;
 
-    dest.wifi_rxbytes = msg->counts.nstat_wifi_rxbytes;
-    dest.wifi_txbytes = msg->counts.nstat_wifi_txbytes;
+    if (view.providerKind == NTSTAT_PROVIDER_KIND_TCP) {
+      readTcpDescriptor((nstat_tcp_descriptor*)msg->data, dest);
+    } else if (view.providerKind == NTSTAT_PROVIDER_KIND_UDP) {
+      readUdpDescriptor((nstat_udp_descriptor*)msg->data, dest);
+    } else {
+      return false;
+    }
 
-    dest.wired_rxbytes = msg->counts.nstat_wired_rxbytes;
-    dest.wired_txbytes = msg->counts.nstat_wired_txbytes;
+    readCounts(msg->counts, dest->stats);
+    return true;
   }
 
 };
@@ -234,3 +419,14 @@ public:
 NTStatKernelStructHandler* NewNTStatKernel4570() {
   return new NTStatKernel4570();
 }
+
+//--------------------------------------------------------------------
+// client run loop with NTStatKernel4570 calls resolved at compile time
+//--------------------------------------------------------------------
+
+#include "NetworkStatisticsClientImpl.hpp"
+
+void ntstat_client::RunLoop4570(NetworkStatisticsClientImpl* client, NTStatKernelStructHandler* handler)
+{
+  client->runLoop(static_cast<NTStatKernel4570*>(handler));
+}